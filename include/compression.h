@@ -0,0 +1,41 @@
+/*****************************************************************************\
+** compression.h                                                             **
+** Transparent gzip/zstd compression of files                                **
+\*****************************************************************************/
+
+#ifndef __COMPRESSION_H__
+#define __COMPRESSION_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define COMPRESSION_NONE    (0)
+#define COMPRESSION_GZIP    (1)
+#define COMPRESSION_ZSTD    (2)     /* only if built with HAVE_ZSTD */
+
+/* returns the COMPRESSION_* value for "none", "gzip" or "zstd", or -1 if the
+   name isn't recognised or the compression isn't supported by this build */
+int parse_compression(const char *name);
+
+/* the suffix added to the names of compressed files, "" for none */
+const char *compression_suffix(int compression);
+
+/* returns the compression that the data starts with, from its magic bytes */
+int detect_compression(const uint8_t *data, size_t size);
+
+/* returns a stream that compresses everything written to it into file;
+   closing the stream finishes the compressed data and closes file. With
+   COMPRESSION_NONE, file itself is returned. Returns 0 on failure, in
+   which case file is left open */
+FILE *compress_stream(FILE *file, int compression);
+
+/* opens a file for writing, compressed if requested */
+FILE *fopen_compressed(const char *filename, int compression);
+
+/* returns a stream that reads file, decompressing it if it starts with
+   gzip or zstd magic bytes, and passing it through unchanged if not.
+   Closing the stream doesn't close file */
+FILE *decompress_stream(FILE *file);
+
+#endif  /* __COMPRESSION_H__ */
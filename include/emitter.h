@@ -0,0 +1,61 @@
+/*****************************************************************************\
+** emitter.h                                                                 **
+** Buffered text output for the exporters                                    **
+\*****************************************************************************/
+
+#ifndef __EMITTER_H__
+#define __EMITTER_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#define EMITTER_BUFFER_SIZE (65536)
+
+/* collects output in a large buffer and writes it to the file in big blocks,
+   formatting numbers itself rather than going through printf */
+typedef struct
+{
+    FILE *file;
+    size_t length;
+    char buffer[EMITTER_BUFFER_SIZE];
+} EMITTER;
+
+/* renders timestamps as strftime's "%FT%X", only re-rendering the seconds
+   while successive times stay within the same minute */
+typedef struct
+{
+    int utc;                    /* gmtime rather than localtime */
+    int patchable;              /* the text ends in the seconds digits */
+    time_t minute;              /* start of the minute in text */
+    time_t second;              /* time in text, -1 if none */
+    size_t length;
+    char text[32];
+} EMIT_TIME;
+
+void emit_init(EMITTER *out, FILE *file);
+
+/* writes out everything that has been emitted so far */
+void emit_flush(EMITTER *out);
+
+void emit_str(EMITTER *out, const char *str);
+
+void emit_char(EMITTER *out, char c);
+
+void emit_int(EMITTER *out, long value);
+
+/* zero pads the value to at least 'width' digits, like printf's "%0*lu" */
+void emit_padded(EMITTER *out, unsigned long value, int width);
+
+/* writes the value exactly as printf's "%.<decimals>f" would */
+void emit_fixed(EMITTER *out, double value, int decimals);
+
+/* for anything that isn't worth formatting by hand */
+void emit_printf(EMITTER *out, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+void emit_time_init(EMIT_TIME *cache, int utc);
+
+/* returns the text for the time, which stays valid until the next call */
+const char *emit_format_time(EMIT_TIME *cache, time_t t);
+
+#endif  /* __EMITTER_H__ */
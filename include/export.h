@@ -22,6 +22,25 @@
 #define OFFLINE_FORMAT_PWX  (0x00000010)
 #define OFFLINE_FORMAT_TCX  (0x00000020)
 
+/* an exporter that writes its format a record at a time, so that several
+   formats can be written in a single walk of the record list. begin writes
+   the header and returns the writer's state, or 0 if it has nothing (more) to
+   write; have_gps says whether the file has any GPS records, as a file that
+   is being streamed hasn't read them yet. record is then called for every record in the file, along with the
+   record's timeline sample if it has one, and finish writes the rest of the
+   file and frees the state. Writers may run on separate threads, so they
+   must not use static buffers (gmtime, localtime, create_filename) */
+typedef struct
+{
+    void *(*begin)(TTBIN_FILE *ttbin, FILE *file, int have_gps);
+    void (*record)(void *state, TTBIN_RECORD *record, const TTBIN_SAMPLE *sample);
+    void (*finish)(void *state);
+    int uses_columns;           /* ttbin->columns must be built beforehand */
+    int uses_laps;              /* and ttbin->laps */
+    int simplifies;             /* follows export_set_simplify, which also
+                                   needs ttbin->columns when it is enabled */
+} EXPORT_WRITER;
+
 typedef struct
 {
     uint32_t mask;
@@ -32,13 +51,61 @@ typedef struct
     int indoor_ok;
     void (*producer)(TTBIN_FILE* ttbin, FILE *file);
     void (*protobuf_producer)(PROTOBUF_FILE* ttbin, FILE *file);
+    const EXPORT_WRITER *writer;
 } OFFLINE_FORMAT;
 
 #define OFFLINE_FORMAT_COUNT    (6)
 extern const OFFLINE_FORMAT OFFLINE_FORMATS[OFFLINE_FORMAT_COUNT];
 
+/* the size of the buffer given to each export file */
+#define EXPORT_BUFFER_SIZE  (65536)
+
+extern const EXPORT_WRITER CSV_WRITER;
+extern const EXPORT_WRITER FIT_WRITER;
+extern const EXPORT_WRITER GPX_WRITER;
+extern const EXPORT_WRITER KML_WRITER;
+extern const EXPORT_WRITER TCX_WRITER;
+
+/* runs a single writer over the file */
+void export_with_writer(const EXPORT_WRITER *writer, TTBIN_FILE *ttbin, FILE *file);
+
+/* writes every format that has an entry in files (which is indexed like
+   OFFLINE_FORMATS), either on one thread per format or, if only one thread
+   is available, in a single walk of the record list; returns 0 if the
+   timeline couldn't be built, in which case nothing is written */
+int export_files(TTBIN_FILE *ttbin, FILE *const files[OFFLINE_FORMAT_COUNT]);
+
+/* converts a TTBIN file read from input to a single format as it arrives,
+   passing the records straight to the format's writer rather than building
+   the whole file in memory. Only the start of the file is held, until it is
+   known whether the format applies; treadmill activities and formats that
+   need the whole file are read in full and converted as usual. Compressed
+   input is decompressed as it is read. Returns 1 if
+   the file was converted, 0 if the format doesn't apply to the activity, or
+   -1 if the input couldn't be read or parsed (if that is only found part way
+   through, what has been written so far is left as it is) */
+int export_stream(FILE *input, uint32_t format, FILE *output);
+
+/* limits the number of threads export_files uses; 0 (the default) uses one
+   per processor, and 1 writes every format on the calling thread */
+void export_set_threads(unsigned threads);
+
+/* compresses the files written by export_formats (COMPRESSION_NONE,
+   COMPRESSION_GZIP or COMPRESSION_ZSTD), adding the compression's suffix
+   to their names */
+void export_set_compression(int compression);
+
+/* simplifies the tracks written by the GPX and KML exporters with
+   simplify_track, leaving out points that are within about 'tolerance'
+   metres of the simplified track; 0 (the default) writes every point */
+void export_set_simplify(double tolerance);
+
+double export_simplify_tolerance(void);
+
 void export_csv(TTBIN_FILE *ttbin, FILE *file);
 
+void export_fit(TTBIN_FILE *ttbin, FILE *file);
+
 void export_gpx(TTBIN_FILE *ttbin, FILE *file);
 
 void export_kml(TTBIN_FILE *ttbin, FILE *file);
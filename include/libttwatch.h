@@ -249,6 +249,12 @@ typedef int (*TTWATCH_DEVICE_ENUMERATOR)(TTWATCH *watch, void *data);
 ******************************************************************************/
 typedef void (*TTWATCH_FILE_ENUMERATOR)(uint32_t id, uint32_t size, void *data);
 
+/******************************************************************************
+* Callback function for ttwatch_read_whole_file_cb. Called with each block of *
+* file data as soon as it has been read from the watch.                       *
+******************************************************************************/
+typedef void (*TTWATCH_FILE_DATA_CALLBACK)(const void *data, uint32_t length, void *cbdata);
+
 /******************************************************************************
 * Callback function for ttwatch_enumerate_offline_formats.                    *
 ******************************************************************************/
@@ -383,6 +389,14 @@ int ttwatch_enumerate_files(TTWATCH *watch, uint32_t type, TTWATCH_FILE_ENUMERAT
 ******************************************************************************/
 int ttwatch_read_whole_file(TTWATCH *watch, uint32_t id, void **data, uint32_t *length);
 
+/******************************************************************************
+* Same as ttwatch_read_whole_file, but also passes each block of data to the  *
+* callback function as it arrives, so that it can be processed while the rest *
+* of the file is still being transferred.                                     *
+******************************************************************************/
+int ttwatch_read_whole_file_cb(TTWATCH *watch, uint32_t id, void **data, uint32_t *length,
+    TTWATCH_FILE_DATA_CALLBACK callback, void *cbdata);
+
 /******************************************************************************
 * Writes a whole file from memory into the watch. Writes 'length' bytes from  *
 * 'data' to the specified file. If the file exists on the watch already, it   *
@@ -52,6 +52,9 @@ typedef struct
     char *setting_spec;
     int list_settings;
     int skip_elevation;
+    int compression;            /* COMPRESSION_*, for the ttbin and export files */
+    double simplify;            /* GPX/KML track tolerance in metres, 0 = none */
+    unsigned export_threads;    /* 0 = one per processor */
     char *post_processor;
     char *ephemeris_url;
     int factory_reset;
@@ -0,0 +1,24 @@
+/*****************************************************************************\
+** simplify.h                                                                **
+** GPS track simplification                                                  **
+\*****************************************************************************/
+
+#ifndef __SIMPLIFY_H__
+#define __SIMPLIFY_H__
+
+#include "ttbin.h"
+
+#include <stdint.h>
+
+/* works out which points of the track can be left out, Visvalingam style:
+   the point nearest the line between its remaining neighbours is dropped,
+   repeatedly, until none is within 'tolerance' metres, which takes
+   O(n log n). Points dropped early can end up a little further than that
+   from the final track (Douglas-Peucker bounds it strictly, but is O(n^2)
+   at worst). Returns an array with an entry per GPS record, 0 for the points
+   that can be left out; points without a fix are not part of the track and
+   are always 1, as are the first and last points. Returns 0 if there is
+   no memory */
+uint8_t *simplify_track(const GPS_COLUMNS *gps, double tolerance);
+
+#endif  /* __SIMPLIFY_H__ */
@@ -0,0 +1,45 @@
+/*****************************************************************************\
+** synthetic.h                                                               **
+** Synthetic TTBIN activity generator                                        **
+\*****************************************************************************/
+
+#ifndef __SYNTHETIC_H__
+#define __SYNTHETIC_H__
+
+#include "ttbin.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SENSOR_HEART_RATE   (0x00000001)
+#define SENSOR_CADENCE      (0x00000002)
+#define SENSOR_ALTITUDE     (0x00000004)
+
+#define MODE_LAPS_MANUAL    (1)
+#define MODE_LAPS_TIME      (2)
+#define MODE_LAPS_DISTANCE  (3)
+#define MODE_GOAL_DISTANCE  (4)
+#define MODE_RACE           (5)
+#define MODE_INTERVALS      (6)
+
+typedef struct
+{
+    unsigned activity;      /* from find_synthetic_activity */
+    double   hours;
+    unsigned rate;          /* seconds between samples */
+    uint32_t seed;
+    uint32_t sensors;
+    int      mode;
+    float    mode_value;    /* lap distance/time, goal distance, race distance */
+    uint32_t intervals[5];  /* warm, work, rest, cool (seconds), sets */
+} SYNTHETIC_ACTIVITY;
+
+/* returns the activity number for "running", "cycling", "swimming",
+   "treadmill", "freestyle", "hiking" or "trailrunning", or -1 */
+int find_synthetic_activity(const char *name);
+
+/* generates a valid TTBIN file for the activity, returning the data (which
+   must be freed) and its size; the same settings always give the same file */
+uint8_t *generate_ttbin(const SYNTHETIC_ACTIVITY *activity, size_t *size);
+
+#endif  /* __SYNTHETIC_H__ */
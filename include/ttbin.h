@@ -62,6 +62,23 @@ typedef struct
     uint8_t  cycles;        /* steps/strokes/cycles etc. */
 } GPS_RECORD;
 
+/* a GPS record in the file's fixed-point form, used instead of GPS_RECORD
+   when the file is parsed with TTBIN_PARSE_COMPACT_GPS; use the ttbin_gps_*
+   functions to read either form */
+typedef struct
+{
+    int32_t  latitude;      /* degrees * 1e7 */
+    int32_t  longitude;     /* degrees * 1e7 */
+    uint32_t timestamp;     /* gps time (utc) */
+    float    instant_speed; /* m/s */
+    float    cum_distance;  /* metres */
+    float    elevation;     /* metres, initialised to NAN */
+    uint16_t heading;       /* degrees * 100, N = 0, E = 9000 */
+    uint16_t gps_speed;
+    uint16_t calories;
+    uint8_t  cycles;        /* steps/strokes/cycles etc. */
+} COMPACT_GPS_RECORD;
+
 typedef struct
 {
     uint8_t  status;        /* 0 = ready, 1 = active, 2 = paused, 3 = stopped */
@@ -257,6 +274,7 @@ typedef struct _TTBIN_RECORD
     {
         uint8_t                    data[1];
         GPS_RECORD                 gps;
+        COMPACT_GPS_RECORD         gps_compact;
         STATUS_RECORD              status;
         TREADMILL_RECORD           treadmill;
         SWIM_RECORD                swim;
@@ -280,12 +298,108 @@ typedef struct _TTBIN_RECORD
     };
 } TTBIN_RECORD;
 
+/* records points to space for 'capacity' entries, of which the first 'count'
+   are in use. Parsing a complete buffer sizes each array exactly from a quick
+   count of the tags beforehand; otherwise the capacity doubles as needed.
+   The entries live in the file's arena, so code that empties an array must
+   zero all three fields rather than free the pointer */
 typedef struct
 {
     unsigned count;
+    unsigned capacity;
     TTBIN_RECORD **records;
 } RECORD_ARRAY;
 
+/* contiguous copies of the GPS and heart rate streams, for code that wants to
+   scan them linearly; the record list remains the master copy */
+typedef struct
+{
+    unsigned  count;            /* same as gps_records.count */
+    double   *latitude;         /* degrees */
+    double   *longitude;        /* degrees */
+    time_t   *timestamp;        /* gps time (utc) */
+    float    *elevation;        /* metres, NAN if unknown */
+    float    *heading;          /* degrees */
+    float    *instant_speed;    /* m/s */
+    float    *cum_distance;     /* metres */
+    uint16_t *gps_speed;
+    uint16_t *calories;
+    uint8_t  *cycles;
+    uint8_t  *heart_rate;       /* last heart rate since the previous GPS record, 0 = none */
+} GPS_COLUMNS;
+
+typedef struct
+{
+    unsigned  count;            /* same as heart_rate_records.count */
+    time_t   *timestamp;        /* utc time */
+    uint8_t  *heart_rate;       /* bpm */
+} HEART_RATE_COLUMNS;
+
+typedef struct
+{
+    GPS_COLUMNS        gps;
+    HEART_RATE_COLUMNS heart_rate;
+} TTBIN_COLUMNS;
+
+/* one sample per usable GPS, treadmill, swim, gym or indoor cycling record
+   (records written while paused or without a GPS fix are left out), with the
+   heart rate, cadence sensor and lap state merged in as of that record */
+typedef struct
+{
+    TTBIN_RECORD *record;
+    time_t   timestamp;         /* utc time */
+    double   latitude;          /* degrees, GPS samples only */
+    double   longitude;         /* degrees, GPS samples only */
+    float    elevation;         /* metres, NAN if unknown or not a GPS sample */
+    double   distance;          /* metres, treadmill distances are scaled by distance_factor */
+    float    speed;             /* m/s, GPS samples only */
+    uint16_t calories;          /* GPS samples only */
+    uint8_t  cycles;            /* steps/strokes/cycles, GPS samples only */
+    uint8_t  heart_rate;        /* last heart rate since the previous sample, 0 = none */
+    uint8_t  last_heart_rate;   /* last heart rate before the sample, 0 = none */
+    uint8_t  cadence_available; /* the cadence sensor has reported crank revolutions */
+    unsigned cycling_cadence;   /* rpm */
+    float    wheel_speed;       /* m/s */
+    unsigned lap;               /* number of lap records before the sample */
+} TTBIN_SAMPLE;
+
+typedef struct
+{
+    unsigned count;
+    double distance_factor;     /* summary distance / treadmill distance, 1 for other activities */
+    TTBIN_SAMPLE *samples;
+} TTBIN_TIMELINE;
+
+#define TTBIN_LAP_TRIGGER_MANUAL    (0)
+#define TTBIN_LAP_TRIGGER_TIME      (1)
+#define TTBIN_LAP_TRIGGER_DISTANCE  (2)
+
+/* the statistics for a lap, which ends with a lap record, an interval, a
+   length of the pool or the end of the activity */
+typedef struct
+{
+    uint8_t  end_tag;           /* TAG_LAP, TAG_INTERVAL_FINISH, TAG_SWIM, 0 = end of the activity */
+    uint8_t  trigger;           /* TTBIN_LAP_TRIGGER_* */
+    uint8_t  resting;           /* the last interval to finish wasn't a work interval */
+    uint32_t total_time;        /* seconds, since the start of the activity */
+    float    total_distance;    /* metres, as recorded when the lap ended */
+    uint32_t total_calories;
+    uint32_t time;              /* seconds */
+    float    distance;          /* metres, treadmill distances are scaled by distance_factor */
+    uint32_t calories;
+    float    avg_speed;         /* m/s, metres per sample for the treadmill */
+    float    max_speed;         /* m/s, GPS samples only */
+    uint32_t avg_heart_rate;    /* 0 = none */
+    uint32_t max_heart_rate;
+    uint32_t steps;             /* steps, gym repetitions or swim strokes */
+} TTBIN_LAP_SUMMARY;
+
+typedef struct
+{
+    unsigned count;
+    TTBIN_LAP_SUMMARY *laps;
+} TTBIN_LAP_LIST;
+
 typedef struct
 {
     uint8_t  file_version;
@@ -324,31 +438,232 @@ typedef struct
 
     TTBIN_RECORD *first;
     TTBIN_RECORD *last;
+
+    TTBIN_COLUMNS *columns;     /* only present if requested */
+
+    struct _TTBIN_TIME_INDEX *time_index;   /* built on first use */
+
+    TTBIN_TIMELINE *timeline;   /* built on first use */
+
+    TTBIN_LAP_LIST *laps;       /* built on first use */
+
+    int compact_gps;            /* GPS records are COMPACT_GPS_RECORDs */
+
+    /* every record and record array is allocated from these slabs, and
+       is only released by free_ttbin */
+    struct _TTBIN_SLAB *slabs;
 } TTBIN_FILE;
 
 /*****************************************************************************/
 
+/* gzip or zstd compressed files are decompressed as they are read */
 TTBIN_FILE *read_ttbin_file(FILE *file);
 
+/* reads a file without copying it into a heap buffer first; regular files
+   are memory-mapped, anything else (pipes, compressed files etc.) is read
+   like read_ttbin_file */
+TTBIN_FILE *read_ttbin_fd(int fd);
+
+TTBIN_FILE *read_ttbin_path(const char *filename);
+
 TTBIN_FILE *parse_ttbin_data(const uint8_t *data, uint32_t size);
 
+#define TTBIN_PARSE_COLUMNS     (0x00000001)    /* build ttbin->columns */
+#define TTBIN_PARSE_COMPACT_GPS (0x00000002)    /* store GPS records in fixed-point form */
+
+TTBIN_FILE *parse_ttbin_data_ex(const uint8_t *data, uint32_t size, uint32_t flags);
+
+/* incremental parser, for data that arrives in pieces (USB transfers, pipes);
+   the header callback is called once the file header has been read, and the
+   record callback for every record except the summary (which is stored in
+   the TTBIN_FILE). The record is only valid until the callback returns, and
+   either callback can return 0 to abort parsing. Without a record callback
+   the complete file is built, exactly as parse_ttbin_data does */
+typedef struct
+{
+    int (*header)(TTBIN_FILE *ttbin, void *data);
+    int (*record)(TTBIN_FILE *ttbin, const TTBIN_RECORD *record, void *data);
+} TTBIN_PARSER_CALLBACKS;
+
+typedef struct _TTBIN_PARSER TTBIN_PARSER;
+
+TTBIN_PARSER *ttbin_parser_create(const TTBIN_PARSER_CALLBACKS *callbacks, void *data);
+
+/* returns 0 if the data is invalid or a callback aborted parsing */
+int ttbin_parser_feed(TTBIN_PARSER *parser, const uint8_t *data, size_t size);
+
+/* frees the parser, returning the parsed file (which only contains records if
+   there was no record callback), or 0 if parsing failed */
+TTBIN_FILE *ttbin_parser_finish(TTBIN_PARSER *parser);
+
+/* a record index, for consumers that only need a few of the records in a
+   file; indexing reads the header and summary and notes where every record
+   is, and records are then only decoded when asked for */
+typedef struct
+{
+    uint32_t offset;    /* of the tag byte, from the start of the data */
+    uint32_t length;    /* including the tag byte; can exceed 64k for
+                           variable length records */
+    uint8_t  tag;
+} TTBIN_INDEX_ENTRY;
+
+typedef struct
+{
+    TTBIN_FILE *ttbin;          /* header and summary only, the record list is empty */
+    const uint8_t *data;        /* must stay valid while the index is used */
+    uint32_t size;
+    uint32_t count;             /* same records as parse_ttbin_data returns */
+    TTBIN_INDEX_ENTRY *entries;
+    TTBIN_RECORD **records;     /* decoded records, 0 until first accessed */
+    void *mapping;              /* only present if the index mapped the file */
+} TTBIN_INDEX;
+
+TTBIN_INDEX *index_ttbin_data(const uint8_t *data, uint32_t size);
+
+/* maps the file, which stays mapped until the index is freed; compressed
+   files can't be indexed */
+TTBIN_INDEX *index_ttbin_path(const char *filename);
+
+/* decodes a record on first use; the record is not linked to any other.
+   Returns 0 if i is out of range or there is no memory */
+const TTBIN_RECORD *ttbin_index_record(TTBIN_INDEX *index, uint32_t i);
+
+/* returns the position of the next record with the tag at or after 'start',
+   or index->count if there isn't one */
+uint32_t ttbin_index_find(const TTBIN_INDEX *index, uint8_t tag, uint32_t start);
+
+void free_ttbin_index(TTBIN_INDEX *index);
+
 int write_ttbin_file(const TTBIN_FILE *ttbin, FILE *file);
 
+/* encodes the whole file into a single buffer (which must be freed), so that
+   it can be written or sent in one go; returns 0 on failure */
+int serialize_ttbin(const TTBIN_FILE *ttbin, uint8_t **buf, size_t *len);
+
+/* these return 0 if there is no memory for the new record */
 TTBIN_RECORD *insert_before(TTBIN_FILE *ttbin, TTBIN_RECORD *record);
 
 TTBIN_RECORD *insert_after(TTBIN_FILE *ttbin, TTBIN_RECORD *record);
 
 void delete_record(TTBIN_FILE *ttbin, TTBIN_RECORD *record);
 
+/* batch editing; delete_record updates the record arrays on every call (and
+   insert_before/insert_after leave them alone), whereas an edit only changes
+   the record list and rebuilds the arrays (and discards the columns) once,
+   when it is committed. Until then the arrays still describe the file as it
+   was when the edit began, so they can be used to find the records to
+   change. Deleted records must not be used as insertion points, and every
+   edit must be committed, which also frees it */
+typedef struct _TTBIN_EDIT TTBIN_EDIT;
+
+/* returns 0 if there is no memory */
+TTBIN_EDIT *ttbin_edit_begin(TTBIN_FILE *ttbin);
+
+TTBIN_RECORD *ttbin_edit_insert_before(TTBIN_EDIT *edit, TTBIN_RECORD *record);
+
+TTBIN_RECORD *ttbin_edit_insert_after(TTBIN_EDIT *edit, TTBIN_RECORD *record);
+
+void ttbin_edit_delete(TTBIN_EDIT *edit, TTBIN_RECORD *record);
+
+/* returns 0 if there was no memory to rebuild the arrays */
+int ttbin_edit_commit(TTBIN_EDIT *edit);
+
+/* returns a pointer to a static buffer, which create_filename_r avoids by
+   writing into the caller's buffer (32 characters is enough) */
 const char *create_filename(TTBIN_FILE *file, const char *ext);
 
+const char *create_filename_r(TTBIN_FILE *file, const char *ext, char *filename, size_t size);
+
 void download_elevation_data(TTBIN_FILE *ttbin);
 
 uint32_t export_formats(TTBIN_FILE *ttbin, uint32_t formats);
 
 void free_ttbin(TTBIN_FILE *ttbin);
 
-void replace_lap_list(TTBIN_FILE *ttbin, float *distances, unsigned count);
+/* (re)builds ttbin->columns from the record list, returns 0 on failure; the
+   columns are discarded if GPS or heart rate records are deleted */
+int build_ttbin_columns(TTBIN_FILE *ttbin);
+
+void free_ttbin_columns(TTBIN_FILE *ttbin);
+
+/* timestamp lookups for the GPS, heart rate, status, treadmill, swim, gym
+   and fitness point streams, using a sorted index of each stream that is
+   built on first use and discarded when records are deleted or edited */
+typedef struct _TTBIN_TIME_INDEX TTBIN_TIME_INDEX;
+
+int build_ttbin_time_index(TTBIN_FILE *ttbin);
+
+void free_ttbin_time_index(TTBIN_FILE *ttbin);
+
+/* returns the stream's record in effect at time t (utc), i.e. the last one
+   at or before t, or 0 if there isn't one */
+const TTBIN_RECORD *ttbin_value_at(TTBIN_FILE *ttbin, uint8_t tag, time_t t);
+
+/* points 'records' at the stream's records from time t0 up to (but not
+   including) t1, in time order, and returns how many there are */
+unsigned ttbin_range(TTBIN_FILE *ttbin, uint8_t tag, time_t t0, time_t t1, TTBIN_RECORD *const **records);
+
+/* the merged sample timeline that the exporters work from, built on first
+   use and discarded when records are deleted or edited, or the elevations
+   are replaced; returns 0 if it can't be built */
+const TTBIN_TIMELINE *ttbin_timeline(TTBIN_FILE *ttbin);
+
+int build_ttbin_timeline(TTBIN_FILE *ttbin);
+
+/* builds timeline samples one record at a time, for records that aren't
+   kept in a TTBIN_FILE (see the incremental parser below); distance_factor
+   is as in TTBIN_TIMELINE */
+typedef struct _TTBIN_SAMPLER TTBIN_SAMPLER;
+
+TTBIN_SAMPLER *ttbin_sampler_create(double distance_factor);
+
+/* returns 1 and fills in the sample if the record has one */
+int ttbin_sampler_add(TTBIN_SAMPLER *sampler, const TTBIN_FILE *ttbin, TTBIN_RECORD *record, TTBIN_SAMPLE *sample);
+
+void ttbin_sampler_free(TTBIN_SAMPLER *sampler);
+
+void free_ttbin_timeline(TTBIN_FILE *ttbin);
+
+/* the statistics for every lap, built on first use and discarded along with
+   the timeline; returns 0 if they can't be built */
+const TTBIN_LAP_LIST *ttbin_laps(TTBIN_FILE *ttbin);
+
+int build_ttbin_laps(TTBIN_FILE *ttbin);
+
+void free_ttbin_laps(TTBIN_FILE *ttbin);
+
+/* works out the lap statistics one record at a time, for records that
+   aren't kept in a TTBIN_FILE; sample is the record's timeline sample, if
+   it has one, and distance_factor is as in TTBIN_TIMELINE */
+typedef struct _TTBIN_LAP_BUILDER TTBIN_LAP_BUILDER;
+
+TTBIN_LAP_BUILDER *ttbin_lap_builder_create(double distance_factor);
+
+/* returns 1 and fills in the lap if the record ends one */
+int ttbin_lap_builder_add(TTBIN_LAP_BUILDER *builder, const TTBIN_FILE *ttbin,
+    const TTBIN_RECORD *record, const TTBIN_SAMPLE *sample, TTBIN_LAP_SUMMARY *lap);
+
+/* fills in the lap that the end of the activity finishes, from the summary;
+   returns 0 if there have been no samples since the previous lap ended */
+int ttbin_lap_builder_finish(TTBIN_LAP_BUILDER *builder, const TTBIN_FILE *ttbin, TTBIN_LAP_SUMMARY *lap);
+
+void ttbin_lap_builder_free(TTBIN_LAP_BUILDER *builder);
+
+/* GPS record accessors, which work whether or not the file was parsed with
+   TTBIN_PARSE_COMPACT_GPS */
+void ttbin_gps_get(const TTBIN_FILE *ttbin, const TTBIN_RECORD *record, GPS_RECORD *gps);
+
+double ttbin_gps_latitude(const TTBIN_FILE *ttbin, const TTBIN_RECORD *record);
+
+double ttbin_gps_longitude(const TTBIN_FILE *ttbin, const TTBIN_RECORD *record);
+
+time_t ttbin_gps_timestamp(const TTBIN_FILE *ttbin, const TTBIN_RECORD *record);
+
+float ttbin_gps_cum_distance(const TTBIN_FILE *ttbin, const TTBIN_RECORD *record);
+
+/* returns 0 if there wasn't the memory to add every lap or to rebuild the
+   record arrays afterwards */
+int replace_lap_list(TTBIN_FILE *ttbin, float *distances, unsigned count);
 
 int truncate_laps(TTBIN_FILE *ttbin);
 
@@ -0,0 +1,515 @@
+/*****************************************************************************\
+** bench_ttbin.c                                                             **
+** TTBIN processing benchmark                                                **
+\*****************************************************************************/
+
+#include "ttbin.h"
+#include "export.h"
+#include "synthetic.h"
+
+#include <assert.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+/* allocation counting relies on the linker wrapping the allocator (see
+   CMakeLists.txt); without that the counts are reported as zero */
+static unsigned long long allocations;
+static unsigned long long allocated_bytes;
+
+#ifdef BENCH_COUNT_ALLOCATIONS
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    ++allocations;
+    allocated_bytes += size;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+    ++allocations;
+    allocated_bytes += count * size;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    ++allocations;
+    allocated_bytes += size;
+    return __real_realloc(ptr, size);
+}
+#endif
+
+/*****************************************************************************/
+
+typedef struct
+{
+    const char *name;
+    uint8_t *data;
+    uint32_t size;
+    unsigned records;   /* including the summary */
+} CORPUS_FILE;
+
+typedef struct
+{
+    const char *name;
+    unsigned iterations;
+    double seconds;
+    double records;
+    double bytes;
+    unsigned long long allocations;
+    unsigned long long allocated_bytes;
+    long peak_rss;      /* kilobytes, the process peak after the benchmark */
+} RESULT;
+
+#define MAX_RESULTS     (16)
+
+typedef struct
+{
+    CORPUS_FILE *files;
+    unsigned file_count;
+    unsigned iterations;
+    RESULT results[MAX_RESULTS];
+    unsigned result_count;
+    FILE *null_file;
+} BENCH;
+
+/* the operations timed for each file */
+typedef void (*FILE_OPERATION)(BENCH *bench, const CORPUS_FILE *file, TTBIN_FILE *ttbin);
+
+/*****************************************************************************/
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long peak_rss(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static RESULT *begin_result(BENCH *bench, const char *name)
+{
+    RESULT *result;
+
+    assert(bench->result_count < MAX_RESULTS);
+    result = &bench->results[bench->result_count++];
+    memset(result, 0, sizeof(RESULT));
+    result->name = name;
+    result->iterations = bench->iterations;
+    allocations = allocated_bytes = 0;
+    return result;
+}
+
+/* a run too quick for the clock to see counts as no throughput */
+static double per_second(double amount, double seconds)
+{
+    return (seconds > 0) ? amount / seconds : 0;
+}
+
+static void end_result(const BENCH *bench, RESULT *result)
+{
+    result->allocations     = allocations;
+    result->allocated_bytes = allocated_bytes;
+    result->peak_rss        = peak_rss();
+
+    printf("%-20s %8.3f s %11.0f records/s %8.1f MB/s %9.1f allocs/file %8ld kB peak RSS\n",
+        result->name, result->seconds, per_second(result->records, result->seconds),
+        per_second(result->bytes, result->seconds) / 1e6,
+        (double)result->allocations / result->iterations / bench->file_count, result->peak_rss);
+}
+
+/*****************************************************************************/
+
+static void bench_parse(BENCH *bench, const char *name, uint32_t flags)
+{
+    RESULT *result = begin_result(bench, name);
+    unsigned i, f;
+    double start = now();
+
+    for (i = 0; i < bench->iterations; ++i)
+    {
+        for (f = 0; f < bench->file_count; ++f)
+        {
+            free_ttbin(parse_ttbin_data_ex(bench->files[f].data, bench->files[f].size, flags));
+            result->records += bench->files[f].records;
+            result->bytes   += bench->files[f].size;
+        }
+    }
+    result->seconds = now() - start;
+    end_result(bench, result);
+}
+
+static void bench_index(BENCH *bench)
+{
+    RESULT *result = begin_result(bench, "index_ttbin_data");
+    unsigned i, f;
+    double start = now();
+
+    for (i = 0; i < bench->iterations; ++i)
+    {
+        for (f = 0; f < bench->file_count; ++f)
+        {
+            free_ttbin_index(index_ttbin_data(bench->files[f].data, bench->files[f].size));
+            result->records += bench->files[f].records;
+            result->bytes   += bench->files[f].size;
+        }
+    }
+    result->seconds = now() - start;
+    end_result(bench, result);
+}
+
+/* times an operation that leaves the file as it was, on one parsed copy */
+static void bench_reader(BENCH *bench, const char *name, FILE_OPERATION operation)
+{
+    RESULT *result;
+    TTBIN_FILE **ttbins = calloc(bench->file_count, sizeof(TTBIN_FILE*));
+    unsigned i, f;
+    double start;
+
+    for (f = 0; f < bench->file_count; ++f)
+        ttbins[f] = parse_ttbin_data(bench->files[f].data, bench->files[f].size);
+
+    result = begin_result(bench, name);
+    start = now();
+    for (i = 0; i < bench->iterations; ++i)
+    {
+        for (f = 0; f < bench->file_count; ++f)
+        {
+            operation(bench, &bench->files[f], ttbins[f]);
+            result->records += bench->files[f].records;
+            result->bytes   += bench->files[f].size;
+        }
+    }
+    result->seconds = now() - start;
+    end_result(bench, result);
+
+    for (f = 0; f < bench->file_count; ++f)
+        free_ttbin(ttbins[f]);
+    free(ttbins);
+}
+
+/* times an operation that modifies the file, on a fresh copy each time;
+   the copies are parsed before the clock starts */
+static void bench_modifier(BENCH *bench, const char *name, FILE_OPERATION operation)
+{
+    RESULT *result;
+    TTBIN_FILE **ttbins = calloc(bench->iterations, sizeof(TTBIN_FILE*));
+    unsigned i, f;
+    double start;
+
+    result = begin_result(bench, name);
+    for (f = 0; f < bench->file_count; ++f)
+    {
+        unsigned long long a = allocations, b = allocated_bytes;
+        for (i = 0; i < bench->iterations; ++i)
+            ttbins[i] = parse_ttbin_data(bench->files[f].data, bench->files[f].size);
+        allocations = a;
+        allocated_bytes = b;
+
+        start = now();
+        for (i = 0; i < bench->iterations; ++i)
+            operation(bench, &bench->files[f], ttbins[i]);
+        result->seconds += now() - start;
+        result->records += (double)bench->files[f].records * bench->iterations;
+        result->bytes   += (double)bench->files[f].size * bench->iterations;
+
+        a = allocations;
+        b = allocated_bytes;
+        for (i = 0; i < bench->iterations; ++i)
+            free_ttbin(ttbins[i]);
+        allocations = a;
+        allocated_bytes = b;
+    }
+    end_result(bench, result);
+    free(ttbins);
+}
+
+/*****************************************************************************/
+
+static void do_write(BENCH *bench, const CORPUS_FILE *file, TTBIN_FILE *ttbin)
+{
+    write_ttbin_file(ttbin, bench->null_file);
+}
+
+static const OFFLINE_FORMAT *current_format;
+
+static void do_export(BENCH *bench, const CORPUS_FILE *file, TTBIN_FILE *ttbin)
+{
+    current_format->producer(ttbin, bench->null_file);
+}
+
+static void do_export_all(BENCH *bench, const CORPUS_FILE *file, TTBIN_FILE *ttbin)
+{
+    FILE *files[OFFLINE_FORMAT_COUNT];
+    unsigned i;
+    for (i = 0; i < OFFLINE_FORMAT_COUNT; ++i)
+        files[i] = bench->null_file;
+    export_files(ttbin, files);
+}
+
+static void do_replace_laps(BENCH *bench, const CORPUS_FILE *file, TTBIN_FILE *ttbin)
+{
+    float distance = 1000.0f;
+    replace_lap_list(ttbin, &distance, 1);
+}
+
+static void do_truncate_laps(BENCH *bench, const CORPUS_FILE *file, TTBIN_FILE *ttbin)      { truncate_laps(ttbin); }
+static void do_truncate_race(BENCH *bench, const CORPUS_FILE *file, TTBIN_FILE *ttbin)      { truncate_race(ttbin); }
+static void do_truncate_goal(BENCH *bench, const CORPUS_FILE *file, TTBIN_FILE *ttbin)      { truncate_goal(ttbin); }
+static void do_truncate_intervals(BENCH *bench, const CORPUS_FILE *file, TTBIN_FILE *ttbin) { truncate_intervals(ttbin); }
+
+/*****************************************************************************/
+
+/* file names come from the command line, so they may need escaping */
+static void write_json_string(FILE *file, const char *str)
+{
+    fputc('"', file);
+    for (; *str; ++str)
+    {
+        if ((*str == '"') || (*str == '\\'))
+            fprintf(file, "\\%c", *str);
+        else if ((unsigned char)*str < 0x20)
+            fprintf(file, "\\u%04x", (unsigned char)*str);
+        else
+            fputc(*str, file);
+    }
+    fputc('"', file);
+}
+
+static void write_json(const BENCH *bench, FILE *file)
+{
+    unsigned i;
+
+    fprintf(file, "{\n  \"files\": [");
+    for (i = 0; i < bench->file_count; ++i)
+    {
+        fprintf(file, "%s\n    { \"name\": ", i ? "," : "");
+        write_json_string(file, bench->files[i].name);
+        fprintf(file, ", \"bytes\": %u, \"records\": %u }", bench->files[i].size, bench->files[i].records);
+    }
+    fprintf(file, "\n  ],\n  \"iterations\": %u,\n  \"results\": [", bench->iterations);
+    for (i = 0; i < bench->result_count; ++i)
+    {
+        const RESULT *r = &bench->results[i];
+        fprintf(file, "%s\n    { \"name\": ", i ? "," : "");
+        write_json_string(file, r->name);
+        fprintf(file, ", \"seconds\": %.6f, \"records_per_sec\": %.0f, \"mb_per_sec\": %.3f, "
+            "\"allocations\": %llu, \"allocated_bytes\": %llu, \"peak_rss_kb\": %ld }",
+            r->seconds, per_second(r->records, r->seconds), per_second(r->bytes, r->seconds) / 1e6,
+            r->allocations, r->allocated_bytes, r->peak_rss);
+    }
+    fprintf(file, "\n  ]\n}\n");
+}
+
+/*****************************************************************************/
+
+static int load_file(const char *filename, CORPUS_FILE *file)
+{
+    FILE *f = fopen(filename, "r");
+    uint8_t *data = 0, *new_data;
+    size_t size = 0, capacity = 0, length;
+    int ok;
+
+    if (!f)
+        return 0;
+    for (;;)
+    {
+        if (size == capacity)
+        {
+            new_data = realloc(data, capacity ? capacity * 2 : 65536);
+            if (!new_data)
+                break;
+            data = new_data;
+            capacity = capacity ? capacity * 2 : 65536;
+        }
+        length = fread(data + size, 1, capacity - size, f);
+        if (!length)
+            break;
+        size += length;
+    }
+    ok = feof(f) && !ferror(f);
+    fclose(f);
+    if (!ok)
+    {
+        free(data);
+        return 0;
+    }
+
+    file->name = filename;
+    file->data = data;
+    file->size = size;
+    return 1;
+}
+
+static int count_records(CORPUS_FILE *file)
+{
+    TTBIN_FILE *ttbin = parse_ttbin_data(file->data, file->size);
+    TTBIN_RECORD *record;
+
+    if (!ttbin)
+        return 0;
+    file->records = 1;  /* the summary record isn't kept in the list */
+    for (record = ttbin->first; record; record = record->next)
+        ++file->records;
+    free_ttbin(ttbin);
+    return 1;
+}
+
+static void help(char *argv[])
+{
+    printf("Usage: %s [OPTION]... [FILE]...\n", argv[0]);
+    printf("Measures TTBIN parsing, writing, exporting and editing speed over a corpus\n");
+    printf("of TTBIN files. If no files are given, a synthetic activity is used.\n");
+    printf("\n");
+    printf("Mandatory arguments to long options are mandatory for short options too.\n");
+    printf("  -h, --help             Print this help.\n");
+    printf("  -d, --duration=[HOURS] Length of the synthetic activity (default 4).\n");
+    printf("  -n, --iterations=[N]   Number of times to process each file (default 20).\n");
+    printf("  -j, --json=[FILE]      Also write the results as JSON (- for stdout).\n");
+}
+
+int main(int argc, char *argv[])
+{
+    double hours = 4.0;
+    const char *json_filename = 0;
+    BENCH bench;
+    unsigned i;
+
+    int opt = 0;
+    int option_index = 0;
+
+    const struct option long_options[] =
+    {
+        { "help",       no_argument,       0, 'h' },
+        { "duration",   required_argument, 0, 'd' },
+        { "iterations", required_argument, 0, 'n' },
+        { "json",       required_argument, 0, 'j' },
+        { 0, 0, 0, 0 }
+    };
+
+    memset(&bench, 0, sizeof(bench));
+    bench.iterations = 20;
+
+    while ((opt = getopt_long(argc, argv, "hd:n:j:", long_options, &option_index)) != -1)
+    {
+        switch (opt)
+        {
+        case 'h':   /* help */
+            help(argv);
+            return 0;
+        case 'd':   /* activity duration */
+            hours = atof(optarg);
+            break;
+        case 'n':   /* iteration count */
+            bench.iterations = atoi(optarg);
+            break;
+        case 'j':   /* JSON output file */
+            json_filename = optarg;
+            break;
+        default:
+            help(argv);
+            return 1;
+        }
+    }
+    if ((hours <= 0) || (bench.iterations == 0))
+    {
+        help(argv);
+        return 1;
+    }
+
+    /* load the corpus, and check that every file parses */
+    if (optind < argc)
+    {
+        bench.file_count = argc - optind;
+        bench.files = calloc(bench.file_count, sizeof(CORPUS_FILE));
+        for (i = 0; i < bench.file_count; ++i)
+        {
+            if (!load_file(argv[optind + i], &bench.files[i]))
+            {
+                fprintf(stderr, "Unable to read file: %s\n", argv[optind + i]);
+                return 2;
+            }
+        }
+    }
+    else
+    {
+        /* the same running activity that ttbingen writes with -l distance:1000 */
+        SYNTHETIC_ACTIVITY activity = { 0, 0.0, 1, 1, SENSOR_HEART_RATE | SENSOR_ALTITUDE,
+            MODE_LAPS_DISTANCE, 1000.0f, { 0 } };
+        size_t size;
+        activity.activity = find_synthetic_activity("running");
+        activity.hours = hours;
+        bench.file_count = 1;
+        bench.files = calloc(1, sizeof(CORPUS_FILE));
+        bench.files[0].name = "synthetic";
+        bench.files[0].data = generate_ttbin(&activity, &size);
+        bench.files[0].size = size;
+    }
+    for (i = 0; i < bench.file_count; ++i)
+    {
+        if (!count_records(&bench.files[i]))
+        {
+            fprintf(stderr, "Unable to parse file: %s\n", bench.files[i].name);
+            return 2;
+        }
+        printf("%s: %u records, %.2f MB\n", bench.files[i].name, bench.files[i].records, bench.files[i].size / 1e6);
+    }
+
+    bench.null_file = fopen("/dev/null", "w");
+    if (!bench.null_file)
+    {
+        fprintf(stderr, "Unable to open /dev/null\n");
+        return 2;
+    }
+
+    bench_parse(&bench, "parse_ttbin_data", 0);
+    bench_parse(&bench, "parse_compact_gps", TTBIN_PARSE_COMPACT_GPS);
+    bench_index(&bench);
+    bench_reader(&bench, "write_ttbin_file", do_write);
+    for (i = 0; i < OFFLINE_FORMAT_COUNT; ++i)
+    {
+        static char names[OFFLINE_FORMAT_COUNT][16];
+        if (!OFFLINE_FORMATS[i].producer)
+            continue;
+        sprintf(names[i], "export_%s", OFFLINE_FORMATS[i].name);
+        current_format = &OFFLINE_FORMATS[i];
+        bench_reader(&bench, names[i], do_export);
+    }
+    bench_reader(&bench, "export_all", do_export_all);
+    bench_modifier(&bench, "replace_lap_list", do_replace_laps);
+    bench_modifier(&bench, "truncate_laps", do_truncate_laps);
+    bench_modifier(&bench, "truncate_race", do_truncate_race);
+    bench_modifier(&bench, "truncate_goal", do_truncate_goal);
+    bench_modifier(&bench, "truncate_intervals", do_truncate_intervals);
+    fclose(bench.null_file);
+
+    if (json_filename)
+    {
+        FILE *f = strcmp(json_filename, "-") ? fopen(json_filename, "w") : stdout;
+        if (!f)
+        {
+            fprintf(stderr, "Unable to open output file: %s\n", json_filename);
+            return 2;
+        }
+        write_json(&bench, f);
+        if (f != stdout)
+            fclose(f);
+    }
+
+    for (i = 0; i < bench.file_count; ++i)
+        free(bench.files[i].data);
+    free(bench.files);
+    return 0;
+}
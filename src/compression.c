@@ -0,0 +1,485 @@
+/*****************************************************************************\
+** compression.c                                                             **
+** Transparent gzip/zstd compression of files                                **
+\*****************************************************************************/
+
+#define _GNU_SOURCE     /* for fopencookie */
+
+#include "compression.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/types.h>
+
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define COMPRESSION_BUFFER_SIZE (65536)
+#define MAGIC_SIZE              (4)
+
+static const uint8_t GZIP_MAGIC[] = { 0x1f, 0x8b };
+static const uint8_t ZSTD_MAGIC[] = { 0x28, 0xb5, 0x2f, 0xfd };
+
+typedef struct
+{
+    FILE *file;
+    int compression;
+    int writing;
+    int error;
+    int eof;                    /* no more input in file */
+    int member;                 /* part way through a gzip member or zstd frame */
+    z_stream zlib;
+#ifdef HAVE_ZSTD
+    ZSTD_CStream *zstd_out;
+    ZSTD_DStream *zstd_in;
+#endif
+    /* input waiting to be decompressed (or passed through), or output
+       waiting to be written */
+    size_t pos;
+    size_t size;
+    uint8_t buffer[COMPRESSION_BUFFER_SIZE];
+} COMPRESSION_STREAM;
+
+/*****************************************************************************/
+
+int parse_compression(const char *name)
+{
+    if (!name)
+        return -1;
+    if (!strcasecmp(name, "none"))
+        return COMPRESSION_NONE;
+    if (!strcasecmp(name, "gzip"))
+        return COMPRESSION_GZIP;
+#ifdef HAVE_ZSTD
+    if (!strcasecmp(name, "zstd"))
+        return COMPRESSION_ZSTD;
+#endif
+    return -1;
+}
+
+/*****************************************************************************/
+
+const char *compression_suffix(int compression)
+{
+    switch (compression)
+    {
+    case COMPRESSION_GZIP: return ".gz";
+    case COMPRESSION_ZSTD: return ".zst";
+    default:               return "";
+    }
+}
+
+/*****************************************************************************/
+
+int detect_compression(const uint8_t *data, size_t size)
+{
+    if ((size >= sizeof(GZIP_MAGIC)) && !memcmp(data, GZIP_MAGIC, sizeof(GZIP_MAGIC)))
+        return COMPRESSION_GZIP;
+    if ((size >= sizeof(ZSTD_MAGIC)) && !memcmp(data, ZSTD_MAGIC, sizeof(ZSTD_MAGIC)))
+        return COMPRESSION_ZSTD;
+    return COMPRESSION_NONE;
+}
+
+/*****************************************************************************/
+
+static int write_output(COMPRESSION_STREAM *stream, size_t size)
+{
+    if (size && (fwrite(stream->buffer, 1, size, stream->file) != size))
+        stream->error = 1;
+    return !stream->error;
+}
+
+/*****************************************************************************/
+
+static long stream_write(COMPRESSION_STREAM *stream, const char *data, size_t size)
+{
+    if (stream->error)
+        return -1;
+
+    if (stream->compression == COMPRESSION_GZIP)
+    {
+        stream->zlib.next_in  = (Bytef*)data;
+        stream->zlib.avail_in = size;
+        while (stream->zlib.avail_in)
+        {
+            stream->zlib.next_out  = stream->buffer;
+            stream->zlib.avail_out = sizeof(stream->buffer);
+            if (deflate(&stream->zlib, Z_NO_FLUSH) == Z_STREAM_ERROR)
+                stream->error = 1;
+            if (!write_output(stream, sizeof(stream->buffer) - stream->zlib.avail_out))
+                return -1;
+        }
+    }
+#ifdef HAVE_ZSTD
+    else
+    {
+        ZSTD_inBuffer in = { data, size, 0 };
+        while (in.pos < in.size)
+        {
+            ZSTD_outBuffer out = { stream->buffer, sizeof(stream->buffer), 0 };
+            if (ZSTD_isError(ZSTD_compressStream2(stream->zstd_out, &out, &in, ZSTD_e_continue)))
+                stream->error = 1;
+            if (!write_output(stream, out.pos))
+                return -1;
+        }
+    }
+#endif
+    return size;
+}
+
+/*****************************************************************************/
+
+/* writes out whatever the compressor is still holding and ends the data */
+static void finish_output(COMPRESSION_STREAM *stream)
+{
+    if (stream->compression == COMPRESSION_GZIP)
+    {
+        int result = Z_OK;
+        stream->zlib.next_in  = 0;
+        stream->zlib.avail_in = 0;
+        while (!stream->error && (result == Z_OK))
+        {
+            stream->zlib.next_out  = stream->buffer;
+            stream->zlib.avail_out = sizeof(stream->buffer);
+            result = deflate(&stream->zlib, Z_FINISH);
+            if (result == Z_STREAM_ERROR)
+                stream->error = 1;
+            write_output(stream, sizeof(stream->buffer) - stream->zlib.avail_out);
+        }
+        deflateEnd(&stream->zlib);
+    }
+#ifdef HAVE_ZSTD
+    else
+    {
+        ZSTD_inBuffer in = { 0, 0, 0 };
+        size_t remaining = 1;
+        while (!stream->error && remaining)
+        {
+            ZSTD_outBuffer out = { stream->buffer, sizeof(stream->buffer), 0 };
+            remaining = ZSTD_compressStream2(stream->zstd_out, &out, &in, ZSTD_e_end);
+            if (ZSTD_isError(remaining))
+                stream->error = 1;
+            write_output(stream, out.pos);
+        }
+        ZSTD_freeCStream(stream->zstd_out);
+    }
+#endif
+}
+
+/*****************************************************************************/
+
+/* refills the input buffer if it's empty, returning 0 at the end of the file */
+static int fill_input(COMPRESSION_STREAM *stream)
+{
+    if (stream->pos < stream->size)
+        return 1;
+    if (stream->eof)
+        return 0;
+    stream->pos  = 0;
+    stream->size = fread(stream->buffer, 1, sizeof(stream->buffer), stream->file);
+    if (!stream->size)
+    {
+        stream->eof = 1;
+        if (ferror(stream->file))
+            stream->error = 1;
+    }
+    return stream->size > 0;
+}
+
+/*****************************************************************************/
+
+static long stream_read(COMPRESSION_STREAM *stream, char *data, size_t size)
+{
+    size_t length = 0;
+
+    if (stream->error)
+        return -1;
+
+    if (stream->compression == COMPRESSION_NONE)
+    {
+        /* anything left over from checking the magic bytes comes first */
+        if (stream->pos < stream->size)
+        {
+            length = stream->size - stream->pos;
+            if (length > size)
+                length = size;
+            memcpy(data, stream->buffer + stream->pos, length);
+            stream->pos += length;
+            return length;
+        }
+        length = fread(data, 1, size, stream->file);
+        return (!length && ferror(stream->file)) ? -1 : (long)length;
+    }
+
+    if (stream->compression == COMPRESSION_GZIP)
+    {
+        stream->zlib.next_out  = (Bytef*)data;
+        stream->zlib.avail_out = size;
+        while (stream->zlib.avail_out == size)
+        {
+            int result;
+            if (!fill_input(stream))
+            {
+                /* running out part way through a member means it's truncated */
+                if (stream->member)
+                    stream->error = 1;
+                break;
+            }
+            if (!stream->member)
+            {
+                /* gzip files may hold several members one after another */
+                inflateReset(&stream->zlib);
+                stream->member = 1;
+            }
+            stream->zlib.next_in  = stream->buffer + stream->pos;
+            stream->zlib.avail_in = stream->size - stream->pos;
+            result = inflate(&stream->zlib, Z_NO_FLUSH);
+            stream->pos = stream->size - stream->zlib.avail_in;
+            if (result == Z_STREAM_END)
+                stream->member = 0;
+            else if (result != Z_OK)
+            {
+                stream->error = 1;
+                break;
+            }
+        }
+        length = size - stream->zlib.avail_out;
+    }
+#ifdef HAVE_ZSTD
+    else
+    {
+        ZSTD_outBuffer out = { data, size, 0 };
+        while (!out.pos)
+        {
+            ZSTD_inBuffer in;
+            size_t result;
+            if (!fill_input(stream))
+            {
+                if (stream->member)
+                    stream->error = 1;
+                break;
+            }
+            in.src  = stream->buffer;
+            in.size = stream->size;
+            in.pos  = stream->pos;
+            result = ZSTD_decompressStream(stream->zstd_in, &out, &in);
+            stream->pos = in.pos;
+            if (ZSTD_isError(result))
+            {
+                stream->error = 1;
+                break;
+            }
+            /* a non-zero result means the frame isn't complete yet */
+            stream->member = (result != 0);
+        }
+        length = out.pos;
+    }
+#endif
+
+    return (!length && stream->error) ? -1 : (long)length;
+}
+
+/*****************************************************************************/
+
+static int stream_close(COMPRESSION_STREAM *stream)
+{
+    int error;
+    if (!stream->writing)
+    {
+        /* the file being read belongs to the caller */
+        if (stream->compression == COMPRESSION_GZIP)
+            inflateEnd(&stream->zlib);
+#ifdef HAVE_ZSTD
+        if (stream->zstd_in)
+            ZSTD_freeDStream(stream->zstd_in);
+#endif
+        error = stream->error;
+    }
+    else
+    {
+        finish_output(stream);
+        error = stream->error;
+        if (fclose(stream->file))
+            error = 1;
+    }
+    free(stream);
+    return error ? EOF : 0;
+}
+
+/*****************************************************************************/
+
+#ifdef __GLIBC__
+
+static ssize_t cookie_read(void *cookie, char *data, size_t size)
+{
+    return stream_read((COMPRESSION_STREAM*)cookie, data, size);
+}
+
+static ssize_t cookie_write(void *cookie, const char *data, size_t size)
+{
+    long length = stream_write((COMPRESSION_STREAM*)cookie, data, size);
+    return (length < 0) ? 0 : length;
+}
+
+static int cookie_close(void *cookie)
+{
+    return stream_close((COMPRESSION_STREAM*)cookie);
+}
+
+static FILE *open_stream(COMPRESSION_STREAM *stream, int writing)
+{
+    cookie_io_functions_t functions = { 0 };
+    if (writing)
+        functions.write = cookie_write;
+    else
+        functions.read = cookie_read;
+    functions.close = cookie_close;
+    return fopencookie(stream, writing ? "w" : "r", functions);
+}
+
+#else
+
+/* the BSDs and OS X have funopen instead */
+static int cookie_read(void *cookie, char *data, int size)
+{
+    return stream_read((COMPRESSION_STREAM*)cookie, data, size);
+}
+
+static int cookie_write(void *cookie, const char *data, int size)
+{
+    return stream_write((COMPRESSION_STREAM*)cookie, data, size);
+}
+
+static int cookie_close(void *cookie)
+{
+    return stream_close((COMPRESSION_STREAM*)cookie);
+}
+
+static FILE *open_stream(COMPRESSION_STREAM *stream, int writing)
+{
+    return funopen(stream, writing ? 0 : cookie_read, writing ? cookie_write : 0, 0, cookie_close);
+}
+
+#endif
+
+/*****************************************************************************/
+
+FILE *compress_stream(FILE *file, int compression)
+{
+    COMPRESSION_STREAM *stream;
+    FILE *result;
+
+    if (compression == COMPRESSION_NONE)
+        return file;
+
+    stream = (COMPRESSION_STREAM*)calloc(1, sizeof(COMPRESSION_STREAM));
+    if (!stream)
+        return 0;
+    stream->file = file;
+    stream->compression = compression;
+    stream->writing = 1;
+
+    switch (compression)
+    {
+    case COMPRESSION_GZIP:
+        /* 16 added to the window bits selects a gzip header */
+        if (deflateInit2(&stream->zlib, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        {
+            free(stream);
+            return 0;
+        }
+        break;
+#ifdef HAVE_ZSTD
+    case COMPRESSION_ZSTD:
+        stream->zstd_out = ZSTD_createCStream();
+        if (!stream->zstd_out)
+        {
+            free(stream);
+            return 0;
+        }
+        break;
+#endif
+    default:
+        free(stream);
+        return 0;
+    }
+
+    result = open_stream(stream, 1);
+    if (!result)
+    {
+        if (compression == COMPRESSION_GZIP)
+            deflateEnd(&stream->zlib);
+#ifdef HAVE_ZSTD
+        else
+            ZSTD_freeCStream(stream->zstd_out);
+#endif
+        free(stream);
+    }
+    return result;
+}
+
+/*****************************************************************************/
+
+FILE *fopen_compressed(const char *filename, int compression)
+{
+    FILE *file = fopen(filename, "w");
+    FILE *result;
+    if (!file)
+        return 0;
+    result = compress_stream(file, compression);
+    if (!result)
+        fclose(file);
+    return result;
+}
+
+/*****************************************************************************/
+
+FILE *decompress_stream(FILE *file)
+{
+    COMPRESSION_STREAM *stream;
+    FILE *result;
+
+    stream = (COMPRESSION_STREAM*)calloc(1, sizeof(COMPRESSION_STREAM));
+    if (!stream)
+        return 0;
+    stream->file = file;
+
+    /* the magic bytes stay in the buffer to be decompressed (or passed
+       through) with the rest of the data */
+    stream->size = fread(stream->buffer, 1, MAGIC_SIZE, file);
+    if (stream->size < MAGIC_SIZE)
+        stream->eof = 1;
+    stream->compression = detect_compression(stream->buffer, stream->size);
+
+    switch (stream->compression)
+    {
+    case COMPRESSION_GZIP:
+        if (inflateInit2(&stream->zlib, 15 + 16) != Z_OK)
+        {
+            free(stream);
+            return 0;
+        }
+        break;
+    case COMPRESSION_ZSTD:
+#ifdef HAVE_ZSTD
+        stream->zstd_in = ZSTD_createDStream();
+        if (!stream->zstd_in)
+        {
+            free(stream);
+            return 0;
+        }
+#else
+        /* not supported by this build, so the data can't be read */
+        stream->error = 1;
+#endif
+        break;
+    }
+
+    result = open_stream(stream, 0);
+    if (!result)
+        stream_close(stream);
+    return result;
+}
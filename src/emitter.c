@@ -0,0 +1,235 @@
+/*****************************************************************************\
+** emitter.c                                                                 **
+** Buffered text output for the exporters                                    **
+\*****************************************************************************/
+
+#include "emitter.h"
+
+#include <math.h>
+#include <stdarg.h>
+#include <string.h>
+
+/* emit_fixed handles values up to this once scaled, beyond which a double
+   can't be rounded reliably without its exact decimal expansion */
+#define FIXED_LIMIT         (2147483648.0)  /* 2^31 */
+/* an error bound on the scaled value, comfortably above half an ulp (2^-23) */
+#define FIXED_TIE_MARGIN    (1.0 / 1048576) /* 2^-20 */
+#define FIXED_MAX_DECIMALS  (15)
+
+static const double SCALE[FIXED_MAX_DECIMALS + 1] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15
+};
+
+/*****************************************************************************/
+
+void emit_init(EMITTER *out, FILE *file)
+{
+    out->file   = file;
+    out->length = 0;
+}
+
+/*****************************************************************************/
+
+void emit_flush(EMITTER *out)
+{
+    if (out->length)
+        fwrite(out->buffer, 1, out->length, out->file);
+    out->length = 0;
+}
+
+/*****************************************************************************/
+
+static void emit_data(EMITTER *out, const char *data, size_t length)
+{
+    while (length > EMITTER_BUFFER_SIZE - out->length)
+    {
+        size_t part = EMITTER_BUFFER_SIZE - out->length;
+        memcpy(out->buffer + out->length, data, part);
+        out->length += part;
+        emit_flush(out);
+        data   += part;
+        length -= part;
+    }
+    memcpy(out->buffer + out->length, data, length);
+    out->length += length;
+}
+
+/*****************************************************************************/
+
+void emit_str(EMITTER *out, const char *str)
+{
+    emit_data(out, str, strlen(str));
+}
+
+/*****************************************************************************/
+
+void emit_char(EMITTER *out, char c)
+{
+    if (out->length >= EMITTER_BUFFER_SIZE)
+        emit_flush(out);
+    out->buffer[out->length++] = c;
+}
+
+/*****************************************************************************/
+
+/* writes the digits of value right-aligned to end, zero padded
+   to at least 'width' digits, and returns a pointer to the first one */
+static char *format_digits(char *end, uint64_t value, int width)
+{
+    char *ptr = end;
+    do
+    {
+        *--ptr = '0' + (value % 10);
+        value /= 10;
+        --width;
+    } while (value || (width > 0));
+    return ptr;
+}
+
+/*****************************************************************************/
+
+void emit_int(EMITTER *out, long value)
+{
+    char buf[24];
+    char *ptr = format_digits(buf + sizeof(buf), (value < 0) ? -(uint64_t)value : (uint64_t)value, 1);
+    if (value < 0)
+        *--ptr = '-';
+    emit_data(out, ptr, buf + sizeof(buf) - ptr);
+}
+
+/*****************************************************************************/
+
+void emit_padded(EMITTER *out, unsigned long value, int width)
+{
+    char buf[24];
+    char *ptr;
+
+    if (width > 20)
+    {
+        emit_printf(out, "%0*lu", width, value);
+        return;
+    }
+    ptr = format_digits(buf + sizeof(buf), value, width);
+    emit_data(out, ptr, buf + sizeof(buf) - ptr);
+}
+
+/*****************************************************************************/
+
+void emit_fixed(EMITTER *out, double value, int decimals)
+{
+    char buf[48];
+    char *end = buf + sizeof(buf);
+    char *ptr;
+    double scaled, whole, fraction;
+    uint64_t digits, scale;
+
+    if (!isfinite(value) || (decimals < 0) || (decimals > FIXED_MAX_DECIMALS))
+    {
+        emit_printf(out, "%.*f", decimals, value);
+        return;
+    }
+
+    /* round the scaled magnitude to an integer, as printf would round the
+       exact value; the multiplication is off by at most half an ulp, which
+       only matters if the value is within that of a tie */
+    scaled = fabs(value) * SCALE[decimals];
+    whole = floor(scaled);
+    fraction = scaled - whole;
+    if ((scaled >= FIXED_LIMIT) || (fabs(fraction - 0.5) < FIXED_TIE_MARGIN))
+    {
+        emit_printf(out, "%.*f", decimals, value);
+        return;
+    }
+    digits = (uint64_t)whole + (fraction > 0.5);
+    scale = (uint64_t)SCALE[decimals];
+
+    ptr = end;
+    if (decimals)
+    {
+        ptr = format_digits(ptr, digits % scale, decimals);
+        *--ptr = '.';
+    }
+    ptr = format_digits(ptr, digits / scale, 1);
+    /* printf keeps the sign of negative values that round to zero */
+    if (signbit(value))
+        *--ptr = '-';
+    emit_data(out, ptr, end - ptr);
+}
+
+/*****************************************************************************/
+
+void emit_printf(EMITTER *out, const char *fmt, ...)
+{
+    size_t space = EMITTER_BUFFER_SIZE - out->length;
+    va_list va;
+    int length;
+
+    va_start(va, fmt);
+    length = vsnprintf(out->buffer + out->length, space, fmt, va);
+    va_end(va);
+    if (length < 0)
+        return;
+    if ((size_t)length < space)
+    {
+        out->length += length;
+        return;
+    }
+
+    /* it didn't fit, so make room and try again */
+    emit_flush(out);
+    va_start(va, fmt);
+    if (length < EMITTER_BUFFER_SIZE)
+        out->length = vsnprintf(out->buffer, EMITTER_BUFFER_SIZE, fmt, va);
+    else
+        vfprintf(out->file, fmt, va);
+    va_end(va);
+}
+
+/*****************************************************************************/
+
+void emit_time_init(EMIT_TIME *cache, int utc)
+{
+    cache->utc       = utc;
+    cache->patchable = 0;
+    cache->minute    = 0;
+    cache->second    = -1;
+    cache->length    = 0;
+    cache->text[0]   = 0;
+}
+
+/*****************************************************************************/
+
+const char *emit_format_time(EMIT_TIME *cache, time_t t)
+{
+    struct tm tm;
+    unsigned seconds;
+
+    if (t == cache->second)
+        return cache->text;
+
+    /* time zone offsets only change on whole minutes, so within a minute
+       only the seconds differ */
+    if (cache->patchable && (t >= cache->minute) && (t - cache->minute < 60))
+    {
+        seconds = (unsigned)(t - cache->minute);
+        cache->text[cache->length - 2] = '0' + seconds / 10;
+        cache->text[cache->length - 1] = '0' + seconds % 10;
+        cache->second = t;
+        return cache->text;
+    }
+
+    if (!(cache->utc ? gmtime_r(&t, &tm) : localtime_r(&t, &tm)))
+    {
+        emit_time_init(cache, cache->utc);
+        return cache->text;
+    }
+    cache->length = strftime(cache->text, sizeof(cache->text), "%FT%X", &tm);
+    cache->minute = t - tm.tm_sec;
+    cache->second = t;
+
+    /* the seconds can only be patched if the locale puts them last */
+    cache->patchable = (cache->length >= 2) && (tm.tm_sec < 60)
+        && (cache->text[cache->length - 2] == '0' + tm.tm_sec / 10)
+        && (cache->text[cache->length - 1] == '0' + tm.tm_sec % 10);
+    return cache->text;
+}
@@ -4,6 +4,7 @@
 \*****************************************************************************/
 
 #include "export.h"
+#include "compression.h"
 
 #include <ctype.h>
 #include <stddef.h>
@@ -11,16 +12,19 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
 
 /*****************************************************************************/
 
 const OFFLINE_FORMAT OFFLINE_FORMATS[OFFLINE_FORMAT_COUNT] = {
-    { OFFLINE_FORMAT_CSV, "csv", 1, 1, 1, 1, export_csv, export_protobuf_csv },
-    { OFFLINE_FORMAT_FIT, "fit", 1, 0, 0, 0, 0,          0 },
-    { OFFLINE_FORMAT_GPX, "gpx", 1, 0, 0, 0, export_gpx, 0 },
-    { OFFLINE_FORMAT_KML, "kml", 1, 0, 0, 0, export_kml, 0 },
-    { OFFLINE_FORMAT_PWX, "pwx", 1, 0, 0, 0, 0,          0 },
-    { OFFLINE_FORMAT_TCX, "tcx", 1, 1, 1, 1, export_tcx, 0 },
+    { OFFLINE_FORMAT_CSV, "csv", 1, 1, 1, 1, export_csv, export_protobuf_csv, &CSV_WRITER },
+    { OFFLINE_FORMAT_FIT, "fit", 1, 1, 1, 1, export_fit, 0,                   &FIT_WRITER },
+    { OFFLINE_FORMAT_GPX, "gpx", 1, 0, 0, 0, export_gpx, 0,                   &GPX_WRITER },
+    { OFFLINE_FORMAT_KML, "kml", 1, 0, 0, 0, export_kml, 0,                   &KML_WRITER },
+    { OFFLINE_FORMAT_PWX, "pwx", 1, 0, 0, 0, 0,          0,                   0 },
+    { OFFLINE_FORMAT_TCX, "tcx", 1, 1, 1, 1, export_tcx, 0,                   &TCX_WRITER },
 };
 
 /*****************************************************************************/
@@ -52,10 +56,464 @@ uint32_t parse_format_list(const char *formats)
 
 /*****************************************************************************/
 
+/* feeds the record list to several writers at once, so that the list (and
+   the timeline) is only walked once however many formats are written */
+static int run_writers(TTBIN_FILE *ttbin, const EXPORT_WRITER *const *writers, FILE *const *files, unsigned count)
+{
+    const TTBIN_TIMELINE *timeline;
+    const TTBIN_SAMPLE *sample, *end;
+    const TTBIN_SAMPLE *current;
+    TTBIN_RECORD *record;
+    void *states[OFFLINE_FORMAT_COUNT];
+    unsigned i, active = 0;
+
+    timeline = ttbin_timeline(ttbin);
+    if (!timeline)
+        return 0;
+
+    for (i = 0; i < count; ++i)
+    {
+        states[i] = (*writers[i]->begin)(ttbin, files[i], ttbin->gps_records.count != 0);
+        if (states[i])
+            ++active;
+    }
+
+    sample = timeline->samples;
+    end = sample + timeline->count;
+    for (record = ttbin->first; record && active; record = record->next)
+    {
+        current = 0;
+        if ((sample < end) && (sample->record == record))
+            current = sample++;
+
+        for (i = 0; i < count; ++i)
+        {
+            if (states[i])
+                (*writers[i]->record)(states[i], record, current);
+        }
+    }
+
+    for (i = 0; i < count; ++i)
+    {
+        if (states[i])
+            (*writers[i]->finish)(states[i]);
+    }
+    return 1;
+}
+
+/*****************************************************************************/
+
+/* 0 = one thread per processor */
+static unsigned export_threads = 0;
+
+void export_set_threads(unsigned threads)
+{
+    export_threads = threads;
+}
+
+/*****************************************************************************/
+
+static int export_compression = COMPRESSION_NONE;
+
+void export_set_compression(int compression)
+{
+    export_compression = compression;
+}
+
+/*****************************************************************************/
+
+/* 0 = write every point */
+static double export_simplify = 0;
+
+void export_set_simplify(double tolerance)
+{
+    export_simplify = tolerance;
+}
+
+double export_simplify_tolerance(void)
+{
+    return export_simplify;
+}
+
+/*****************************************************************************/
+
+static int needs_columns(const EXPORT_WRITER *writer)
+{
+    return writer->uses_columns || (writer->simplifies && (export_simplify > 0));
+}
+
+/*****************************************************************************/
+
+/* the writers still to be run by the export threads */
+typedef struct
+{
+    TTBIN_FILE *ttbin;
+    const EXPORT_WRITER *const *writers;
+    FILE *const *files;
+    unsigned count;
+    unsigned next;
+    pthread_mutex_t lock;
+} EXPORT_JOBS;
+
+static void *export_thread(void *data)
+{
+    EXPORT_JOBS *jobs = (EXPORT_JOBS*)data;
+    unsigned i;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&jobs->lock);
+        i = jobs->next;
+        if (i < jobs->count)
+            ++jobs->next;
+        pthread_mutex_unlock(&jobs->lock);
+        if (i >= jobs->count)
+            break;
+
+        run_writers(jobs->ttbin, &jobs->writers[i], &jobs->files[i], 1);
+    }
+    return 0;
+}
+
+/*****************************************************************************/
+
+/* runs the writers concurrently, each walking the records itself; the
+   calling thread is one of the workers, so this still completes if no
+   threads can be started */
+static int run_writers_parallel(TTBIN_FILE *ttbin, const EXPORT_WRITER *const *writers,
+    FILE *const *files, unsigned count, unsigned threads)
+{
+    pthread_t workers[OFFLINE_FORMAT_COUNT];
+    EXPORT_JOBS jobs;
+    unsigned i, started = 0;
+
+    /* the timeline, columns and laps are built on first use, which isn't safe to
+       do from several threads at once */
+    if (!ttbin_timeline(ttbin))
+        return 0;
+    for (i = 0; i < count; ++i)
+    {
+        if (needs_columns(writers[i]) && ttbin->gps_records.count && !ttbin->columns)
+            build_ttbin_columns(ttbin);
+        if (writers[i]->uses_laps && !ttbin->laps)
+            build_ttbin_laps(ttbin);
+    }
+    /* localtime_r needn't read the time zone itself */
+    tzset();
+
+    jobs.ttbin   = ttbin;
+    jobs.writers = writers;
+    jobs.files   = files;
+    jobs.count   = count;
+    jobs.next    = 0;
+    pthread_mutex_init(&jobs.lock, 0);
+
+    while ((started + 1 < threads) && (pthread_create(&workers[started], 0, export_thread, &jobs) == 0))
+        ++started;
+    export_thread(&jobs);
+    for (i = 0; i < started; ++i)
+        pthread_join(workers[i], 0);
+
+    pthread_mutex_destroy(&jobs.lock);
+    return 1;
+}
+
+/*****************************************************************************/
+
+void export_with_writer(const EXPORT_WRITER *writer, TTBIN_FILE *ttbin, FILE *file)
+{
+    run_writers(ttbin, &writer, &file, 1);
+}
+
+/*****************************************************************************/
+
+int export_files(TTBIN_FILE *ttbin, FILE *const files[OFFLINE_FORMAT_COUNT])
+{
+    const EXPORT_WRITER *writers[OFFLINE_FORMAT_COUNT];
+    FILE *outputs[OFFLINE_FORMAT_COUNT];
+    unsigned i, count = 0;
+    unsigned threads;
+
+    for (i = 0; i < OFFLINE_FORMAT_COUNT; ++i)
+    {
+        if (files[i] && OFFLINE_FORMATS[i].writer)
+        {
+            writers[count] = OFFLINE_FORMATS[i].writer;
+            outputs[count++] = files[i];
+        }
+    }
+
+    threads = export_threads;
+    if (!threads)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = (cpus > 0) ? (unsigned)cpus : 1;
+    }
+    if (threads > count)
+        threads = count;
+
+    /* with a single thread, write everything in one pass of the records */
+    if (threads <= 1)
+        return run_writers(ttbin, writers, outputs, count);
+    return run_writers_parallel(ttbin, writers, outputs, count, threads);
+}
+
+/*****************************************************************************/
+
+static int format_applies(const OFFLINE_FORMAT *format, uint8_t activity, int have_gps)
+{
+    return (format->gps_ok && have_gps)
+        || (format->treadmill_ok && (activity == ACTIVITY_TREADMILL))
+        || (format->pool_swim_ok && (activity == ACTIVITY_SWIMMING))
+        || (format->indoor_ok && ((activity == ACTIVITY_INDOOR) || (activity == ACTIVITY_GYM)));
+}
+
+/*****************************************************************************/
+
+#define STREAM_CHUNK_SIZE   (65536)
+
+/* what the start of the file says about it; the activity is really only
+   known from the summary at the end, but the first status record has it too */
+typedef struct
+{
+    int have_activity;
+    uint8_t activity;
+    int have_gps;
+} STREAM_PROBE;
+
+static int probe_record(TTBIN_FILE *ttbin, const TTBIN_RECORD *record, void *data)
+{
+    STREAM_PROBE *probe = (STREAM_PROBE*)data;
+    (void)ttbin;
+
+    if ((record->tag == TAG_STATUS) && !probe->have_activity)
+    {
+        probe->activity = record->status.activity;
+        probe->have_activity = 1;
+    }
+    else if (record->tag == TAG_GPS)
+        probe->have_gps = 1;
+    return 1;
+}
+
+/*****************************************************************************/
+
+typedef struct
+{
+    const EXPORT_WRITER *writer;
+    FILE *file;
+    const STREAM_PROBE *probe;
+    TTBIN_TIMELINE timeline;    /* no samples, just the distance factor */
+    TTBIN_SAMPLER *sampler;
+    TTBIN_FILE *ttbin;
+    void *state;
+} EXPORT_STREAM;
+
+static int stream_header(TTBIN_FILE *ttbin, void *data)
+{
+    EXPORT_STREAM *stream = (EXPORT_STREAM*)data;
+
+    /* the writers decide what to write from the activity and whether there
+       are any GPS records, which the file itself only says at the end */
+    ttbin->activity = stream->probe->activity;
+    ttbin->timeline = &stream->timeline;
+    stream->ttbin = ttbin;
+    stream->state = (*stream->writer->begin)(ttbin, stream->file, stream->probe->have_gps);
+    return 1;
+}
+
+static int stream_record(TTBIN_FILE *ttbin, const TTBIN_RECORD *record, void *data)
+{
+    EXPORT_STREAM *stream = (EXPORT_STREAM*)data;
+    /* the writers don't modify the records, they just aren't declared const */
+    TTBIN_RECORD *current = (TTBIN_RECORD*)record;
+    TTBIN_SAMPLE sample;
+
+    if (stream->state)
+    {
+        if (ttbin_sampler_add(stream->sampler, ttbin, current, &sample))
+            (*stream->writer->record)(stream->state, current, &sample);
+        else
+            (*stream->writer->record)(stream->state, current, 0);
+    }
+    return 1;
+}
+
+/*****************************************************************************/
+
+static int stream_data(FILE *input, uint32_t format, FILE *output)
+{
+    static const TTBIN_PARSER_CALLBACKS probe_callbacks = { 0, probe_record };
+    static const TTBIN_PARSER_CALLBACKS stream_callbacks = { stream_header, stream_record };
+    const OFFLINE_FORMAT *fmt = 0;
+    TTBIN_PARSER *parser;
+    TTBIN_FILE *ttbin;
+    STREAM_PROBE probe = { 0 };
+    EXPORT_STREAM stream;
+    uint8_t *data = 0, *new_data;
+    size_t size = 0, capacity = 0, length;
+    int streaming = 0, ok = 1;
+    unsigned i;
+
+    for (i = 0; i < OFFLINE_FORMAT_COUNT; ++i)
+    {
+        if (OFFLINE_FORMATS[i].mask == format)
+            fmt = &OFFLINE_FORMATS[i];
+    }
+    if (!fmt || !fmt->writer)
+        return 0;
+
+    /* read until the start of the file says whether the format applies; the
+       treadmill distances are scaled to match the summary, and writers that
+       use the columns or laps need every record up front, so those can't be
+       streamed */
+    parser = ttbin_parser_create(&probe_callbacks, &probe);
+    if (!parser)
+        return -1;
+    for (;;)
+    {
+        if (capacity - size < STREAM_CHUNK_SIZE)
+        {
+            new_data = realloc(data, capacity + STREAM_CHUNK_SIZE);
+            if (!new_data)
+            {
+                ok = 0;
+                break;
+            }
+            data = new_data;
+            capacity += STREAM_CHUNK_SIZE;
+        }
+        length = fread(data + size, 1, STREAM_CHUNK_SIZE, input);
+        if (!length)
+            break;
+        if (needs_columns(fmt->writer) || fmt->writer->uses_laps)
+        {
+            size += length;
+            break;
+        }
+        if (!ttbin_parser_feed(parser, data + size, length))
+        {
+            ok = 0;
+            break;
+        }
+        size += length;
+
+        if (probe.have_activity)
+        {
+            if (probe.activity == ACTIVITY_TREADMILL)
+                break;
+            if (format_applies(fmt, probe.activity, probe.have_gps))
+            {
+                streaming = 1;
+                break;
+            }
+        }
+    }
+    free_ttbin(ttbin_parser_finish(parser));
+    if (!ok || ferror(input))
+    {
+        free(data);
+        return -1;
+    }
+
+    if (!streaming)
+    {
+        /* read the rest of the file and convert it as a whole */
+        while (!feof(input) && !ferror(input))
+        {
+            if (capacity - size < STREAM_CHUNK_SIZE)
+            {
+                new_data = realloc(data, capacity + STREAM_CHUNK_SIZE);
+                if (!new_data)
+                {
+                    free(data);
+                    return -1;
+                }
+                data = new_data;
+                capacity += STREAM_CHUNK_SIZE;
+            }
+            size += fread(data + size, 1, STREAM_CHUNK_SIZE, input);
+        }
+        if (ferror(input))
+        {
+            free(data);
+            return -1;
+        }
+
+        ttbin = parse_ttbin_data(data, size);
+        free(data);
+        if (!ttbin)
+            return -1;
+        ok = format_applies(fmt, ttbin->activity, ttbin->gps_records.count);
+        if (ok)
+            export_with_writer(fmt->writer, ttbin, output);
+        free_ttbin(ttbin);
+        return ok;
+    }
+
+    /* parse the file again, this time passing each record straight on to
+       the writer, starting with what has already been read */
+    stream.writer   = fmt->writer;
+    stream.file     = output;
+    stream.probe    = &probe;
+    stream.timeline.samples         = 0;
+    stream.timeline.count           = 0;
+    stream.timeline.distance_factor = 1;
+    stream.sampler  = ttbin_sampler_create(1);
+    stream.ttbin    = 0;
+    stream.state    = 0;
+
+    parser = stream.sampler ? ttbin_parser_create(&stream_callbacks, &stream) : 0;
+    if (!parser)
+    {
+        ttbin_sampler_free(stream.sampler);
+        free(data);
+        return -1;
+    }
+
+    ok = ttbin_parser_feed(parser, data, size);
+    while (ok && ((length = fread(data, 1, STREAM_CHUNK_SIZE, input)) > 0))
+        ok = ttbin_parser_feed(parser, data, length);
+    free(data);
+    if (ferror(input))
+        ok = 0;
+
+    /* by now the summary has been read, which the writers finish with */
+    if (stream.state)
+        (*stream.writer->finish)(stream.state);
+    if (stream.ttbin)
+        stream.ttbin->timeline = 0;
+    ttbin = ttbin_parser_finish(parser);
+    ttbin_sampler_free(stream.sampler);
+    if (!ttbin || !ok)
+    {
+        free_ttbin(ttbin);
+        return -1;
+    }
+    free_ttbin(ttbin);
+    return 1;
+}
+
+/*****************************************************************************/
+
+int export_stream(FILE *input, uint32_t format, FILE *output)
+{
+    int result;
+    FILE *data = decompress_stream(input);
+    if (!data)
+        return -1;
+    result = stream_data(data, format, output);
+    fclose(data);
+    return result;
+}
+
+/*****************************************************************************/
+
 uint32_t export_formats(TTBIN_FILE *ttbin, uint32_t formats)
 {
+    FILE *files[OFFLINE_FORMAT_COUNT] = { 0 };
     unsigned i;
-    FILE *f;
+    int result;
 
     for (i = 0; i < OFFLINE_FORMAT_COUNT; ++i)
     {
@@ -65,12 +523,12 @@ uint32_t export_formats(TTBIN_FILE *ttbin, uint32_t formats)
                 || (OFFLINE_FORMATS[i].treadmill_ok && (ttbin->activity == ACTIVITY_TREADMILL))
                 || (OFFLINE_FORMATS[i].pool_swim_ok && (ttbin->activity == ACTIVITY_SWIMMING)))
             {
-                f = fopen(create_filename(ttbin, OFFLINE_FORMATS[i].name), "w");
-                if (f)
-                {
-                    (*OFFLINE_FORMATS[i].producer)(ttbin, f);
-                    fclose(f);
-                }
+                char filename[256];
+                snprintf(filename, sizeof(filename), "%s%s",
+                    create_filename(ttbin, OFFLINE_FORMATS[i].name), compression_suffix(export_compression));
+                files[i] = fopen_compressed(filename, export_compression);
+                if (files[i])
+                    setvbuf(files[i], 0, _IOFBF, EXPORT_BUFFER_SIZE);
                 else
                     formats &= ~OFFLINE_FORMATS[i].mask;
             }
@@ -81,6 +539,19 @@ uint32_t export_formats(TTBIN_FILE *ttbin, uint32_t formats)
             formats &= ~OFFLINE_FORMATS[i].mask;
     }
 
+    /* write all the formats together rather than walking the file for each */
+    result = export_files(ttbin, files);
+
+    for (i = 0; i < OFFLINE_FORMAT_COUNT; ++i)
+    {
+        if (files[i])
+        {
+            fclose(files[i]);
+            if (!result)
+                formats &= ~OFFLINE_FORMATS[i].mask;
+        }
+    }
+
     return formats;
 }
 /*****************************************************************************/
@@ -3,205 +3,225 @@
 ** CSV export code                                                           **
 \*****************************************************************************/
 
-#include "ttbin.h"
-#include "protobuf.h"
+#include "export.h"
 #include "cycling_cadence.h"
+#include "emitter.h"
 
 #include <math.h>
+#include <stdlib.h>
 
-void export_csv(TTBIN_FILE *ttbin, FILE *file)
+typedef struct
 {
-    uint32_t steps_prev = 0;
-    uint32_t current_lap = 1;
-    char timestr[32];
-    TTBIN_RECORD *record;
+    TTBIN_FILE *ttbin;
+    uint32_t steps_prev;
+    uint32_t current_lap;
     unsigned heart_rate;
-    double distance_factor = 1;
-    unsigned time;
-    time_t timestamp;
-    CyclingCadenceData cc_data = cc_initialize();
+    CyclingCadenceData cc_data;
+    EMIT_TIME local_time;
+    EMITTER out;
+} CSV_STATE;
 
-    fputs("time,activityType,lapNumber,distance,speed,calories,lat,long,elevation,heartRate,cycles,localtime,elapsedTime,cyclingCadence,wheelSpeed\r\n", file);
+static void *begin_csv(TTBIN_FILE *ttbin, FILE *file, int have_gps)
+{
+    CSV_STATE *state = (CSV_STATE*)malloc(sizeof(CSV_STATE));
+    (void)have_gps;
+    if (!state)
+        return 0;
+    state->ttbin       = ttbin;
+    state->steps_prev  = 0;
+    state->current_lap = 1;
+    state->heart_rate  = 0;
+    state->cc_data     = cc_initialize();
+    emit_time_init(&state->local_time, 0);
+    emit_init(&state->out, file);
+
+    emit_str(&state->out, "time,activityType,lapNumber,distance,speed,calories,lat,long,elevation,heartRate,cycles,localtime,elapsedTime,cyclingCadence,wheelSpeed\r\n");
+    return state;
+}
+
+/* writes ",h:mm:ss" or ",m:ss" */
+static void emit_elapsed_time(EMITTER *out, unsigned time)
+{
+    emit_char(out, ',');
+    if (time >= 3600)
+    {
+        emit_int(out, time / 3600);
+        emit_char(out, ':');
+        emit_padded(out, (time % 3600) / 60, 2);
+    }
+    else
+        emit_int(out, time / 60);
+    emit_char(out, ':');
+    emit_padded(out, time % 60, 2);
+}
+
+static void write_csv_record(void *ptr, TTBIN_RECORD *record, const TTBIN_SAMPLE *sample)
+{
+    CSV_STATE *state = (CSV_STATE*)ptr;
+    TTBIN_FILE *ttbin = state->ttbin;
+    EMITTER *out = &state->out;
+    unsigned time;
 
     switch (ttbin->activity)
     {
     case ACTIVITY_RUNNING:
     case ACTIVITY_CYCLING:
     case ACTIVITY_FREESTYLE:
-        heart_rate = 0;
-        current_lap = 1;
-        for (record = ttbin->first; record; record = record->next)
-        {
-            switch (record->tag)
-            {
-            case TAG_GPS:
-                /* this will happen if the activity is paused and then resumed, or if the GPS signal is lost  */
-                if ((record->gps.timestamp == 0) || ((record->gps.latitude == 0) && (record->gps.longitude == 0)))
-                    continue;
-
-                strftime(timestr, sizeof(timestr), "%FT%X", localtime(&record->gps.timestamp));
-
-                time = (unsigned)(record->gps.timestamp - ttbin->timestamp_utc);
-                fprintf(file, "%u,%d,%d,%.5f,%.2f,%d,%.7f,%.7f,",
-                    time, ttbin->activity, current_lap, record->gps.cum_distance, record->gps.instant_speed,
-                    record->gps.calories, record->gps.latitude, record->gps.longitude);
-                if (!isnan(record->gps.elevation))
-                    fprintf(file, "%.2f", record->gps.elevation);
-                fputs(",", file);
-                if (heart_rate > 0)
-                    fprintf(file, "%d", heart_rate);
-                fprintf(file, ",%d,%s", record->gps.cycles, timestr);
-                if (time >= 3600)
-                    fprintf(file, ",%d:%02d:%02d", time / 3600, (time % 3600) / 60, time % 60);
-                else
-                    fprintf(file, ",%d:%02d", time / 60, time % 60);
-                fprintf(file, ",%d,%f\r\n", cc_data.cycling_cadence, cc_data.wheel_speed);
-                cc_gps_packet_tick(&cc_data);
-                heart_rate = 0;
-                break;
-            case TAG_HEART_RATE:
-                heart_rate = record->heart_rate.heart_rate;
-                break;
-            case TAG_WHEEL_SIZE:
-                cc_set_wheel_size(&cc_data, &record->wheel_size);
-                break;
-            case TAG_CYCLING_CADENCE:
-                cc_sensor_packet(&cc_data, &record->cycling_cadence);
-                break;
-            case TAG_LAP:
-                ++current_lap;
-                break;
-            }
-        }
+        if (!sample || (record->tag != TAG_GPS))
+            break;
+
+        time = (unsigned)(sample->timestamp - ttbin->timestamp_utc);
+        emit_int(out, time);
+        emit_char(out, ',');
+        emit_int(out, ttbin->activity);
+        emit_char(out, ',');
+        emit_int(out, sample->lap + 1);
+        emit_char(out, ',');
+        emit_fixed(out, sample->distance, 5);
+        emit_char(out, ',');
+        emit_fixed(out, sample->speed, 2);
+        emit_char(out, ',');
+        emit_int(out, sample->calories);
+        emit_char(out, ',');
+        emit_fixed(out, sample->latitude, 7);
+        emit_char(out, ',');
+        emit_fixed(out, sample->longitude, 7);
+        emit_char(out, ',');
+        if (!isnan(sample->elevation))
+            emit_fixed(out, sample->elevation, 2);
+        emit_char(out, ',');
+        if (sample->heart_rate > 0)
+            emit_int(out, sample->heart_rate);
+        emit_char(out, ',');
+        emit_int(out, sample->cycles);
+        emit_char(out, ',');
+        emit_str(out, emit_format_time(&state->local_time, sample->timestamp));
+        emit_elapsed_time(out, time);
+        emit_char(out, ',');
+        emit_int(out, sample->cycling_cadence);
+        emit_char(out, ',');
+        emit_fixed(out, sample->wheel_speed, 6);
+        emit_str(out, "\r\n");
         break;
 
     case ACTIVITY_TREADMILL:
-        heart_rate = 0;
-        current_lap = 1;
-        for (record = ttbin->last; record; record = record->prev)
-        {
-            if ((record->tag == TAG_TREADMILL) && record->treadmill.distance)
-            {
-                distance_factor = ttbin->total_distance / record->treadmill.distance;
-                break;
-            }
-        }
-        for (record = ttbin->first; record; record = record->next)
-        {
-            switch (record->tag)
-            {
-            case TAG_TREADMILL:
-                /* this will happen if the activity is paused and then resumed */
-                if (record->treadmill.timestamp == 0)
-                    continue;
-
-                strftime(timestr, sizeof(timestr), "%FT%X", localtime(&record->treadmill.timestamp));
-
-                time = (unsigned)(record->treadmill.timestamp - ttbin->timestamp_utc);
-                fprintf(file, "%u,7,%u,%.2f,,%d,,,,", time, current_lap,
-                    record->treadmill.distance * distance_factor, record->treadmill.calories);
-                if (heart_rate > 0)
-                    fprintf(file, "%d", heart_rate);
-                fprintf(file, ",%d,%s", record->treadmill.steps - steps_prev, timestr);
-                if (time >= 3600)
-                    fprintf(file, ",%d:%02d:%02d,,\r\n", time / 3600, (time % 3600) / 60, time % 60);
-                else
-                    fprintf(file, ",%d:%02d,,\r\n", time / 60, time % 60);
-                steps_prev = record->treadmill.steps;
-                heart_rate = 0;
-                break;
-            case TAG_HEART_RATE:
-                heart_rate = record->heart_rate.heart_rate;
-                break;
-            case TAG_LAP:
-                ++current_lap;
-                break;
-            }
-        }
+        if (!sample || (record->tag != TAG_TREADMILL))
+            break;
+
+        time = (unsigned)(sample->timestamp - ttbin->timestamp_utc);
+        emit_int(out, time);
+        emit_str(out, ",7,");
+        emit_int(out, sample->lap + 1);
+        emit_char(out, ',');
+        emit_fixed(out, sample->distance, 2);
+        emit_str(out, ",,");
+        emit_int(out, record->treadmill.calories);
+        emit_str(out, ",,,,");
+        if (sample->heart_rate > 0)
+            emit_int(out, sample->heart_rate);
+        emit_char(out, ',');
+        emit_int(out, (int32_t)(record->treadmill.steps - state->steps_prev));
+        emit_char(out, ',');
+        emit_str(out, emit_format_time(&state->local_time, sample->timestamp));
+        emit_elapsed_time(out, time);
+        emit_str(out, ",,\r\n");
+        state->steps_prev = record->treadmill.steps;
         break;
 
     case ACTIVITY_SWIMMING:
-        for (record = ttbin->first; record; record = record->next)
-        {
-            if (record->tag != TAG_SWIM)
-                continue;
-
-            /* this will happen if the activity is paused and then resumed */
-            if (record->swim.timestamp == 0)
-                continue;
-
-            strftime(timestr, sizeof(timestr), "%FT%X", localtime(&record->swim.timestamp));
-
-            time = (unsigned)(record->swim.timestamp - ttbin->timestamp_utc);
-            fprintf(file, "%u,2,%d,%.2f,,%d,,,,,%d,%s",
-                time, record->swim.completed_laps + 1, record->swim.total_distance,
-                record->swim.total_calories, record->swim.strokes * 60, timestr);
-            if (time >= 3600)
-                fprintf(file, ",%d:%02d:%02d,,\r\n", time / 3600, (time % 3600) / 60, time % 60);
-            else
-                fprintf(file, ",%d:%02d,,\r\n", time / 60, time % 60);
-        }
+        if (record->tag != TAG_SWIM)
+            break;
+
+        /* this will happen if the activity is paused and then resumed */
+        if (record->swim.timestamp == 0)
+            break;
+
+        time = (unsigned)(record->swim.timestamp - ttbin->timestamp_utc);
+        emit_int(out, time);
+        emit_str(out, ",2,");
+        emit_int(out, (int32_t)(record->swim.completed_laps + 1));
+        emit_char(out, ',');
+        emit_fixed(out, record->swim.total_distance, 2);
+        emit_str(out, ",,");
+        emit_int(out, record->swim.total_calories);
+        emit_str(out, ",,,,,");
+        emit_int(out, (int32_t)(record->swim.strokes * 60));
+        emit_char(out, ',');
+        emit_str(out, emit_format_time(&state->local_time, record->swim.timestamp));
+        emit_elapsed_time(out, time);
+        emit_str(out, ",,\r\n");
         break;
 
     case ACTIVITY_INDOOR:
     case ACTIVITY_GYM:
-        for (record = ttbin->first; record; record = record->next)
+        switch (record->tag)
         {
-          switch (record->tag)
-            {
-            case TAG_HEART_RATE:
-                heart_rate = record->heart_rate.heart_rate;
-                break;
-            case TAG_CYCLING_CADENCE:
-                cc_sensor_packet(&cc_data, &record->cycling_cadence);
-                break;
-            case TAG_WHEEL_SIZE:
-                cc_set_wheel_size(&cc_data, &record->wheel_size);
-                break;
-            case TAG_LAP:
-                ++current_lap;
-                break;
-            case TAG_INDOOR_CYCLING:
-                timestamp = record->indoor_cycling.timestamp;
-                strftime(timestr, sizeof(timestr), "%FT%X", localtime(&timestamp));
-                time = (unsigned)(record->indoor_cycling.timestamp - ttbin->timestamp_local);
-                fprintf(file, "%u,11,%u,%.2f,%.2f,%u,,,,%u,%u,%s",
-                    time,
-                    current_lap,
-                    record->indoor_cycling.distance_meters,
-                    cc_data.wheel_speed,
-                    record->indoor_cycling.calories,
-                    heart_rate,
-                    record->indoor_cycling.cycling_cadence,
-                    timestr
-                );
-                if (time >= 3600)
-                    fprintf(file, ",%d:%02d:%02d,,\r\n", time / 3600, (time % 3600) / 60, time % 60);
-                else
-                    fprintf(file, ",%d:%02d,,\r\n", time / 60, time % 60);
-                break;
-            case TAG_GYM:
-                timestamp = record->gym.timestamp;
-                strftime(timestr, sizeof(timestr), "%FT%X", localtime(&timestamp));
-                time = (unsigned)(record->indoor_cycling.timestamp - ttbin->timestamp_local);
-                fprintf(file, "%u,9,%u,,,%u,,,,%u,%u,%s",
-                    time,
-                    current_lap,
-                    record->gym.total_calories,
-                    heart_rate,
-                    record->gym.total_cycles,
-                    timestr
-                );
-                if (time >= 3600)
-                    fprintf(file, ",%d:%02d:%02d,,\r\n", time / 3600, (time % 3600) / 60, time % 60);
-                else
-                    fprintf(file, ",%d:%02d,,\r\n", time / 60, time % 60);
-                break;
-            }
+        case TAG_HEART_RATE:
+            state->heart_rate = record->heart_rate.heart_rate;
+            break;
+        case TAG_CYCLING_CADENCE:
+            cc_sensor_packet(&state->cc_data, &record->cycling_cadence);
+            break;
+        case TAG_WHEEL_SIZE:
+            cc_set_wheel_size(&state->cc_data, &record->wheel_size);
+            break;
+        case TAG_LAP:
+            ++state->current_lap;
+            break;
+        case TAG_INDOOR_CYCLING:
+            time = (unsigned)(record->indoor_cycling.timestamp - ttbin->timestamp_local);
+            emit_int(out, time);
+            emit_str(out, ",11,");
+            emit_int(out, state->current_lap);
+            emit_char(out, ',');
+            emit_fixed(out, record->indoor_cycling.distance_meters, 2);
+            emit_char(out, ',');
+            emit_fixed(out, state->cc_data.wheel_speed, 2);
+            emit_char(out, ',');
+            emit_int(out, record->indoor_cycling.calories);
+            emit_str(out, ",,,,");
+            emit_int(out, state->heart_rate);
+            emit_char(out, ',');
+            emit_int(out, record->indoor_cycling.cycling_cadence);
+            emit_char(out, ',');
+            emit_str(out, emit_format_time(&state->local_time, record->indoor_cycling.timestamp));
+            emit_elapsed_time(out, time);
+            emit_str(out, ",,\r\n");
+            break;
+        case TAG_GYM:
+            time = (unsigned)(record->indoor_cycling.timestamp - ttbin->timestamp_local);
+            emit_int(out, time);
+            emit_str(out, ",9,");
+            emit_int(out, state->current_lap);
+            emit_str(out, ",,,");
+            emit_int(out, record->gym.total_calories);
+            emit_str(out, ",,,,");
+            emit_int(out, state->heart_rate);
+            emit_char(out, ',');
+            emit_int(out, record->gym.total_cycles);
+            emit_char(out, ',');
+            emit_str(out, emit_format_time(&state->local_time, record->gym.timestamp));
+            emit_elapsed_time(out, time);
+            emit_str(out, ",,\r\n");
+            break;
         }
         break;
     }
+}
 
+static void finish_csv(void *ptr)
+{
+    CSV_STATE *state = (CSV_STATE*)ptr;
+
+    emit_flush(&state->out);
+    free(state);
+}
+
+const EXPORT_WRITER CSV_WRITER = { begin_csv, write_csv_record, finish_csv, 0, 0, 0 };
+
+void export_csv(TTBIN_FILE *ttbin, FILE *file)
+{
+    export_with_writer(&CSV_WRITER, ttbin, file);
 }
 
 void export_protobuf_csv(PROTOBUF_FILE *protobuf, FILE *file)
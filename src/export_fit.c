@@ -0,0 +1,643 @@
+/*****************************************************************************\
+** export_fit.c                                                              **
+** FIT export code                                                           **
+\*****************************************************************************/
+
+#include "export.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* FIT timestamps count seconds from 1989-12-31 00:00:00 UTC */
+#define FIT_EPOCH               (631065600)
+
+#define FIT_PROTOCOL_VERSION    (0x10)  /* 1.0 */
+#define FIT_PROFILE_VERSION     (2093)  /* 20.93 */
+#define FIT_HEADER_SIZE         (14)
+
+#define FIT_MANUFACTURER_TOMTOM (71)
+
+/* base types */
+#define FIT_ENUM    (0x00)
+#define FIT_UINT8   (0x02)
+#define FIT_SINT32  (0x85)
+#define FIT_UINT16  (0x84)
+#define FIT_UINT32  (0x86)
+
+/* invalid values, for fields that have no data */
+#define FIT_INVALID_UINT8   (0xff)
+#define FIT_INVALID_UINT16  (0xffff)
+#define FIT_INVALID_UINT32  (0xffffffff)
+#define FIT_INVALID_SINT32  (0x7fffffff)
+
+/* enum values */
+#define FIT_FILE_ACTIVITY           (4)
+#define FIT_EVENT_TIMER             (0)
+#define FIT_EVENT_SESSION           (8)
+#define FIT_EVENT_LAP               (9)
+#define FIT_EVENT_ACTIVITY          (26)
+#define FIT_EVENT_TYPE_START        (0)
+#define FIT_EVENT_TYPE_STOP         (1)
+#define FIT_EVENT_TYPE_STOP_ALL     (4)
+#define FIT_LAP_TRIGGER_MANUAL      (0)
+#define FIT_LAP_TRIGGER_TIME        (1)
+#define FIT_LAP_TRIGGER_DISTANCE    (2)
+#define FIT_LAP_TRIGGER_SESSION_END (7)
+#define FIT_SESSION_TRIGGER_END     (0)
+#define FIT_ACTIVITY_MANUAL         (0)
+
+/* the messages written, indexed by their local message type */
+enum
+{
+    FIT_MSG_FILE_ID,
+    FIT_MSG_EVENT,
+    FIT_MSG_RECORD,
+    FIT_MSG_LAP,
+    FIT_MSG_SESSION,
+    FIT_MSG_ACTIVITY,
+    FIT_MSG_COUNT
+};
+
+typedef struct
+{
+    uint8_t number;
+    uint8_t size;
+    uint8_t base_type;
+} FIT_FIELD;
+
+typedef struct
+{
+    uint16_t global;
+    uint8_t field_count;
+    const FIT_FIELD *fields;
+} FIT_MESSAGE;
+
+static const FIT_FIELD FILE_ID_FIELDS[] = {
+    { 0, 1, FIT_ENUM },     /* type */
+    { 1, 2, FIT_UINT16 },   /* manufacturer */
+    { 2, 2, FIT_UINT16 },   /* product */
+    { 4, 4, FIT_UINT32 },   /* time_created */
+};
+
+static const FIT_FIELD EVENT_FIELDS[] = {
+    { 253, 4, FIT_UINT32 }, /* timestamp */
+    { 0, 1, FIT_ENUM },     /* event */
+    { 1, 1, FIT_ENUM },     /* event_type */
+};
+
+static const FIT_FIELD RECORD_FIELDS[] = {
+    { 253, 4, FIT_UINT32 }, /* timestamp */
+    { 0, 4, FIT_SINT32 },   /* position_lat, semicircles */
+    { 1, 4, FIT_SINT32 },   /* position_long, semicircles */
+    { 2, 2, FIT_UINT16 },   /* altitude, (m + 500) * 5 */
+    { 3, 1, FIT_UINT8 },    /* heart_rate, bpm */
+    { 4, 1, FIT_UINT8 },    /* cadence, rpm */
+    { 5, 4, FIT_UINT32 },   /* distance, cm */
+    { 6, 2, FIT_UINT16 },   /* speed, mm/s */
+};
+
+static const FIT_FIELD LAP_FIELDS[] = {
+    { 254, 2, FIT_UINT16 }, /* message_index */
+    { 253, 4, FIT_UINT32 }, /* timestamp */
+    { 0, 1, FIT_ENUM },     /* event */
+    { 1, 1, FIT_ENUM },     /* event_type */
+    { 2, 4, FIT_UINT32 },   /* start_time */
+    { 3, 4, FIT_SINT32 },   /* start_position_lat */
+    { 4, 4, FIT_SINT32 },   /* start_position_long */
+    { 5, 4, FIT_SINT32 },   /* end_position_lat */
+    { 6, 4, FIT_SINT32 },   /* end_position_long */
+    { 7, 4, FIT_UINT32 },   /* total_elapsed_time, ms */
+    { 8, 4, FIT_UINT32 },   /* total_timer_time, ms */
+    { 9, 4, FIT_UINT32 },   /* total_distance, cm */
+    { 10, 4, FIT_UINT32 },  /* total_cycles */
+    { 11, 2, FIT_UINT16 },  /* total_calories */
+    { 13, 2, FIT_UINT16 },  /* avg_speed, mm/s */
+    { 14, 2, FIT_UINT16 },  /* max_speed, mm/s */
+    { 15, 1, FIT_UINT8 },   /* avg_heart_rate */
+    { 16, 1, FIT_UINT8 },   /* max_heart_rate */
+    { 24, 1, FIT_ENUM },    /* lap_trigger */
+    { 25, 1, FIT_ENUM },    /* sport */
+};
+
+static const FIT_FIELD SESSION_FIELDS[] = {
+    { 254, 2, FIT_UINT16 }, /* message_index */
+    { 253, 4, FIT_UINT32 }, /* timestamp */
+    { 0, 1, FIT_ENUM },     /* event */
+    { 1, 1, FIT_ENUM },     /* event_type */
+    { 2, 4, FIT_UINT32 },   /* start_time */
+    { 3, 4, FIT_SINT32 },   /* start_position_lat */
+    { 4, 4, FIT_SINT32 },   /* start_position_long */
+    { 5, 1, FIT_ENUM },     /* sport */
+    { 6, 1, FIT_ENUM },     /* sub_sport */
+    { 7, 4, FIT_UINT32 },   /* total_elapsed_time, ms */
+    { 8, 4, FIT_UINT32 },   /* total_timer_time, ms */
+    { 9, 4, FIT_UINT32 },   /* total_distance, cm */
+    { 10, 4, FIT_UINT32 },  /* total_cycles */
+    { 11, 2, FIT_UINT16 },  /* total_calories */
+    { 14, 2, FIT_UINT16 },  /* avg_speed, mm/s */
+    { 15, 2, FIT_UINT16 },  /* max_speed, mm/s */
+    { 16, 1, FIT_UINT8 },   /* avg_heart_rate */
+    { 17, 1, FIT_UINT8 },   /* max_heart_rate */
+    { 25, 2, FIT_UINT16 },  /* first_lap_index */
+    { 26, 2, FIT_UINT16 },  /* num_laps */
+    { 28, 1, FIT_ENUM },    /* trigger */
+};
+
+static const FIT_FIELD ACTIVITY_FIELDS[] = {
+    { 253, 4, FIT_UINT32 }, /* timestamp */
+    { 0, 4, FIT_UINT32 },   /* total_timer_time, ms */
+    { 1, 2, FIT_UINT16 },   /* num_sessions */
+    { 2, 1, FIT_ENUM },     /* type */
+    { 3, 1, FIT_ENUM },     /* event */
+    { 4, 1, FIT_ENUM },     /* event_type */
+    { 5, 4, FIT_UINT32 },   /* local_timestamp */
+};
+
+#define FIELDS(f)   (sizeof(f) / sizeof(f[0])), f
+
+static const FIT_MESSAGE FIT_MESSAGES[FIT_MSG_COUNT] = {
+    { 0,  FIELDS(FILE_ID_FIELDS) },
+    { 21, FIELDS(EVENT_FIELDS) },
+    { 20, FIELDS(RECORD_FIELDS) },
+    { 19, FIELDS(LAP_FIELDS) },
+    { 18, FIELDS(SESSION_FIELDS) },
+    { 34, FIELDS(ACTIVITY_FIELDS) },
+};
+
+/* the largest number of fields in any message */
+#define FIT_MAX_FIELDS  (21)
+
+/* totals for a lap or the whole session */
+typedef struct
+{
+    time_t start_time;
+    uint32_t start_timer;       /* seconds of timer time before the start */
+    float start_distance;
+    unsigned start_calories;
+    int32_t start_lat, start_long;
+    unsigned samples;
+    uint32_t cycles;
+    float max_speed;
+    uint32_t total_heart_rate;
+    uint32_t heart_rate_count;
+    uint8_t max_heart_rate;
+} FIT_TOTALS;
+
+typedef struct
+{
+    TTBIN_FILE *ttbin;
+    FILE *file;
+    double distance_factor;
+    uint8_t sport, sub_sport;
+    uint8_t lap_trigger;
+    int timer_running;
+    time_t last_timestamp;
+    int32_t last_lat, last_long;
+    uint32_t steps_prev;
+    unsigned lap_count;
+    FIT_TOTALS lap;
+    FIT_TOTALS session;
+    unsigned defined;           /* bit mask of the local messages defined */
+    uint8_t *data;              /* everything after the file header */
+    size_t length;
+    size_t size;
+    int failed;
+} FIT_STATE;
+
+static uint16_t fit_crc(uint16_t crc, const uint8_t *data, size_t length)
+{
+    static const uint16_t CRC_TABLE[16] = {
+        0x0000, 0xcc01, 0xd801, 0x1400, 0xf001, 0x3c00, 0x2800, 0xe401,
+        0xa001, 0x6c00, 0x7800, 0xb401, 0x5000, 0x9c01, 0x8801, 0x4400
+    };
+    uint16_t tmp;
+
+    while (length--)
+    {
+        tmp = CRC_TABLE[crc & 0xf];
+        crc = ((crc >> 4) & 0x0fff) ^ tmp ^ CRC_TABLE[*data & 0xf];
+        tmp = CRC_TABLE[crc & 0xf];
+        crc = ((crc >> 4) & 0x0fff) ^ tmp ^ CRC_TABLE[(*data >> 4) & 0xf];
+        ++data;
+    }
+    return crc;
+}
+
+/* makes room for 'size' more bytes and returns a pointer to them, or 0 if
+   the memory couldn't be allocated */
+static uint8_t *fit_reserve(FIT_STATE *state, size_t size)
+{
+    uint8_t *ptr;
+
+    if (state->failed)
+        return 0;
+    if (state->length + size > state->size)
+    {
+        size_t new_size = state->size ? state->size * 2 : 65536;
+        while (new_size < state->length + size)
+            new_size *= 2;
+        ptr = (uint8_t*)realloc(state->data, new_size);
+        if (!ptr)
+        {
+            state->failed = 1;
+            return 0;
+        }
+        state->data = ptr;
+        state->size = new_size;
+    }
+    ptr = state->data + state->length;
+    state->length += size;
+    return ptr;
+}
+
+static void put_le(uint8_t *ptr, uint32_t value, unsigned size)
+{
+    while (size--)
+    {
+        *ptr++ = (uint8_t)value;
+        value >>= 8;
+    }
+}
+
+/* writes a data message, preceded by its definition the first time the
+   message is used; values holds each field's value in field order */
+static void put_message(FIT_STATE *state, unsigned local, const uint32_t *values)
+{
+    const FIT_MESSAGE *msg = &FIT_MESSAGES[local];
+    uint8_t *ptr;
+    unsigned i, size = 1;
+
+    if (!(state->defined & (1 << local)))
+    {
+        ptr = fit_reserve(state, 6 + 3 * msg->field_count);
+        if (!ptr)
+            return;
+        *ptr++ = 0x40 | local;      /* definition message header */
+        *ptr++ = 0;                 /* reserved */
+        *ptr++ = 0;                 /* little-endian */
+        put_le(ptr, msg->global, 2);
+        ptr += 2;
+        *ptr++ = msg->field_count;
+        for (i = 0; i < msg->field_count; ++i)
+        {
+            *ptr++ = msg->fields[i].number;
+            *ptr++ = msg->fields[i].size;
+            *ptr++ = msg->fields[i].base_type;
+        }
+        state->defined |= 1 << local;
+    }
+
+    for (i = 0; i < msg->field_count; ++i)
+        size += msg->fields[i].size;
+    ptr = fit_reserve(state, size);
+    if (!ptr)
+        return;
+    *ptr++ = local;                 /* data message header */
+    for (i = 0; i < msg->field_count; ++i)
+    {
+        put_le(ptr, values[i], msg->fields[i].size);
+        ptr += msg->fields[i].size;
+    }
+}
+
+static uint32_t fit_time(time_t timestamp)
+{
+    return (uint32_t)(timestamp - FIT_EPOCH);
+}
+
+static int32_t fit_semicircles(double degrees)
+{
+    return (int32_t)lround(degrees * (2147483648.0 / 180.0));
+}
+
+/* scales a value into an unsigned field, returning the invalid value if it
+   won't fit */
+static uint32_t fit_scale(double value, double scale, uint32_t invalid)
+{
+    value = value * scale + 0.5;
+    if (!(value >= 0) || (value >= invalid))
+        return invalid;
+    return (uint32_t)value;
+}
+
+static void put_event(FIT_STATE *state, time_t timestamp, uint8_t event, uint8_t event_type)
+{
+    uint32_t values[FIT_MAX_FIELDS];
+
+    values[0] = fit_time(timestamp);
+    values[1] = event;
+    values[2] = event_type;
+    put_message(state, FIT_MSG_EVENT, values);
+}
+
+static void start_totals(FIT_STATE *state, FIT_TOTALS *totals, uint32_t timer,
+    float distance, unsigned calories)
+{
+    memset(totals, 0, sizeof(FIT_TOTALS));
+    totals->start_time     = state->last_timestamp;
+    totals->start_timer    = timer;
+    totals->start_distance = distance;
+    totals->start_calories = calories;
+    totals->start_lat      = FIT_INVALID_SINT32;
+    totals->start_long     = FIT_INVALID_SINT32;
+}
+
+/* fills in the summary fields shared by the lap and session messages, from
+   total_elapsed_time to max_heart_rate */
+static void summarise_totals(const FIT_STATE *state, const FIT_TOTALS *totals, uint32_t timer,
+    float distance, unsigned calories, uint32_t *values)
+{
+    uint32_t time = timer - totals->start_timer;
+    double elapsed = difftime(state->last_timestamp, totals->start_time);
+
+    /* the elapsed time comes from the record timestamps and the timer time
+       from the watch's totals, which don't always agree; the timer can't
+       have run for longer than the lap took */
+    if (elapsed < time)
+        elapsed = time;
+
+    distance -= totals->start_distance;
+    values[0] = fit_scale(elapsed, 1000, FIT_INVALID_UINT32);
+    values[1] = fit_scale(time, 1000, FIT_INVALID_UINT32);
+    values[2] = fit_scale(distance, 100, FIT_INVALID_UINT32);
+    values[3] = totals->cycles;
+    values[4] = (calories - totals->start_calories) & 0xffff;
+    values[5] = time ? fit_scale(distance / time, 1000, FIT_INVALID_UINT16) : FIT_INVALID_UINT16;
+    values[6] = (totals->max_speed > 0) ? fit_scale(totals->max_speed, 1000, FIT_INVALID_UINT16) : FIT_INVALID_UINT16;
+    if (totals->heart_rate_count)
+    {
+        values[7] = (totals->total_heart_rate + (totals->heart_rate_count >> 1)) / totals->heart_rate_count;
+        values[8] = totals->max_heart_rate;
+    }
+    else
+        values[7] = values[8] = FIT_INVALID_UINT8;
+}
+
+static void put_lap(FIT_STATE *state, uint32_t timer, float distance, unsigned calories, uint8_t trigger)
+{
+    uint32_t values[FIT_MAX_FIELDS];
+
+    values[0] = state->lap_count++;
+    values[1] = fit_time(state->last_timestamp);
+    values[2] = FIT_EVENT_LAP;
+    values[3] = FIT_EVENT_TYPE_STOP;
+    values[4] = fit_time(state->lap.start_time);
+    values[5] = state->lap.start_lat;
+    values[6] = state->lap.start_long;
+    values[7] = state->last_lat;
+    values[8] = state->last_long;
+    summarise_totals(state, &state->lap, timer, distance, calories, &values[9]);
+    values[18] = trigger;
+    values[19] = state->sport;
+    put_message(state, FIT_MSG_LAP, values);
+
+    start_totals(state, &state->lap, timer, distance, calories);
+}
+
+static void *begin_fit(TTBIN_FILE *ttbin, FILE *file, int have_gps)
+{
+    FIT_STATE *state;
+    uint32_t values[FIT_MAX_FIELDS];
+
+    if ((ttbin->activity != ACTIVITY_TREADMILL) && (ttbin->activity != ACTIVITY_INDOOR) &&
+        (ttbin->activity != ACTIVITY_GYM) && (ttbin->activity != ACTIVITY_SWIMMING) &&
+        !have_gps)
+        return 0;
+
+    state = (FIT_STATE*)calloc(1, sizeof(FIT_STATE));
+    if (!state)
+        return 0;
+    state->ttbin = ttbin;
+    state->file  = file;
+    state->distance_factor = ttbin_timeline(ttbin)->distance_factor;   /* already built by the caller */
+    state->lap_trigger = FIT_LAP_TRIGGER_MANUAL;
+    state->last_timestamp = ttbin->timestamp_utc;
+    state->last_lat  = FIT_INVALID_SINT32;
+    state->last_long = FIT_INVALID_SINT32;
+    start_totals(state, &state->lap, 0, 0, 0);
+    start_totals(state, &state->session, 0, 0, 0);
+
+    switch (ttbin->activity)
+    {
+    case ACTIVITY_RUNNING:      state->sport = 1;  state->sub_sport = 0;  break;
+    case ACTIVITY_CYCLING:      state->sport = 2;  state->sub_sport = 0;  break;
+    case ACTIVITY_SWIMMING:     state->sport = 5;  state->sub_sport = 17; break; /* lap swimming */
+    case ACTIVITY_TREADMILL:    state->sport = 1;  state->sub_sport = 1;  break; /* treadmill */
+    case ACTIVITY_GYM:          state->sport = 10; state->sub_sport = 0;  break; /* training */
+    case ACTIVITY_HIKING:       state->sport = 17; state->sub_sport = 0;  break;
+    case ACTIVITY_INDOOR:       state->sport = 2;  state->sub_sport = 6;  break; /* indoor cycling */
+    case ACTIVITY_TRAILRUNNING: state->sport = 1;  state->sub_sport = 3;  break; /* trail */
+    case ACTIVITY_SKIING:       state->sport = 13; state->sub_sport = 0;  break; /* alpine skiing */
+    case ACTIVITY_SNOWBOARDING: state->sport = 14; state->sub_sport = 0;  break;
+    default:                    state->sport = 0;  state->sub_sport = 0;  break;
+    }
+
+    values[0] = FIT_FILE_ACTIVITY;
+    values[1] = FIT_MANUFACTURER_TOMTOM;
+    values[2] = ttbin->product_id;
+    values[3] = fit_time(ttbin->timestamp_utc);
+    put_message(state, FIT_MSG_FILE_ID, values);
+
+    put_event(state, ttbin->timestamp_utc, FIT_EVENT_TIMER, FIT_EVENT_TYPE_START);
+    state->timer_running = 1;
+    return state;
+}
+
+static void add_heart_rate(FIT_TOTALS *totals, uint8_t heart_rate)
+{
+    if (heart_rate > totals->max_heart_rate)
+        totals->max_heart_rate = heart_rate;
+    totals->total_heart_rate += heart_rate;
+    ++totals->heart_rate_count;
+}
+
+static void write_fit_record(void *ptr, TTBIN_RECORD *record, const TTBIN_SAMPLE *sample)
+{
+    FIT_STATE *state = (FIT_STATE*)ptr;
+    TTBIN_FILE *ttbin = state->ttbin;
+    uint32_t values[FIT_MAX_FIELDS];
+    uint32_t cycles = 0;
+    int cadence = -1;
+
+    switch (record->tag)
+    {
+    case TAG_TRAINING_SETUP:
+        switch (record->training_setup.type)
+        {
+        case TRAINING_LAPS_TIME:     state->lap_trigger = FIT_LAP_TRIGGER_TIME;     break;
+        case TRAINING_LAPS_DISTANCE: state->lap_trigger = FIT_LAP_TRIGGER_DISTANCE; break;
+        }
+        break;
+
+    case TAG_STATUS:
+        if (record->status.timestamp > state->last_timestamp)
+            state->last_timestamp = record->status.timestamp;
+        if ((record->status.status == TTBIN_STATUS_PAUSED) && state->timer_running)
+        {
+            put_event(state, state->last_timestamp, FIT_EVENT_TIMER, FIT_EVENT_TYPE_STOP_ALL);
+            state->timer_running = 0;
+        }
+        else if ((record->status.status == TTBIN_STATUS_ACTIVE) && !state->timer_running)
+        {
+            put_event(state, state->last_timestamp, FIT_EVENT_TIMER, FIT_EVENT_TYPE_START);
+            state->timer_running = 1;
+        }
+        break;
+
+    case TAG_HEART_RATE:
+        add_heart_rate(&state->lap, record->heart_rate.heart_rate);
+        add_heart_rate(&state->session, record->heart_rate.heart_rate);
+        break;
+
+    case TAG_LAP:
+        if (ttbin->activity == ACTIVITY_TREADMILL)
+            put_lap(state, record->lap.total_time, state->distance_factor * record->lap.total_distance,
+                record->lap.total_calories, state->lap_trigger);
+        else
+            put_lap(state, record->lap.total_time, record->lap.total_distance,
+                record->lap.total_calories, state->lap_trigger);
+        break;
+
+    case TAG_TREADMILL:
+    case TAG_INDOOR_CYCLING:
+    case TAG_GPS:
+    case TAG_GYM:
+    case TAG_SWIM:
+        /* the timeline leaves out records written while the activity was
+           paused, and GPS records without a fix */
+        if (!sample)
+            break;
+
+        state->last_timestamp = sample->timestamp;
+        ++state->lap.samples;
+        if (record->tag == TAG_GPS)
+        {
+            state->last_lat  = fit_semicircles(sample->latitude);
+            state->last_long = fit_semicircles(sample->longitude);
+            if (state->lap.start_lat == FIT_INVALID_SINT32)
+            {
+                state->lap.start_lat  = state->last_lat;
+                state->lap.start_long = state->last_long;
+            }
+            if (state->session.start_lat == FIT_INVALID_SINT32)
+            {
+                state->session.start_lat  = state->last_lat;
+                state->session.start_long = state->last_long;
+            }
+            if (sample->speed > state->lap.max_speed)
+                state->lap.max_speed = sample->speed;
+            if (sample->speed > state->session.max_speed)
+                state->session.max_speed = sample->speed;
+            cycles = sample->cycles;
+            /* cycles are steps, and running cadence is in strides per minute */
+            if (((ttbin->activity == ACTIVITY_RUNNING) || (ttbin->activity == ACTIVITY_TRAILRUNNING))
+                && (sample->cycles <= 4))
+                cadence = 30 * sample->cycles;
+        }
+        else if (record->tag == TAG_TREADMILL)
+        {
+            cycles = record->treadmill.steps - state->steps_prev;
+            state->steps_prev = record->treadmill.steps;
+            if (cycles <= 4)
+                cadence = 30 * cycles;
+        }
+        else if (record->tag == TAG_GYM)
+        {
+            cycles = record->gym.total_cycles - state->steps_prev;
+            state->steps_prev = record->gym.total_cycles;
+        }
+        else if (record->tag == TAG_SWIM)
+            cycles = record->swim.strokes;
+        state->lap.cycles += cycles;
+        state->session.cycles += cycles;
+
+        if (sample->cadence_available)
+            cadence = sample->cycling_cadence;
+
+        values[0] = fit_time(sample->timestamp);
+        values[1] = (record->tag == TAG_GPS) ? (uint32_t)state->last_lat  : FIT_INVALID_SINT32;
+        values[2] = (record->tag == TAG_GPS) ? (uint32_t)state->last_long : FIT_INVALID_SINT32;
+        values[3] = isnan(sample->elevation) ? FIT_INVALID_UINT16
+            : fit_scale(sample->elevation + 500.0, 5, FIT_INVALID_UINT16);
+        values[4] = sample->heart_rate ? sample->heart_rate : FIT_INVALID_UINT8;
+        values[5] = ((cadence >= 0) && (cadence < FIT_INVALID_UINT8)) ? (uint32_t)cadence : FIT_INVALID_UINT8;
+        values[6] = fit_scale(sample->distance, 100, FIT_INVALID_UINT32);
+        values[7] = (record->tag == TAG_GPS) ? fit_scale(sample->speed, 1000, FIT_INVALID_UINT16) : FIT_INVALID_UINT16;
+        put_message(state, FIT_MSG_RECORD, values);
+        break;
+    }
+}
+
+static void finish_fit(void *ptr)
+{
+    FIT_STATE *state = (FIT_STATE*)ptr;
+    TTBIN_FILE *ttbin = state->ttbin;
+    uint32_t values[FIT_MAX_FIELDS];
+    uint8_t header[FIT_HEADER_SIZE];
+    uint8_t crc_bytes[2];
+    uint16_t crc;
+
+    if (state->timer_running)
+        put_event(state, state->last_timestamp, FIT_EVENT_TIMER, FIT_EVENT_TYPE_STOP_ALL);
+
+    /* the time after the last lap record is a lap of its own, unless the
+       activity stopped right at the end of that lap */
+    if (!state->lap_count || state->lap.samples || (ttbin->duration != state->lap.start_timer))
+        put_lap(state, ttbin->duration, ttbin->total_distance, ttbin->total_calories,
+            FIT_LAP_TRIGGER_SESSION_END);
+
+    values[0] = 0;
+    values[1] = fit_time(state->last_timestamp);
+    values[2] = FIT_EVENT_SESSION;
+    values[3] = FIT_EVENT_TYPE_STOP;
+    values[4] = fit_time(state->session.start_time);
+    values[5] = state->session.start_lat;
+    values[6] = state->session.start_long;
+    values[7] = state->sport;
+    values[8] = state->sub_sport;
+    summarise_totals(state, &state->session, ttbin->duration, ttbin->total_distance,
+        ttbin->total_calories, &values[9]);
+    values[18] = 0;
+    values[19] = state->lap_count;
+    values[20] = FIT_SESSION_TRIGGER_END;
+    put_message(state, FIT_MSG_SESSION, values);
+
+    values[0] = fit_time(state->last_timestamp);
+    values[1] = fit_scale(ttbin->duration, 1000, FIT_INVALID_UINT32);
+    values[2] = 1;
+    values[3] = FIT_ACTIVITY_MANUAL;
+    values[4] = FIT_EVENT_ACTIVITY;
+    values[5] = FIT_EVENT_TYPE_STOP;
+    values[6] = fit_time(state->last_timestamp + (ttbin->timestamp_local - ttbin->timestamp_utc));
+    put_message(state, FIT_MSG_ACTIVITY, values);
+
+    if (!state->failed)
+    {
+        /* the header has to hold the size of the data, so the data is only
+           written once it is complete */
+        header[0] = FIT_HEADER_SIZE;
+        header[1] = FIT_PROTOCOL_VERSION;
+        put_le(&header[2], FIT_PROFILE_VERSION, 2);
+        put_le(&header[4], (uint32_t)state->length, 4);
+        memcpy(&header[8], ".FIT", 4);
+        put_le(&header[12], fit_crc(0, header, 12), 2);
+
+        crc = fit_crc(fit_crc(0, header, FIT_HEADER_SIZE), state->data, state->length);
+        put_le(crc_bytes, crc, 2);
+
+        fwrite(header, 1, FIT_HEADER_SIZE, state->file);
+        fwrite(state->data, 1, state->length, state->file);
+        fwrite(crc_bytes, 1, 2, state->file);
+    }
+
+    free(state->data);
+    free(state);
+}
+
+const EXPORT_WRITER FIT_WRITER = { begin_fit, write_fit_record, finish_fit, 0, 0, 0 };
+
+void export_fit(TTBIN_FILE *ttbin, FILE *file)
+{
+    export_with_writer(&FIT_WRITER, ttbin, file);
+}
@@ -3,89 +3,126 @@
 ** GPX export code                                                           **
 \*****************************************************************************/
 
-#include "ttbin.h"
-#include "cycling_cadence.h"
+#include "export.h"
+#include "emitter.h"
+#include "simplify.h"
 
 #include <math.h>
+#include <stdlib.h>
 
-void export_gpx(TTBIN_FILE *ttbin, FILE *file)
+typedef struct
 {
-    char timestr[32];
-    TTBIN_RECORD *record;
-    int heart_rate;
+    EMIT_TIME utc_time;
+    uint8_t *keep;              /* simplified track, 0 if every point is written */
+    uint32_t gps_index;
+    EMITTER out;
+} GPX_STATE;
 
-    if (!ttbin->gps_records.count)
-        return;
+static void *begin_gpx(TTBIN_FILE *ttbin, FILE *file, int have_gps)
+{
+    GPX_STATE *state;
+    EMITTER *out;
+    char filename[32];
 
-    fputs("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\r\n"
-          "<gpx xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\""
-          " xsi:schemaLocation=\"http://www.topografix.com/GPX/1/1"
-          " http://www.topografix.com/GPX/1/1/gpx.xsd"
-          " http://www.garmin.com/xmlschemas/GpxExtensions/v3"
-          " http://www.garmin.com/xmlschemas/GpxExtensionsv3.xsd"
-          " http://www.garmin.com/xmlschemas/TrackPointExtension/v1"
-          " http://www.garmin.com/xmlschemas/TrackPointExtensionv1.xsd\""
-          " xmlns:gpxx=\"http://www.garmin.com/xmlschemas/GpxExtensions/v3\""
-          " xmlns:gpxtpx=\"http://www.garmin.com/xmlschemas/TrackPointExtension/v1\""
-          " version=\"1.1\" creator=\"TomTom\" xmlns=\"http://www.topografix.com/GPX/1/1\">\r\n"
-          "    <metadata>\r\n        <name>", file);
-    fputs(create_filename(ttbin, "gpx"), file);
-    fputs("</name>\r\n    </metadata>\r\n"
-          "    <trk>\r\n        <name>", file);
+    if (!have_gps)
+        return 0;
+
+    state = (GPX_STATE*)malloc(sizeof(GPX_STATE));
+    if (!state)
+        return 0;
+    emit_time_init(&state->utc_time, 1);
+    state->keep = 0;
+    state->gps_index = 0;
+    if ((export_simplify_tolerance() > 0) && (ttbin->columns || build_ttbin_columns(ttbin)))
+        state->keep = simplify_track(&ttbin->columns->gps, export_simplify_tolerance());
+    out = &state->out;
+    emit_init(out, file);
+
+    emit_str(out, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\r\n"
+                  "<gpx xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\""
+                  " xsi:schemaLocation=\"http://www.topografix.com/GPX/1/1"
+                  " http://www.topografix.com/GPX/1/1/gpx.xsd"
+                  " http://www.garmin.com/xmlschemas/GpxExtensions/v3"
+                  " http://www.garmin.com/xmlschemas/GpxExtensionsv3.xsd"
+                  " http://www.garmin.com/xmlschemas/TrackPointExtension/v1"
+                  " http://www.garmin.com/xmlschemas/TrackPointExtensionv1.xsd\""
+                  " xmlns:gpxx=\"http://www.garmin.com/xmlschemas/GpxExtensions/v3\""
+                  " xmlns:gpxtpx=\"http://www.garmin.com/xmlschemas/TrackPointExtension/v1\""
+                  " version=\"1.1\" creator=\"TomTom\" xmlns=\"http://www.topografix.com/GPX/1/1\">\r\n"
+                  "    <metadata>\r\n        <name>");
+    emit_str(out, create_filename_r(ttbin, "gpx", filename, sizeof(filename)));
+    emit_str(out, "</name>\r\n    </metadata>\r\n"
+                  "    <trk>\r\n        <name>");
     switch(ttbin->activity)
     {
-    case ACTIVITY_RUNNING:   fputs("RUNNING", file);   break;
-    case ACTIVITY_CYCLING:   fputs("CYCLING", file);   break;
-    case ACTIVITY_SWIMMING:  fputs("POOL SWIM", file); break;
-    case ACTIVITY_TREADMILL: fputs("TREADMILL", file); break;
-    case ACTIVITY_FREESTYLE: fputs("FREESTYLE", file); break;
-    default:                 fputs("UNKNOWN", file);   break;
+    case ACTIVITY_RUNNING:   emit_str(out, "RUNNING");   break;
+    case ACTIVITY_CYCLING:   emit_str(out, "CYCLING");   break;
+    case ACTIVITY_SWIMMING:  emit_str(out, "POOL SWIM"); break;
+    case ACTIVITY_TREADMILL: emit_str(out, "TREADMILL"); break;
+    case ACTIVITY_FREESTYLE: emit_str(out, "FREESTYLE"); break;
+    default:                 emit_str(out, "UNKNOWN");   break;
     }
-    fputs("</name>\r\n        <trkseg>\r\n", file);
+    emit_str(out, "</name>\r\n        <trkseg>\r\n");
+    return state;
+}
+
+static void write_gpx_record(void *ptr, TTBIN_RECORD *record, const TTBIN_SAMPLE *sample)
+{
+    GPX_STATE *state = (GPX_STATE*)ptr;
+    EMITTER *out = &state->out;
+
+    if (record->tag != TAG_GPS)
+        return;
+    ++state->gps_index;
+    if (!sample || (state->keep && !state->keep[state->gps_index - 1]))
+        return;
 
-    heart_rate = 0;
-    CyclingCadenceData cc_data = cc_initialize();
-    for (record = ttbin->first; record; record = record->next)
+    emit_str(out, "            <trkpt lat=\"");
+    emit_fixed(out, sample->latitude, 6);
+    emit_str(out, "\" lon=\"");
+    emit_fixed(out, sample->longitude, 6);
+    emit_str(out, "\">\r\n");
+    if (!isnan(sample->elevation))
     {
-        switch (record->tag)
-        {
-        case TAG_GPS:
-            /* this will happen if the GPS signal is lost or the activity is paused */
-            if ((record->gps.timestamp == 0) || ((record->gps.latitude == 0) && (record->gps.longitude == 0)))
-                continue;
-            strftime(timestr, sizeof(timestr), "%FT%X.000Z", gmtime(&record->gps.timestamp));
-            fprintf(file, "            <trkpt lat=\"%.6f\" lon=\"%.6f\">\r\n",
-                record->gps.latitude, record->gps.longitude);
-            if (!isnan(record->gps.elevation))
-                fprintf(file, "                <ele>%d</ele>\r\n", (int)record->gps.elevation);
-            fputs(        "                <time>", file);
-            fputs(timestr, file);
-            fputs("</time>\r\n", file);
-            fputs("                <extensions>\r\n"
-                  "                    <gpxtpx:TrackPointExtension>\r\n", file);
-            if (heart_rate > 0)
-                fprintf(file, "                        <gpxtpx:hr>%d</gpxtpx:hr>\r\n", heart_rate);
-            if (cc_data.cadence_available)
-            {
-                fprintf(file, "                        <gpxtpx:cad>%d</gpxtpx:cad>\r\n", cc_data.cycling_cadence);
-                cc_gps_packet_tick(&cc_data);
-            }
-            fputs("                    </gpxtpx:TrackPointExtension>\r\n"
-                  "                </extensions>\r\n", file);
-            fputs("            </trkpt>\r\n", file);
-            break;
-        case TAG_HEART_RATE:
-            heart_rate = record->heart_rate.heart_rate;
-            break;
-        case TAG_WHEEL_SIZE:
-            cc_set_wheel_size(&cc_data, &record->wheel_size);
-            break;
-        case TAG_CYCLING_CADENCE:
-            cc_sensor_packet(&cc_data, &record->cycling_cadence);
-            break;
-        }
+        emit_str(out, "                <ele>");
+        emit_int(out, (int)sample->elevation);
+        emit_str(out, "</ele>\r\n");
     }
+    emit_str(out, "                <time>");
+    emit_str(out, emit_format_time(&state->utc_time, sample->timestamp));
+    emit_str(out, ".000Z</time>\r\n");
+    emit_str(out, "                <extensions>\r\n"
+                  "                    <gpxtpx:TrackPointExtension>\r\n");
+    if (sample->last_heart_rate > 0)
+    {
+        emit_str(out, "                        <gpxtpx:hr>");
+        emit_int(out, sample->last_heart_rate);
+        emit_str(out, "</gpxtpx:hr>\r\n");
+    }
+    if (sample->cadence_available)
+    {
+        emit_str(out, "                        <gpxtpx:cad>");
+        emit_int(out, sample->cycling_cadence);
+        emit_str(out, "</gpxtpx:cad>\r\n");
+    }
+    emit_str(out, "                    </gpxtpx:TrackPointExtension>\r\n"
+                  "                </extensions>\r\n");
+    emit_str(out, "            </trkpt>\r\n");
+}
 
-    fputs("        </trkseg>\r\n    </trk>\r\n</gpx>\r\n", file);
+static void finish_gpx(void *ptr)
+{
+    GPX_STATE *state = (GPX_STATE*)ptr;
+
+    emit_str(&state->out, "        </trkseg>\r\n    </trk>\r\n</gpx>\r\n");
+    emit_flush(&state->out);
+    free(state->keep);
+    free(state);
 }
 
+const EXPORT_WRITER GPX_WRITER = { begin_gpx, write_gpx_record, finish_gpx, 0, 0, 1 };
+
+void export_gpx(TTBIN_FILE *ttbin, FILE *file)
+{
+    export_with_writer(&GPX_WRITER, ttbin, file);
+}
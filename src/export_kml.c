@@ -3,45 +3,60 @@
 ** KML export code                                                           **
 \*****************************************************************************/
 
-#include "ttbin.h"
+#include "export.h"
+#include "emitter.h"
+#include "simplify.h"
 
 #include <math.h>
+#include <stdlib.h>
 #include <string.h>
 
-static void make_kml_style(FILE *file, const char *id, const char *icon, uint32_t icon_colour,
+static void make_kml_style(EMITTER *out, const char *id, const char *icon, uint32_t icon_colour,
     uint32_t line_colour, int line_width, uint32_t poly_colour, const char *balloon_text)
 {
-    fputs(        "        <Style id=\"", file);
-    fputs(        id, file);
-    fputs(        "\">\r\n"
-                  "            <IconStyle>\r\n"
-                  "                <Icon>\r\n"
-                  "                    <href>", file);
-    fputs(        icon, file);
-    fputs(        "</href>\r\n"
-                  "                </Icon>\r\n", file);
+    emit_str(out,    "        <Style id=\"");
+    emit_str(out,    id);
+    emit_str(out,    "\">\r\n"
+                     "            <IconStyle>\r\n"
+                     "                <Icon>\r\n"
+                     "                    <href>");
+    emit_str(out,    icon);
+    emit_str(out,    "</href>\r\n"
+                     "                </Icon>\r\n");
     if (icon_colour & 0xff000000)
-        fprintf(file, "                <color>%08x</color>\r\n", icon_colour);
-    fputs(        "            </IconStyle>\r\n"
-                  "            <BalloonStyle>\r\n"
-                  "                <text>", file);
-    fputs(        balloon_text, file);
-    fputs(        "</text>\r\n"
-                  "            </BalloonStyle>\r\n", file);
+        emit_printf(out, "                <color>%08x</color>\r\n", icon_colour);
+    emit_str(out,    "            </IconStyle>\r\n"
+                     "            <BalloonStyle>\r\n"
+                     "                <text>");
+    emit_str(out,    balloon_text);
+    emit_str(out,    "</text>\r\n"
+                     "            </BalloonStyle>\r\n");
     if (line_colour & 0xff000000)
     {
-        fputs(        "            <LineStyle>\r\n", file);
-        fprintf(file, "                <color>%08x</color>\r\n", line_colour);
-        fprintf(file, "                <width>%d</width>\r\n", line_width);
-        fputs(        "            </LineStyle>\r\n", file);
+        emit_str(out,    "            <LineStyle>\r\n");
+        emit_printf(out, "                <color>%08x</color>\r\n", line_colour);
+        emit_printf(out, "                <width>%d</width>\r\n", line_width);
+        emit_str(out,    "            </LineStyle>\r\n");
     }
     if (poly_colour & 0xff000000)
     {
-        fputs(        "           <PolyStyle>\r\n", file);
-        fprintf(file, "               <color>%08x</color>\r\n", poly_colour);
-        fputs(        "           </PolyStyle>\r\n", file);
+        emit_str(out,    "           <PolyStyle>\r\n");
+        emit_printf(out, "               <color>%08x</color>\r\n", poly_colour);
+        emit_str(out,    "           </PolyStyle>\r\n");
     }
-    fputs(        "        </Style>\r\n", file);
+    emit_str(out,    "        </Style>\r\n");
+}
+
+/* this will happen if the GPS signal is lost or the activity is paused */
+static int valid_point(const GPS_COLUMNS *gps, uint32_t i)
+{
+    return (gps->timestamp[i] != 0) && !((gps->latitude[i] == 0) && (gps->longitude[i] == 0));
+}
+
+/* keep is the simplified track, if there is one */
+static int track_point(const GPS_COLUMNS *gps, const uint8_t *keep, uint32_t i)
+{
+    return valid_point(gps, i) && (!keep || keep[i]);
 }
 
 void export_kml(TTBIN_FILE *ttbin, FILE *file)
@@ -51,31 +66,57 @@ void export_kml(TTBIN_FILE *ttbin, FILE *file)
     uint32_t i;
     char text_buf[150];
     const char *type_text;
-    struct tm *time;
-    uint32_t initial_time;
+    struct tm *time, start_tm;
+    const TTBIN_LAP_LIST *laps;
+    const TTBIN_LAP_SUMMARY *prev;
+    unsigned number = 0;
+    const GPS_COLUMNS *gps;
+    const HEART_RATE_COLUMNS *hr;
+    uint8_t *keep = 0;
+    EMIT_TIME utc_time;
+    EMITTER *out;
 
     if (!ttbin->gps_records.count)
         return;
 
-    time = gmtime(&ttbin->timestamp_local);
+    /* the track is written out one attribute at a time, so scan the columns
+       rather than chasing the record pointers for every pass */
+    if (!ttbin->columns && !build_ttbin_columns(ttbin))
+        return;
+    gps = &ttbin->columns->gps;
+    hr  = &ttbin->columns->heart_rate;
+
+    if (export_simplify_tolerance() > 0)
+        keep = simplify_track(gps, export_simplify_tolerance());
+
+    out = (EMITTER*)malloc(sizeof(EMITTER));
+    if (!out)
+    {
+        free(keep);
+        return;
+    }
+    emit_init(out, file);
+    emit_time_init(&utc_time, 1);
 
-    fputs("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\r\n"
-          "<kml xmlns=\"http://www.opengis.net/kml/2.2\" xmlns:gx=\"http://www.google.com/kml/ext/2.2\">\r\n"
-          "    <Document>\r\n"
-          "        <name>", file);
+    time = gmtime_r(&ttbin->timestamp_local, &start_tm);
+
+    emit_str(out, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\r\n"
+                  "<kml xmlns=\"http://www.opengis.net/kml/2.2\" xmlns:gx=\"http://www.google.com/kml/ext/2.2\">\r\n"
+                  "    <Document>\r\n"
+                  "        <name>");
     switch(ttbin->activity)
     {
-    case ACTIVITY_RUNNING:   fputs("Running", file);   break;
-    case ACTIVITY_CYCLING:   fputs("Cycling", file);   break;
-    case ACTIVITY_SWIMMING:  fputs("Swimming", file);  break;
-    case ACTIVITY_TREADMILL: fputs("Treadmill", file); break;
-    case ACTIVITY_FREESTYLE: fputs("Freestyle", file); break;
-    default:                 fputs("Unknown", file);   break;
+    case ACTIVITY_RUNNING:   emit_str(out, "Running");   break;
+    case ACTIVITY_CYCLING:   emit_str(out, "Cycling");   break;
+    case ACTIVITY_SWIMMING:  emit_str(out, "Swimming");  break;
+    case ACTIVITY_TREADMILL: emit_str(out, "Treadmill"); break;
+    case ACTIVITY_FREESTYLE: emit_str(out, "Freestyle"); break;
+    default:                 emit_str(out, "Unknown");   break;
     }
-    fprintf(file, "_%02d:%02d:%02d_%02d-%s-%04d</name>\r\n",
+    emit_printf(out, "_%02d:%02d:%02d_%02d-%s-%04d</name>\r\n",
         time->tm_hour, time->tm_min, time->tm_sec, time->tm_mday,
         MONTHNAMES[time->tm_mon], time->tm_year + 1900);
-    fputs("        <description>TomTom GPS Watch activity</description>\r\n", file);
+    emit_str(out, "        <description>TomTom GPS Watch activity</description>\r\n");
 
     switch(ttbin->activity)
     {
@@ -93,209 +134,251 @@ void export_kml(TTBIN_FILE *ttbin, FILE *file)
         "   Total Calories: %d&lt;br/&gt;",
         type_text, ttbin->duration, ttbin->total_distance, ttbin->total_calories);
 
-    make_kml_style(file, "track", "http://earth.google.com/images/kml-icons/track-directional/track-0.png",
+    make_kml_style(out, "track", "http://earth.google.com/images/kml-icons/track-directional/track-0.png",
         0, 0xff31d7bd, 8, 0xffbdd731, text_buf);
-    make_kml_style(file, "start-track", "http://maps.google.com/mapfiles/kml/pal5/icon13.png",
+    make_kml_style(out, "start-track", "http://maps.google.com/mapfiles/kml/pal5/icon13.png",
         0xff007f00, 0, 0, 0, text_buf);
-    make_kml_style(file, "end-track", "http://maps.google.com/mapfiles/kml/pal5/icon13.png",
+    make_kml_style(out, "end-track", "http://maps.google.com/mapfiles/kml/pal5/icon13.png",
         0xff0000af, 0, 0, 0, text_buf);
-    make_kml_style(file, "graph", "http://maps.google.com/mapfiles/kml/shapes/placemark_circle.png",
+    make_kml_style(out, "graph", "http://maps.google.com/mapfiles/kml/shapes/placemark_circle.png",
         0, 0, 0, 0, "$[description]");
 
     if (ttbin->lap_records.count)
     {
-        fputs("        <Style id=\"laps-balloon\">\r\n"
-              "            <IconStyle>\r\n"
-              "                <Icon>\r\n"
-              "                    <href>http://maps.google.com/mapfiles/kml/shapes/placemark_circle.png</href>\r\n"
-              "                </Icon>\r\n"
-              "            </IconStyle>\r\n"
-              "            <BalloonStyle>\r\n"
-              "                <text>", file);
+        emit_str(out, "        <Style id=\"laps-balloon\">\r\n"
+                      "            <IconStyle>\r\n"
+                      "                <Icon>\r\n"
+                      "                    <href>http://maps.google.com/mapfiles/kml/shapes/placemark_circle.png</href>\r\n"
+                      "                </Icon>\r\n"
+                      "            </IconStyle>\r\n"
+                      "            <BalloonStyle>\r\n"
+                      "                <text>");
 
-        fputs("&lt;h2&gt;", file);
-        fputs(type_text, file);
-        fputs(" Distance laps&lt;/h2&gt;&lt;TABLE BORDER=\"1\"&gt;\r\n"
-            "&lt;TR&gt;&lt;TH&gt;Lap&lt;/TH&gt;&lt;TH&gt;Time&lt;/TH&gt;"
-            "&lt;TH&gt;Distance&lt;/TH&gt;&lt;TH&gt;Calories&lt;/TH&gt;&lt;TH&gt;Delta Time&lt;/TH&gt;"
-            "&lt;TH&gt;Delta Distance&lt;/TH&gt;&lt;TH&gt;Delta Calories&lt;/TH&gt;&lt;/TR&gt;\r\n", file);
+        emit_str(out, "&lt;h2&gt;");
+        emit_str(out, type_text);
+        emit_str(out, " Distance laps&lt;/h2&gt;&lt;TABLE BORDER=\"1\"&gt;\r\n"
+                    "&lt;TR&gt;&lt;TH&gt;Lap&lt;/TH&gt;&lt;TH&gt;Time&lt;/TH&gt;"
+                    "&lt;TH&gt;Distance&lt;/TH&gt;&lt;TH&gt;Calories&lt;/TH&gt;&lt;TH&gt;Delta Time&lt;/TH&gt;"
+                    "&lt;TH&gt;Delta Distance&lt;/TH&gt;&lt;TH&gt;Delta Calories&lt;/TH&gt;&lt;/TR&gt;\r\n");
 
-        initial_time = 0;
-        for (i = 0; i < ttbin->lap_records.count; ++i)
+        /* only the laps from lap records go in the table */
+        laps = ttbin_laps(ttbin);
+        prev = 0;
+        for (i = 0; laps && (i < laps->count); ++i)
         {
-            LAP_RECORD *lap = &ttbin->lap_records.records[i]->lap;
+            const TTBIN_LAP_SUMMARY *lap = &laps->laps[i];
+            if (lap->end_tag != TAG_LAP)
+                continue;
 
-            fprintf(file,
+            emit_printf(out,
                 "&lt;TR&gt;&lt;TH&gt;%d&lt;/TH&gt;&lt;TD&gt;%d&lt;/TD&gt;&lt;TD&gt;%.2f&lt;/TD&gt;"
                 "&lt;TD&gt;%d&lt;/TD&gt;&lt;TD&gt;%d&lt;/TD&gt;&lt;TD&gt;%.2f&lt;/TD&gt;&lt;TD&gt;%d&lt;/TD&gt;&lt;/TR&gt;\r\n",
-                i + 1, lap->total_time, lap->total_distance, lap->total_calories, lap->total_time - initial_time,
-                lap->total_distance - ((i > 0) ? ttbin->lap_records.records[i - 1]->lap.total_distance : 0.0f),
-                lap->total_calories - ((i > 0) ? ttbin->lap_records.records[i - 1]->lap.total_calories : 0));
-            initial_time = lap->total_time;
+                ++number, lap->total_time, lap->total_distance, lap->total_calories,
+                lap->total_time - (prev ? prev->total_time : 0),
+                lap->total_distance - (prev ? prev->total_distance : 0.0f),
+                (int)lap->total_calories - (prev ? (int)prev->total_calories : 0));
+            prev = lap;
         }
-        fputs("&lt;/TABLE&gt;\r\n", file);
+        emit_str(out, "&lt;/TABLE&gt;\r\n");
 
-        fputs("</text>\r\n"
-              "            </BalloonStyle>\r\n"
-              "        </Style>\r\n", file);
+        emit_str(out, "</text>\r\n"
+                      "            </BalloonStyle>\r\n"
+                      "        </Style>\r\n");
     }
 
-    fputs(        "        <Schema id=\"", file);
-    fputs(        type_text, file);
-    fputs(        "_schema\">\r\n"
-                  "            <gx:SimpleArrayField name=\"calories\" type=\"int\">\r\n"
-                  "                <displayName>Calories</displayName>\r\n"
-                  "            </gx:SimpleArrayField>\r\n"
-                  "            <gx:SimpleArrayField name=\"distance\" type=\"float\">\r\n"
-                  "                <displayName>Distance</displayName>\r\n"
-                  "            </gx:SimpleArrayField>\r\n"
-                  "            <gx:SimpleArrayField name=\"speed\" type=\"float\">\r\n"
-                  "                <displayName>Speed</displayName>\r\n"
-                  "            </gx:SimpleArrayField>\r\n"
-                  "            <gx:SimpleArrayField name=\"pace\" type=\"float\">\r\n"
-                  "                <displayName>Pace</displayName>\r\n"
-                  "            </gx:SimpleArrayField>\r\n", file);
+    emit_str(out,    "        <Schema id=\"");
+    emit_str(out,    type_text);
+    emit_str(out,    "_schema\">\r\n"
+                     "            <gx:SimpleArrayField name=\"calories\" type=\"int\">\r\n"
+                     "                <displayName>Calories</displayName>\r\n"
+                     "            </gx:SimpleArrayField>\r\n"
+                     "            <gx:SimpleArrayField name=\"distance\" type=\"float\">\r\n"
+                     "                <displayName>Distance</displayName>\r\n"
+                     "            </gx:SimpleArrayField>\r\n"
+                     "            <gx:SimpleArrayField name=\"speed\" type=\"float\">\r\n"
+                     "                <displayName>Speed</displayName>\r\n"
+                     "            </gx:SimpleArrayField>\r\n"
+                     "            <gx:SimpleArrayField name=\"pace\" type=\"float\">\r\n"
+                     "                <displayName>Pace</displayName>\r\n"
+                     "            </gx:SimpleArrayField>\r\n");
     if (ttbin->activity != ACTIVITY_CYCLING)
     {
-        fputs(        "            <gx:SimpleArrayField name=\"steps\" type=\"int\">\r\n"
-                      "                <displayName>Steps</displayName>\r\n"
-                      "            </gx:SimpleArrayField>\r\n", file);
+        emit_str(out,    "            <gx:SimpleArrayField name=\"steps\" type=\"int\">\r\n"
+                         "                <displayName>Steps</displayName>\r\n"
+                         "            </gx:SimpleArrayField>\r\n");
     }
     if (ttbin->heart_rate_records.count > 0)
     {
-        fputs(        "            <gx:SimpleArrayField name=\"heartrate\" type=\"int\">\r\n"
-                      "                <displayName>Heart Rate</displayName>\r\n"
-                      "            </gx:SimpleArrayField>\r\n", file);
+        emit_str(out,    "            <gx:SimpleArrayField name=\"heartrate\" type=\"int\">\r\n"
+                         "                <displayName>Heart Rate</displayName>\r\n"
+                         "            </gx:SimpleArrayField>\r\n");
     }
-    fputs(        "        </Schema>\r\n"
-                  "        <Placemark>\r\n"
-                  "            <name>Workout</name>\r\n"
-                  "            <description>Workout</description>\r\n"
-                  "            <styleUrl>#track</styleUrl>\r\n"
-                  "            <gx:Track>\r\n"
-                  "                <altitudeMode>clamptoground</altitudeMode>\r\n", file);
-    for (i = 0; i < ttbin->gps_records.count; ++i)
+    emit_str(out,    "        </Schema>\r\n"
+                     "        <Placemark>\r\n"
+                     "            <name>Workout</name>\r\n"
+                     "            <description>Workout</description>\r\n"
+                     "            <styleUrl>#track</styleUrl>\r\n"
+                     "            <gx:Track>\r\n"
+                     "                <altitudeMode>clamptoground</altitudeMode>\r\n");
+    for (i = 0; i < gps->count; ++i)
     {
-        if ((ttbin->gps_records.records[i]->gps.timestamp != 0) &&
-            !((ttbin->gps_records.records[i]->gps.latitude == 0) && (ttbin->gps_records.records[i]->gps.longitude == 0)))
+        if (track_point(gps, keep, i))
         {
-            strftime(text_buf, sizeof(text_buf), "%FT%X.000Z", gmtime(&ttbin->gps_records.records[i]->gps.timestamp));
-            fputs(        "                <when>", file);
-            fputs(        text_buf, file);
-            fputs(        "</when>\r\n", file);
-            fprintf(file, "                <gx:coord>%.6f %.6f %d</gx:coord>\r\n",
-                ttbin->gps_records.records[i]->gps.longitude, ttbin->gps_records.records[i]->gps.latitude,
-                isnan(ttbin->gps_records.records[i]->gps.elevation) ? 0 : (int)ttbin->gps_records.records[i]->gps.elevation);
+            emit_str(out, "                <when>");
+            emit_str(out, emit_format_time(&utc_time, gps->timestamp[i]));
+            emit_str(out, ".000Z</when>\r\n"
+                          "                <gx:coord>");
+            emit_fixed(out, gps->longitude[i], 6);
+            emit_char(out, ' ');
+            emit_fixed(out, gps->latitude[i], 6);
+            emit_char(out, ' ');
+            emit_int(out, isnan(gps->elevation[i]) ? 0 : (int)gps->elevation[i]);
+            emit_str(out, "</gx:coord>\r\n");
         }
     }
-    fputs(        "                <ExtendedData>\r\n"
-                  "                    <SchemaData schemaUrl=\"#", file);
-    fputs(        type_text, file);
-    fputs(        "-schema\">\r\n"
-                  "                        <gx:SimpleArrayData name=\"calories\">\r\n", file);
-    for (i = 0; i < ttbin->gps_records.count; ++i)
+    emit_str(out,    "                <ExtendedData>\r\n"
+                     "                    <SchemaData schemaUrl=\"#");
+    emit_str(out,    type_text);
+    emit_str(out,    "-schema\">\r\n"
+                     "                        <gx:SimpleArrayData name=\"calories\">\r\n");
+    for (i = 0; i < gps->count; ++i)
     {
-        if ((ttbin->gps_records.records[i]->gps.timestamp != 0) &&
-            !((ttbin->gps_records.records[i]->gps.latitude == 0) && (ttbin->gps_records.records[i]->gps.longitude == 0)))
-            fprintf(file, "                            <gx:value>%d</gx:value>\r\n", ttbin->gps_records.records[i]->gps.calories);
+        if (track_point(gps, keep, i))
+        {
+            emit_str(out, "                            <gx:value>");
+            emit_int(out, gps->calories[i]);
+            emit_str(out, "</gx:value>\r\n");
+        }
     }
-    fputs(        "                        </gx:SimpleArrayData>\r\n"
-                  "                        <gx:SimpleArrayData name=\"distance\">\r\n", file);
-    for (i = 0; i < ttbin->gps_records.count; ++i)
+    emit_str(out,    "                        </gx:SimpleArrayData>\r\n"
+                     "                        <gx:SimpleArrayData name=\"distance\">\r\n");
+    for (i = 0; i < gps->count; ++i)
     {
-        if ((ttbin->gps_records.records[i]->gps.timestamp != 0) &&
-            !((ttbin->gps_records.records[i]->gps.latitude == 0) && (ttbin->gps_records.records[i]->gps.longitude == 0)))
+        if (track_point(gps, keep, i))
         {
-            fprintf(file, "                            <gx:value>%.*f</gx:value>\r\n",
-                (ttbin->gps_records.records[i]->gps.cum_distance == 0.0f) ? 0 : (5 - (int)floor(log10(ttbin->gps_records.records[i]->gps.cum_distance))),
-                ttbin->gps_records.records[i]->gps.cum_distance);
+            emit_str(out, "                            <gx:value>");
+            emit_fixed(out, gps->cum_distance[i],
+                (gps->cum_distance[i] == 0.0f) ? 0 : (5 - (int)floor(log10(gps->cum_distance[i]))));
+            emit_str(out, "</gx:value>\r\n");
         }
     }
-    fputs(        "                        </gx:SimpleArrayData>\r\n"
-                  "                        <gx:SimpleArrayData name=\"speed\">\r\n", file);
-    for (i = 0; i < ttbin->gps_records.count; ++i)
+    emit_str(out,    "                        </gx:SimpleArrayData>\r\n"
+                     "                        <gx:SimpleArrayData name=\"speed\">\r\n");
+    for (i = 0; i < gps->count; ++i)
     {
-        if ((ttbin->gps_records.records[i]->gps.timestamp != 0) &&
-            !((ttbin->gps_records.records[i]->gps.latitude == 0) && (ttbin->gps_records.records[i]->gps.longitude == 0)))
+        if (track_point(gps, keep, i))
         {
-            fprintf(file, "                            <gx:value>%.2f</gx:value>\r\n", ttbin->gps_records.records[i]->gps.instant_speed);
+            emit_str(out, "                            <gx:value>");
+            emit_fixed(out, gps->instant_speed[i], 2);
+            emit_str(out, "</gx:value>\r\n");
         }
     }
-    fputs(        "                        </gx:SimpleArrayData>\r\n"
-                  "                        <gx:SimpleArrayData name=\"pace\">\r\n", file);
-    for (i = 0; i < ttbin->gps_records.count; ++i)
+    emit_str(out,    "                        </gx:SimpleArrayData>\r\n"
+                     "                        <gx:SimpleArrayData name=\"pace\">\r\n");
+    for (i = 0; i < gps->count; ++i)
     {
-        if ((ttbin->gps_records.records[i]->gps.timestamp != 0) &&
-            !((ttbin->gps_records.records[i]->gps.latitude == 0) && (ttbin->gps_records.records[i]->gps.longitude == 0)))
+        if (track_point(gps, keep, i))
         {
-            fprintf(file, "                            <gx:value>%.2f</gx:value>\r\n", 1000.0f / (60.0f * ttbin->gps_records.records[i]->gps.instant_speed));
+            emit_str(out, "                            <gx:value>");
+            emit_fixed(out, 1000.0f / (60.0f * gps->instant_speed[i]), 2);
+            emit_str(out, "</gx:value>\r\n");
         }
     }
-    fputs(        "                        </gx:SimpleArrayData>\r\n", file);
+    emit_str(out,    "                        </gx:SimpleArrayData>\r\n");
     if (ttbin->activity != ACTIVITY_CYCLING)
     {
-        fputs(        "                        <gx:SimpleArrayData name=\"steps\">\r\n", file);
-        for (i = 0; i < ttbin->gps_records.count; ++i)
+        emit_str(out,    "                        <gx:SimpleArrayData name=\"steps\">\r\n");
+        for (i = 0; i < gps->count; ++i)
         {
-            if ((ttbin->gps_records.records[i]->gps.timestamp != 0) &&
-                !((ttbin->gps_records.records[i]->gps.latitude == 0) && (ttbin->gps_records.records[i]->gps.longitude == 0)))
+            if (track_point(gps, keep, i))
             {
-                fprintf(file, "                            <gx:value>%d</gx:value>\r\n", ttbin->gps_records.records[i]->gps.cycles);
+                emit_str(out, "                            <gx:value>");
+                emit_int(out, gps->cycles[i]);
+                emit_str(out, "</gx:value>\r\n");
             }
         }
-        fputs(        "                        </gx:SimpleArrayData>\r\n", file);
+        emit_str(out,    "                        </gx:SimpleArrayData>\r\n");
     }
     if (ttbin->heart_rate_records.count > 0)
     {
-        fputs(        "                        <gx:SimpleArrayData name=\"heartrate\">\r\n", file);
-        for (i = 0; i < ttbin->heart_rate_records.count; ++i)
+        emit_str(out,    "                        <gx:SimpleArrayData name=\"heartrate\">\r\n");
+        if (keep)
         {
-            if (ttbin->heart_rate_records.records[i]->heart_rate.heart_rate != 0)
+            /* there are too few points left to give every reading, so take
+               the one for each point that is */
+            for (i = 0; i < gps->count; ++i)
             {
-                fprintf(file, "                            <gx:value>%d</gx:value>\r\n", ttbin->heart_rate_records.records[i]->heart_rate.heart_rate);
+                if (track_point(gps, keep, i))
+                {
+                    emit_str(out, "                            <gx:value>");
+                    emit_int(out, gps->heart_rate[i]);
+                    emit_str(out, "</gx:value>\r\n");
+                }
             }
         }
-        fputs(        "                        </gx:SimpleArrayData>\r\n", file);
+        else
+        {
+            for (i = 0; i < hr->count; ++i)
+            {
+                if (hr->heart_rate[i] != 0)
+                {
+                    emit_str(out, "                            <gx:value>");
+                    emit_int(out, hr->heart_rate[i]);
+                    emit_str(out, "</gx:value>\r\n");
+                }
+            }
+        }
+        emit_str(out,    "                        </gx:SimpleArrayData>\r\n");
     }
-    fputs(        "                    </SchemaData>\r\n"
-                  "                </ExtendedData>\r\n"
-                  "            </gx:Track>\r\n"
-                  "        </Placemark>\r\n"
-                  "        <Placemark>\r\n"
-                  "            <name>Start</name>\r\n", file);
-    fprintf(file, "            <description>%.6f,%.6f</description>\r\n",
-        ttbin->gps_records.records[0]->gps.longitude, ttbin->gps_records.records[0]->gps.latitude);
-    fputs(        "            <styleUrl>#start-track</styleUrl>\r\n"
-                  "            <Point>\r\n", file);
-    fprintf(file, "                <coordinates>%.6f,%.6f</coordinates>\r\n",
-        ttbin->gps_records.records[0]->gps.longitude, ttbin->gps_records.records[0]->gps.latitude);
-    fputs(        "            </Point>\r\n"
-                  "        </Placemark>\r\n"
-                  "        <Placemark>\r\n"
-                  "            <name>End</name>\r\n", file);
-    fprintf(file, "            <description>%.6f,%.6f</description>\r\n",
-        ttbin->gps_records.records[ttbin->gps_records.count - 1]->gps.longitude,
-        ttbin->gps_records.records[ttbin->gps_records.count - 1]->gps.latitude);
-    fputs(        "            <styleUrl>#end-track</styleUrl>\r\n"
-                  "            <Point>\r\n", file);
-    fprintf(file, "                <coordinates>%.6f,%.6f</coordinates>\r\n",
-        ttbin->gps_records.records[ttbin->gps_records.count - 1]->gps.longitude,
-        ttbin->gps_records.records[ttbin->gps_records.count - 1]->gps.latitude);
-    fputs(        "            </Point>\r\n"
-                  "        </Placemark>\r\n"
-                  "        <Placemark>\r\n"
-                  "            <name>Distance laps</name>\r\n", file);
-    fprintf(file, "            <description>%.6f,%.6f</description>\r\n",
-        ttbin->gps_records.records[ttbin->gps_records.count - 1]->gps.longitude,
-        ttbin->gps_records.records[ttbin->gps_records.count - 1]->gps.latitude);
-    fputs(        "            <styleUrl>#laps-balloon</styleUrl>\r\n"
-                  "            <Point>\r\n", file);
-    fprintf(file, "                <coordinates>%.6f,%.6f</coordinates>\r\n",
-        ttbin->gps_records.records[ttbin->gps_records.count - 1]->gps.longitude,
-        ttbin->gps_records.records[ttbin->gps_records.count - 1]->gps.latitude);
-    fputs(        "            </Point>\r\n"
-                  "        </Placemark>\r\n"
-                  "    </Document>\r\n"
-        "</kml>\r\n", file);
+    emit_str(out,    "                    </SchemaData>\r\n"
+                     "                </ExtendedData>\r\n"
+                     "            </gx:Track>\r\n"
+                     "        </Placemark>\r\n"
+                     "        <Placemark>\r\n"
+                     "            <name>Start</name>\r\n");
+    emit_printf(out, "            <description>%.6f,%.6f</description>\r\n",
+        gps->longitude[0], gps->latitude[0]);
+    emit_str(out,    "            <styleUrl>#start-track</styleUrl>\r\n"
+                     "            <Point>\r\n");
+    emit_printf(out, "                <coordinates>%.6f,%.6f</coordinates>\r\n",
+        gps->longitude[0], gps->latitude[0]);
+    emit_str(out,    "            </Point>\r\n"
+                     "        </Placemark>\r\n"
+                     "        <Placemark>\r\n"
+                     "            <name>End</name>\r\n");
+    emit_printf(out, "            <description>%.6f,%.6f</description>\r\n",
+        gps->longitude[gps->count - 1], gps->latitude[gps->count - 1]);
+    emit_str(out,    "            <styleUrl>#end-track</styleUrl>\r\n"
+                     "            <Point>\r\n");
+    emit_printf(out, "                <coordinates>%.6f,%.6f</coordinates>\r\n",
+        gps->longitude[gps->count - 1], gps->latitude[gps->count - 1]);
+    emit_str(out,    "            </Point>\r\n"
+                     "        </Placemark>\r\n"
+                     "        <Placemark>\r\n"
+                     "            <name>Distance laps</name>\r\n");
+    emit_printf(out, "            <description>%.6f,%.6f</description>\r\n",
+        gps->longitude[gps->count - 1], gps->latitude[gps->count - 1]);
+    emit_str(out,    "            <styleUrl>#laps-balloon</styleUrl>\r\n"
+                     "            <Point>\r\n");
+    emit_printf(out, "                <coordinates>%.6f,%.6f</coordinates>\r\n",
+        gps->longitude[gps->count - 1], gps->latitude[gps->count - 1]);
+    emit_str(out,    "            </Point>\r\n"
+                     "        </Placemark>\r\n"
+                     "    </Document>\r\n"
+                     "</kml>\r\n");
+
+    emit_flush(out);
+    free(out);
+    free(keep);
+}
+
+static void *begin_kml(TTBIN_FILE *ttbin, FILE *file, int have_gps)
+{
+    /* the track is written one attribute at a time from the columns, so the
+       whole file is written up front and the records aren't needed */
+    if (have_gps)
+        export_kml(ttbin, file);
+    return 0;
 }
 
+const EXPORT_WRITER KML_WRITER = { begin_kml, 0, 0, 1, 1, 1 };
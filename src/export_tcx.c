@@ -3,10 +3,11 @@
 ** TCX export code                                                           **
 \*****************************************************************************/
 
-#include "ttbin.h"
-#include "cycling_cadence.h"
+#include "export.h"
+#include "emitter.h"
 
 #include <math.h>
+#include <stdlib.h>
 
 enum LapState
 {
@@ -15,426 +16,294 @@ enum LapState
     LapState_Finish     /* the next GPS/treadmill record finishes a lap */
 };
 
-struct LapData
-{
-    const char *intensity;
-    float avg_speed;
-    unsigned step_count;
-    unsigned time;
-    const char *trigger_method;
-    float distance;
-    float max_speed;
-    unsigned calories;
-    unsigned avg_heart_rate;
-    unsigned max_heart_rate;
-};
+static const char *const TRIGGER_METHODS[] = { "Manual", "Time", "Distance" };
 
-static void write_lap_finish(FILE *file, const struct LapData *lap)
+static void write_lap_finish(EMITTER *out, const TTBIN_LAP_SUMMARY *lap)
 {
-    fputs(        "                    <Extensions>\r\n"
-                  "                       <LX xmlns=\"http://www.garmin.com/xmlschemas/ActivityExtension/v2\">\r\n", file);
-    fprintf(file, "                           <AvgSpeed>%.5f</AvgSpeed>\r\n", lap->avg_speed);
-    if (lap->step_count)
-        fprintf(file, "                           <Steps>%d</Steps>\r\n"
-                  "                           <AvgRunCadence>%d</AvgRunCadence>\r\n", lap->step_count, 30*lap->step_count/lap->time);
-    fputs(        "                       </LX>\r\n"
-                  "                    </Extensions>\r\n", file);
-    fputs(        "                </Track>\r\n", file);
-    fprintf(file, "                <Intensity>%s</Intensity>\r\n", lap->intensity);
-    fprintf(file, "                <TriggerMethod>%s</TriggerMethod>\r\n", lap->trigger_method);
-    fprintf(file, "                <TotalTimeSeconds>%d</TotalTimeSeconds>\r\n", lap->time);
-    fprintf(file, "                <DistanceMeters>%.2f</DistanceMeters>\r\n", lap->distance);
+    emit_str(out,    "                    <Extensions>\r\n"
+                     "                       <LX xmlns=\"http://www.garmin.com/xmlschemas/ActivityExtension/v2\">\r\n");
+    emit_printf(out, "                           <AvgSpeed>%.5f</AvgSpeed>\r\n", lap->avg_speed);
+    if (lap->steps && lap->time)
+        emit_printf(out, "                           <Steps>%d</Steps>\r\n"
+                     "                           <AvgRunCadence>%d</AvgRunCadence>\r\n", lap->steps, 30*lap->steps/lap->time);
+    emit_str(out,    "                       </LX>\r\n"
+                     "                    </Extensions>\r\n");
+    emit_str(out,    "                </Track>\r\n");
+    emit_printf(out, "                <Intensity>%s</Intensity>\r\n", lap->resting ? "Resting" : "Active");
+    emit_printf(out, "                <TriggerMethod>%s</TriggerMethod>\r\n", TRIGGER_METHODS[lap->trigger]);
+    emit_printf(out, "                <TotalTimeSeconds>%d</TotalTimeSeconds>\r\n", lap->time);
+    emit_printf(out, "                <DistanceMeters>%.2f</DistanceMeters>\r\n", lap->distance);
     if (lap->max_speed > 0.0f)
-        fprintf(file, "                <MaximumSpeed>%.2f</MaximumSpeed>\r\n", lap->max_speed);
-    fprintf(file, "                <Calories>%d</Calories>\r\n", lap->calories);
+        emit_printf(out, "                <MaximumSpeed>%.2f</MaximumSpeed>\r\n", lap->max_speed);
+    emit_printf(out, "                <Calories>%d</Calories>\r\n", lap->calories);
     if (lap->avg_heart_rate > 0)
     {
-        fputs(        "                <AverageHeartRateBpm>\r\n", file);
-        fprintf(file, "                    <Value>%d</Value>\r\n", lap->avg_heart_rate);
-        fputs(        "                </AverageHeartRateBpm>\r\n", file);
-        fputs(        "                <MaximumHeartRateBpm>\r\n", file);
-        fprintf(file, "                    <Value>%d</Value>\r\n", lap->max_heart_rate);
-        fputs(        "                </MaximumHeartRateBpm>\r\n", file);
+        emit_str(out,    "                <AverageHeartRateBpm>\r\n");
+        emit_printf(out, "                    <Value>%d</Value>\r\n", lap->avg_heart_rate);
+        emit_str(out,    "                </AverageHeartRateBpm>\r\n");
+        emit_str(out,    "                <MaximumHeartRateBpm>\r\n");
+        emit_printf(out, "                    <Value>%d</Value>\r\n", lap->max_heart_rate);
+        emit_str(out,    "                </MaximumHeartRateBpm>\r\n");
     }
-    fputs(        "            </Lap>\r\n", file);
+    emit_str(out,    "            </Lap>\r\n");
 }
 
-void export_tcx(TTBIN_FILE *ttbin, FILE *file)
+typedef struct
 {
-    char timestr[32];
-    TTBIN_RECORD *record;
-    float max_speed = 0.0f;
-    float total_speed = 0.0f;
-    uint32_t total_heart_rate = 0;
-    uint32_t max_heart_rate = 0;
-    uint32_t heart_rate_count = 0;
-    uint32_t move_count = 0;
-    uint32_t total_step_count = 0;
-    unsigned heart_rate;
-    uint32_t time = 0;
+    TTBIN_FILE *ttbin;
+    time_t prev_timestamp;
     enum LapState lap_state;
-    CyclingCadenceData cc_data = cc_initialize();
     int insert_pause;
-    unsigned lap_start_time = 0;
-    float lap_start_distance = 0.0f;
-    unsigned lap_start_calories = 0;
-    float cadence_avg = 0.0f;
-    double distance_factor = 1;
-    uint32_t steps, steps_prev = 0;
+    float cadence_avg;
+    uint32_t steps, steps_prev;
     time_t timestamp;
     float distance;
-
-    struct LapData lap = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
-    lap.trigger_method = "Manual";
-    lap.intensity = "Active";
-
-    if (ttbin->activity == ACTIVITY_TREADMILL)
-    {
-        for (record = ttbin->last; record; record = record->prev)
-        {
-            if ((record->tag == TAG_TREADMILL) && record->treadmill.distance)
-            {
-                distance_factor = ttbin->total_distance / record->treadmill.distance;
-                break;
-            }
-        }
-    }
-    else if (ttbin->activity == ACTIVITY_INDOOR || ttbin->activity == ACTIVITY_GYM || ttbin->activity == ACTIVITY_SWIMMING)
+    /* the lap statistics are worked out as the records go by, the same way
+       as ttbin_laps does, so that the file can be streamed */
+    TTBIN_LAP_BUILDER *laps;
+    TTBIN_LAP_SUMMARY lap;
+    EMIT_TIME utc_time;
+    EMITTER out;
+} TCX_STATE;
+
+static void *begin_tcx(TTBIN_FILE *ttbin, FILE *file, int have_gps)
+{
+    TCX_STATE *state;
+    EMITTER *out;
+
+    if ((ttbin->activity != ACTIVITY_TREADMILL) && (ttbin->activity != ACTIVITY_INDOOR) &&
+        (ttbin->activity != ACTIVITY_GYM) && (ttbin->activity != ACTIVITY_SWIMMING) &&
+        !have_gps)
+        return 0;
+
+    state = (TCX_STATE*)calloc(1, sizeof(TCX_STATE));
+    if (!state)
+        return 0;
+    state->ttbin = ttbin;
+    state->laps = ttbin_lap_builder_create(ttbin_timeline(ttbin)->distance_factor);   /* already built by the caller */
+    if (!state->laps)
     {
-
+        free(state);
+        return 0;
     }
-    else if (!ttbin->gps_records.count)
-        return;
-
-    fputs("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\r\n"
-          "<TrainingCenterDatabase xsi:schemaLocation=\"http://www.garmin.com/xmlschemas/TrainingCenterDatabase/v2"
-          " http://www.garmin.com/xmlschemas/TrainingCenterDatabasev2.xsd\""
-          " xmlns=\"http://www.garmin.com/xmlschemas/TrainingCenterDatabase/v2\""
-          " xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\""
-          " xmlns:xsd=\"http://www.w3.org/2001/XMLSchema\""
-          " xmlns:ns2=\"http://www.garmin.com/xmlschemas/ActivityExtension/v2\">\r\n"
-          "    <Activities>\r\n"
-          "        <Activity Sport=\"", file);
+    emit_time_init(&state->utc_time, 1);
+    out = &state->out;
+    emit_init(out, file);
+
+    emit_str(out, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\r\n"
+                  "<TrainingCenterDatabase xsi:schemaLocation=\"http://www.garmin.com/xmlschemas/TrainingCenterDatabase/v2"
+                  " http://www.garmin.com/xmlschemas/TrainingCenterDatabasev2.xsd\""
+                  " xmlns=\"http://www.garmin.com/xmlschemas/TrainingCenterDatabase/v2\""
+                  " xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\""
+                  " xmlns:xsd=\"http://www.w3.org/2001/XMLSchema\""
+                  " xmlns:ns2=\"http://www.garmin.com/xmlschemas/ActivityExtension/v2\">\r\n"
+                  "    <Activities>\r\n"
+                  "        <Activity Sport=\"");
     switch(ttbin->activity)
     {
-    case ACTIVITY_RUNNING:   fputs("Running", file);   break;
-    case ACTIVITY_CYCLING:   fputs("Cycling", file);   break;
-    case ACTIVITY_SWIMMING:  fputs("Pool Swim", file); break;
-    case ACTIVITY_TREADMILL: fputs("Running", file);   break; /* per Garmin spec, not "Treadmill" */
-    case ACTIVITY_FREESTYLE: fputs("Freestyle", file); break;
-    case ACTIVITY_INDOOR:    fputs("Biking", file);    break;
-    case ACTIVITY_GYM:       fputs("Gym",file);        break;
-    default:                 fputs("Unknown", file);   break;
+    case ACTIVITY_RUNNING:   emit_str(out, "Running");   break;
+    case ACTIVITY_CYCLING:   emit_str(out, "Cycling");   break;
+    case ACTIVITY_SWIMMING:  emit_str(out, "Pool Swim"); break;
+    case ACTIVITY_TREADMILL: emit_str(out, "Running");   break; /* per Garmin spec, not "Treadmill" */
+    case ACTIVITY_FREESTYLE: emit_str(out, "Freestyle"); break;
+    case ACTIVITY_INDOOR:    emit_str(out, "Biking");    break;
+    case ACTIVITY_GYM:       emit_str(out, "Gym");       break;
+    default:                 emit_str(out, "Unknown");   break;
     }
-    fputs("\">\r\n"
-          "            <Id>", file);
-    strftime(timestr, sizeof(timestr), "%FT%X.000Z", gmtime(&ttbin->timestamp_utc));
-    fputs(timestr, file);
-    fputs("</Id>\r\n", file);
+    emit_str(out, "\">\r\n"
+                  "            <Id>");
+    emit_str(out, emit_format_time(&state->utc_time, ttbin->timestamp_utc));
+    emit_str(out, ".000Z</Id>\r\n");
+
+    /* a lap starts at the time of the trackpoint before it */
+    state->prev_timestamp = ttbin->timestamp_utc;
+    state->lap_state = LapState_Start; /* the first GPS/treadmill record should start a lap */
+    return state;
+}
 
-    heart_rate = 0;
-    lap_state = LapState_Start; /* the first GPS/treadmill record should start a lap */
-    insert_pause = 0;
-    for (record = ttbin->first; record; record = record->next)
-    {
-        switch (record->tag)
-        {
-        case TAG_TRAINING_SETUP:
-            switch (record->training_setup.type)
-            {
-            case TRAINING_LAPS_TIME:     lap.trigger_method = "Time";     break;
-            case TRAINING_LAPS_DISTANCE: lap.trigger_method = "Distance"; break;
-            }
-            break;
+static void write_tcx_record(void *ptr, TTBIN_RECORD *record, const TTBIN_SAMPLE *sample)
+{
+    TCX_STATE *state = (TCX_STATE*)ptr;
+    TTBIN_FILE *ttbin = state->ttbin;
+    EMITTER *out = &state->out;
+    int lap_ended = ttbin_lap_builder_add(state->laps, ttbin, record, sample, &state->lap);
 
-        case TAG_STATUS:
-            if ((record->status.status == TTBIN_STATUS_PAUSED) && (lap_state == LapState_None))
-                insert_pause = 1;
+    switch (record->tag)
+    {
+    case TAG_STATUS:
+        if ((record->status.status == TTBIN_STATUS_PAUSED) && (state->lap_state == LapState_None))
+            state->insert_pause = 1;
+        break;
+
+    case TAG_TREADMILL:
+    case TAG_INDOOR_CYCLING:
+    case TAG_GPS:
+    case TAG_GYM:
+    case TAG_SWIM:
+        /* the timeline leaves out records written while the activity was
+           paused, and GPS records without a fix */
+        if (!sample)
             break;
 
-        case TAG_TREADMILL:
-        case TAG_INDOOR_CYCLING:
-        case TAG_GPS:
-        case TAG_GYM:
-        case TAG_SWIM:
-            if (record->tag == TAG_TREADMILL)
-            {
-                /* this will happen if the activity is paused and then resumed */
-                if (record->treadmill.timestamp == 0)
-                    break;
-
-                steps = record->treadmill.steps - steps_prev;
-                steps_prev = record->treadmill.steps;
-
-                total_step_count += steps;
-                timestamp = record->treadmill.timestamp;
-                distance = record->treadmill.distance * distance_factor;
-            }
-            else if (record->tag == TAG_GYM)
-            {
-                if (record->gym.timestamp == 0)
-                    break;
-
-                steps = record->gym.total_cycles - steps_prev;
-                steps_prev = record->gym.total_cycles;
-
-                total_step_count += steps;
-                timestamp = record->gym.timestamp;
-            }
-            else if (record->tag == TAG_INDOOR_CYCLING)
-            {
-                if (record->indoor_cycling.timestamp == 0)
-                    break;
-                distance = record->indoor_cycling.distance_meters;
-                timestamp = record->indoor_cycling.timestamp;
-            }
-            else if (record->tag == TAG_SWIM)
-            {
-                if (record->swim.timestamp == 0)
-                    break;
-                timestamp = record->swim.timestamp;
-                distance = record->swim.total_distance;
-                steps = record->swim.strokes;
-                total_step_count += steps;
-                time = timestamp - ttbin->timestamp_utc;
-            }
-            else /* TAG_GPS only */
-            {
-                /* this will happen if the activity is paused and then resumed, or if the GPS signal is lost */
-                if ((record->gps.timestamp == 0) || ((record->gps.latitude == 0) && (record->gps.longitude == 0)))
-                    break;
-
-                if (record->gps.instant_speed > max_speed)
-                    max_speed = record->gps.instant_speed;
-                total_speed += record->gps.instant_speed;
-
-                if (ttbin->activity == ACTIVITY_RUNNING)
-                    total_step_count += record->gps.cycles;
-                timestamp = record->gps.timestamp;
-                distance = record->gps.cum_distance;
-            }
-
-            /* code common to both TAG_GPS and TAG_TREADMILL */
-            ++move_count;
-
-            if ((lap_state == LapState_None) && insert_pause)
-            {
-                /* Garmin's tools use multiple tracks within a lap to signal a pause */
-                insert_pause = 0;
-                fputs("                </Track>\r\n"
-                      "                <Track>\r\n", file);
-            }
-
-            if (lap_state == LapState_Start)
-            {
-                fprintf(file, "            <Lap StartTime=\"%s\">\r\n", timestr);
-                fputs(        "                <Track>\r\n", file);
-                lap_state = LapState_None;
-            }
-
-            strftime(timestr, sizeof(timestr), "%FT%X.000Z", gmtime(&timestamp));
-
-            fputs(        "                    <Trackpoint>\r\n", file);
-            fprintf(file, "                        <Time>%s</Time>\r\n", timestr);
-            if (record->tag == TAG_GPS)
-            {
-                fputs(        "                        <Position>\r\n", file);
-                fprintf(file, "                            <LatitudeDegrees>%.7f</LatitudeDegrees>\r\n", record->gps.latitude);
-                fprintf(file, "                            <LongitudeDegrees>%.7f</LongitudeDegrees>\r\n", record->gps.longitude);
-                fputs(        "                        </Position>\r\n", file);
-                if (!isnan(record->gps.elevation))
-                    fprintf(file, "                        <AltitudeMeters>%.0f</AltitudeMeters>\r\n", record->gps.elevation);
-            }
-            fprintf(file, "                        <DistanceMeters>%.5f</DistanceMeters>\r\n", distance);
+        state->timestamp = sample->timestamp;
+        state->distance = sample->distance;
+        if (record->tag == TAG_TREADMILL)
+        {
+            state->steps = record->treadmill.steps - state->steps_prev;
+            state->steps_prev = record->treadmill.steps;
+        }
+        else if (record->tag == TAG_GYM)
+        {
+            state->steps = record->gym.total_cycles - state->steps_prev;
+            state->steps_prev = record->gym.total_cycles;
+        }
+        else if (record->tag == TAG_SWIM)
+            state->steps = record->swim.strokes;
 
-            if (heart_rate > 0)
-            {
-                fputs(        "                        <HeartRateBpm>\r\n", file);
-                fprintf(file, "                            <Value>%d</Value>\r\n", heart_rate);
-                fputs(        "                        </HeartRateBpm>\r\n", file);
-            }
+        if ((state->lap_state == LapState_None) && state->insert_pause)
+        {
+            /* Garmin's tools use multiple tracks within a lap to signal a pause */
+            state->insert_pause = 0;
+            emit_str(out, "                </Track>\r\n"
+                          "                <Track>\r\n");
+        }
 
-            if (cc_data.cadence_available)
-            {
-                fprintf(file, "                        <Cadence>%d</Cadence>\r\n", cc_data.cycling_cadence);
-                cc_gps_packet_tick(&cc_data);
-            }
+        if (state->lap_state == LapState_Start)
+        {
+            emit_str(out, "            <Lap StartTime=\"");
+            emit_str(out, emit_format_time(&state->utc_time, state->prev_timestamp));
+            emit_str(out, ".000Z\">\r\n"
+                          "                <Track>\r\n");
+            state->lap_state = LapState_None;
+        }
+        state->prev_timestamp = state->timestamp;
 
-            fputs(        "                        <Extensions>\r\n"
-                          "                            <TPX xmlns=\"http://www.garmin.com/xmlschemas/ActivityExtension/v2\">\r\n", file);
-            if (record->tag == TAG_GPS)
-                fprintf(file, "                                <Speed>%.2f</Speed>\r\n", record->gps.instant_speed);
-            if (ttbin->activity == ACTIVITY_RUNNING)
-            {
-                /* use an exponential moving average to smooth cadence data */
-                if ((int)record->gps.cycles <= 4) // max 4 * 60 = 240 spm
-                    cadence_avg = (0.05 * 30 * (int)record->gps.cycles) + (1.0 - 0.05) * cadence_avg;
-                fprintf(file, "                                <RunCadence>%d</RunCadence>\r\n", (int)cadence_avg);
-            }
-            else if (ttbin->activity == ACTIVITY_TREADMILL)
+        emit_str(out, "                    <Trackpoint>\r\n"
+                      "                        <Time>");
+        emit_str(out, emit_format_time(&state->utc_time, state->timestamp));
+        emit_str(out, ".000Z</Time>\r\n");
+        if (record->tag == TAG_GPS)
+        {
+            emit_str(out, "                        <Position>\r\n"
+                          "                            <LatitudeDegrees>");
+            emit_fixed(out, sample->latitude, 7);
+            emit_str(out, "</LatitudeDegrees>\r\n"
+                          "                            <LongitudeDegrees>");
+            emit_fixed(out, sample->longitude, 7);
+            emit_str(out, "</LongitudeDegrees>\r\n"
+                          "                        </Position>\r\n");
+            if (!isnan(sample->elevation))
             {
-                /* use an exponential moving average to smooth cadence data */
-                if ((int)steps <= 4) // max 4 * 60 = 240 spm
-                    cadence_avg = (0.05 * 30 * (int)steps) + (1.0 - 0.05) * cadence_avg;
-                fprintf(file, "                                <RunCadence>%d</RunCadence>\r\n", (int)cadence_avg);
+                emit_str(out, "                        <AltitudeMeters>");
+                emit_fixed(out, sample->elevation, 0);
+                emit_str(out, "</AltitudeMeters>\r\n");
             }
-            fputs(        "                            </TPX>\r\n"
-                          "                        </Extensions>\r\n"
-                          "                    </Trackpoint>\r\n", file);
+        }
+        emit_str(out, "                        <DistanceMeters>");
+        emit_fixed(out, state->distance, 5);
+        emit_str(out, "</DistanceMeters>\r\n");
 
-            if (record->tag == TAG_SWIM && lap_start_distance < distance)
-            {
-                /* New lap when we reach the border in swimming pool */
-                lap.step_count = total_step_count;
-                lap.time = time - lap_start_time;
-                lap.distance = distance - lap_start_distance;
-                lap.calories = record->swim.total_calories - lap_start_calories;
-                lap.trigger_method = "Distance";
-                lap_state = LapState_Finish;
+        if (sample->heart_rate > 0)
+        {
+            emit_str(out, "                        <HeartRateBpm>\r\n"
+                          "                            <Value>");
+            emit_int(out, sample->heart_rate);
+            emit_str(out, "</Value>\r\n"
+                          "                        </HeartRateBpm>\r\n");
+        }
 
-                lap_start_distance = distance;
-                lap_start_calories = lap.calories;
-                lap_start_time = time;
-                total_step_count = 0;
-            }
+        if (sample->cadence_available)
+        {
+            emit_str(out, "                        <Cadence>");
+            emit_int(out, sample->cycling_cadence);
+            emit_str(out, "</Cadence>\r\n");
+        }
 
-            if (lap_state == LapState_Finish)
-            {
-                write_lap_finish(file, &lap);
-                lap_state = LapState_Start;
-            }
-            heart_rate = 0;
-            break;
+        emit_str(out, "                        <Extensions>\r\n"
+                      "                            <TPX xmlns=\"http://www.garmin.com/xmlschemas/ActivityExtension/v2\">\r\n");
+        if (record->tag == TAG_GPS)
+        {
+            emit_str(out, "                                <Speed>");
+            emit_fixed(out, sample->speed, 2);
+            emit_str(out, "</Speed>\r\n");
+        }
+        if (ttbin->activity == ACTIVITY_RUNNING)
+        {
+            /* use an exponential moving average to smooth cadence data */
+            if ((int)sample->cycles <= 4) // max 4 * 60 = 240 spm
+                state->cadence_avg = (0.05 * 30 * (int)sample->cycles) + (1.0 - 0.05) * state->cadence_avg;
+            emit_str(out, "                                <RunCadence>");
+            emit_int(out, (int)state->cadence_avg);
+            emit_str(out, "</RunCadence>\r\n");
+        }
+        else if (ttbin->activity == ACTIVITY_TREADMILL)
+        {
+            /* use an exponential moving average to smooth cadence data */
+            if ((int)state->steps <= 4) // max 4 * 60 = 240 spm
+                state->cadence_avg = (0.05 * 30 * (int)state->steps) + (1.0 - 0.05) * state->cadence_avg;
+            emit_str(out, "                                <RunCadence>");
+            emit_int(out, (int)state->cadence_avg);
+            emit_str(out, "</RunCadence>\r\n");
+        }
+        emit_str(out, "                            </TPX>\r\n"
+                      "                        </Extensions>\r\n"
+                      "                    </Trackpoint>\r\n");
 
-        case TAG_HEART_RATE:
-            if (record->heart_rate.heart_rate > max_heart_rate)
-                max_heart_rate = record->heart_rate.heart_rate;
-            total_heart_rate += record->heart_rate.heart_rate;
-            ++heart_rate_count;
+        /* every length of the pool is a lap */
+        if ((record->tag == TAG_SWIM) && lap_ended)
+            state->lap_state = LapState_Finish;
 
-            heart_rate = record->heart_rate.heart_rate;
-            break;
-        case TAG_WHEEL_SIZE:
-            cc_set_wheel_size(&cc_data, &record->wheel_size);
-            break;
-        case TAG_CYCLING_CADENCE:
-            cc_sensor_packet(&cc_data, &record->cycling_cadence);
-            break;
-        case TAG_INTERVAL_SETUP:
-            break;
-        case TAG_INTERVAL_START:
-            break;
-        case TAG_INTERVAL_FINISH:
-            if (record->interval_start.type == TTBIN_INTERVAL_TYPE_WORK)
-            {
-                lap.intensity = "Active";
-            }
-            else
-            {
-                lap.intensity = "Resting";
-            }
-            lap.time = record->interval_finish.total_time - lap_start_time;
-            if (ttbin->activity == ACTIVITY_TREADMILL)
-            {
-                lap.distance = distance_factor * (double)(record->interval_finish.total_distance - lap_start_distance);
-                lap.avg_speed = lap.distance / move_count;
-            }
-            else
-            {
-                lap.distance = record->interval_finish.total_distance - lap_start_distance;
-                lap.avg_speed = total_speed / move_count;
-            }
-            lap.max_speed = max_speed;
-            lap.calories = record->interval_finish.total_calories - lap_start_calories;
-            if (heart_rate_count > 0)
-                lap.avg_heart_rate = (total_heart_rate + (heart_rate_count >> 1)) / heart_rate_count;
-            else
-                lap.avg_heart_rate = 0;
-            lap.max_heart_rate = max_heart_rate;
-            lap.step_count = total_step_count;
-            move_count = 0;
-            heart_rate_count = 0;
-            total_speed = 0;
-            max_speed = 0;
-            max_heart_rate = 0;
-            total_heart_rate = 0;
-            total_step_count = 0;
-            lap_state = LapState_Finish;
-            lap_start_time = record->interval_finish.total_time;
-            lap_start_distance = record->interval_finish.total_distance;
-            lap_start_calories = record->interval_finish.total_calories;
-            break;
-        case TAG_LAP:
-            lap.time = record->lap.total_time - lap_start_time;
-            if (ttbin->activity == ACTIVITY_TREADMILL)
-            {
-                lap.distance = distance_factor * (double)(record->lap.total_distance - lap_start_distance);
-                lap.avg_speed = lap.distance / move_count;
-            }
-            else
-            {
-                lap.distance = record->lap.total_distance - lap_start_distance;
-                lap.avg_speed = total_speed / move_count;
-            }
-            lap.max_speed = max_speed;
-            lap.calories = record->lap.total_calories - lap_start_calories;
-            if (heart_rate_count > 0)
-                lap.avg_heart_rate = (total_heart_rate + (heart_rate_count >> 1)) / heart_rate_count;
-            else
-                lap.avg_heart_rate = 0;
-            lap.max_heart_rate = max_heart_rate;
-            lap.step_count = total_step_count;
-            move_count = 0;
-            heart_rate_count = 0;
-            total_speed = 0;
-            max_speed = 0;
-            max_heart_rate = 0;
-            total_heart_rate = 0;
-            total_step_count = 0;
-            lap_state = LapState_Finish;
-            lap_start_time = record->lap.total_time;
-            lap_start_distance = record->lap.total_distance;
-            lap_start_calories = record->lap.total_calories;
-            break;
+        if (state->lap_state == LapState_Finish)
+        {
+            write_lap_finish(out, &state->lap);
+            state->lap_state = LapState_Start;
         }
+        break;
+
+    case TAG_INTERVAL_FINISH:
+    case TAG_LAP:
+        if (lap_ended)
+            state->lap_state = LapState_Finish;
+        break;
     }
+}
 
-    if (lap_state != LapState_Start)
-    {
-        if (lap_state == LapState_None)
-        {
-            lap.time = ttbin->duration - lap_start_time;
-            lap.distance = ttbin->total_distance - lap_start_distance;
-            if (ttbin->activity == ACTIVITY_TREADMILL)
-                lap.avg_speed = lap.distance / move_count;
-            else
-                lap.avg_speed = total_speed / move_count;
-            lap.max_speed = max_speed;
-            lap.calories = ttbin->total_calories - lap_start_calories;
-            if (heart_rate_count > 0)
-                lap.avg_heart_rate = (total_heart_rate + (heart_rate_count >> 1)) / heart_rate_count;
-            else
-                lap.avg_heart_rate = 0;
-            lap.max_heart_rate = max_heart_rate;
-            lap.step_count = total_step_count;
-        }
+static void finish_tcx(void *ptr)
+{
+    TCX_STATE *state = (TCX_STATE*)ptr;
+    TTBIN_FILE *ttbin = state->ttbin;
+    EMITTER *out = &state->out;
 
-        write_lap_finish(file, &lap);
+    if (state->lap_state != LapState_Start)
+    {
+        if (state->lap_state == LapState_None)
+            ttbin_lap_builder_finish(state->laps, ttbin, &state->lap);
+        write_lap_finish(out, &state->lap);
     }
 
-    fputs(        "            <Creator xsi:type=\"Device_t\">\r\n"
-                  "                <Name>TomTom GPS Sport Watch</Name>\r\n"
-                  "                <UnitId>0</UnitId>\r\n"
-                  "                <ProductID>0</ProductID>\r\n"
-                  "                <Version>\r\n", file);
-    fprintf(file, "                    <VersionMajor>%d</VersionMajor>\r\n", ttbin->firmware_version[0]);
-    fprintf(file, "                    <VersionMinor>%d</VersionMinor>\r\n", ttbin->firmware_version[1]);
-    fprintf(file, "                    <BuildMajor>%d</BuildMajor>\r\n", ttbin->firmware_version[2]);
-    fputs(        "                    <BuildMinor>0</BuildMinor>\r\n"
-                  "                </Version>\r\n"
-                  "            </Creator>\r\n"
-                  "        </Activity>\r\n"
-                  "    </Activities>\r\n"
-                  "</TrainingCenterDatabase>\r\n", file);
+    emit_str(out,    "            <Creator xsi:type=\"Device_t\">\r\n"
+                     "                <Name>TomTom GPS Sport Watch</Name>\r\n"
+                     "                <UnitId>0</UnitId>\r\n"
+                     "                <ProductID>0</ProductID>\r\n"
+                     "                <Version>\r\n");
+    emit_printf(out, "                    <VersionMajor>%d</VersionMajor>\r\n", ttbin->firmware_version[0]);
+    emit_printf(out, "                    <VersionMinor>%d</VersionMinor>\r\n", ttbin->firmware_version[1]);
+    emit_printf(out, "                    <BuildMajor>%d</BuildMajor>\r\n", ttbin->firmware_version[2]);
+    emit_str(out,    "                    <BuildMinor>0</BuildMinor>\r\n"
+                     "                </Version>\r\n"
+                     "            </Creator>\r\n"
+                     "        </Activity>\r\n"
+                     "    </Activities>\r\n"
+                     "</TrainingCenterDatabase>\r\n");
+    emit_flush(out);
+
+    ttbin_lap_builder_free(state->laps);
+    free(state);
 }
 
+const EXPORT_WRITER TCX_WRITER = { begin_tcx, write_tcx_record, finish_tcx, 0, 0, 0 };
+
+void export_tcx(TTBIN_FILE *ttbin, FILE *file)
+{
+    export_with_writer(&TCX_WRITER, ttbin, file);
+}
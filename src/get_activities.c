@@ -3,6 +3,7 @@
 ** Implementation file for the activity download routines                     **
 \******************************************************************************/
 
+#include "compression.h"
 #include "download.h"
 #include "export.h"
 #include "get_activities.h"
@@ -67,12 +68,42 @@ static void create_directory_name(DGACallback *c, struct tm timestamp)
     chdir(dir_name);
 }
 
+/*****************************************************************************/
+static void parse_activity_data_callback(const void *data, uint32_t length, void *cbdata)
+{
+    ttbin_parser_feed((TTBIN_PARSER*)cbdata, (const uint8_t*)data, length);
+}
+
+/*****************************************************************************/
+/* reads the file back, decompressing it if need be, and checks that it
+   matches the data */
+static int verify_file(const char *filename, const uint8_t *data, uint32_t length)
+{
+    FILE *file, *f;
+    uint8_t *data1;
+    int ok = 0;
+
+    file = fopen(filename, "r");
+    if (!file)
+        return 0;
+    f = decompress_stream(file);
+    data1 = (uint8_t*)malloc(length);
+    if (f && data1)
+        ok = (fread(data1, 1, length, f) == length) && (memcmp(data, data1, length) == 0);
+    free(data1);
+    if (f)
+        fclose(f);
+    fclose(file);
+    return ok;
+}
+
 /*****************************************************************************/
 static void do_get_activities_callback(uint32_t id, uint32_t length, void *cbdata)
 {
     DGACallback *c = (DGACallback*)cbdata;
     char filename[256] = {0};
     uint8_t *data;
+    TTBIN_PARSER *parser;
     TTBIN_FILE *ttbin;
     FILE *f;
     struct tm timestamp;
@@ -80,14 +111,19 @@ static void do_get_activities_callback(uint32_t id, uint32_t length, void *cbdat
     int i;
     char cwd[PATH_MAX];
 
-    if (ttwatch_read_whole_file(c->watch, id, (void**)&data, 0) != TTWATCH_NoError)
+    /* parse the activity file while it is being downloaded, or once it has
+       arrived if there isn't the memory for a parser */
+    parser = ttbin_parser_create(0, 0);
+    if (ttwatch_read_whole_file_cb(c->watch, id, (void**)&data, 0,
+            parser ? parse_activity_data_callback : 0, parser) != TTWATCH_NoError)
     {
         write_log(1, "Unable to read activity file\n");
+        if (parser)
+            free_ttbin(ttbin_parser_finish(parser));
         return;
     }
 
-    /* parse the activity file */
-    ttbin = parse_ttbin_data(data, length);
+    ttbin = parser ? ttbin_parser_finish(parser) : parse_ttbin_data(data, length);
 
     if (ttbin)
         gmtime_r(&ttbin->timestamp_local, &timestamp);
@@ -105,28 +141,26 @@ static void do_get_activities_callback(uint32_t id, uint32_t length, void *cbdat
 
     /* create the file name */
     if (ttbin)
-        sprintf(filename, "%s", create_filename(ttbin, "ttbin"));
+        sprintf(filename, "%s%s", create_filename(ttbin, "ttbin"), compression_suffix(c->options->compression));
     else
-        sprintf(filename, "Unknown_%d-%d-%d_%d.ttbin", timestamp.tm_hour, timestamp.tm_min, timestamp.tm_sec, length);
+        sprintf(filename, "Unknown_%d-%d-%d_%d.ttbin%s", timestamp.tm_hour, timestamp.tm_min, timestamp.tm_sec, length,
+            compression_suffix(c->options->compression));
 
     /* write the ttbin file */
-    f = fopen(filename, "w+");
+    f = fopen_compressed(filename, c->options->compression);
     if (f)
     {
-        uint8_t *data1;
-        fwrite(data, 1, length, f);
+        int written = (fwrite(data, 1, length, f) == length);
+        if (fclose(f))
+            written = 0;
 
         /* verify that the file was written correctly */
-        fseek(f, 0, SEEK_SET);
-        data1 = (uint8_t*)malloc(length);
-        if ((fread(data1, 1, length, f) != length) ||
-            (memcmp(data, data1, length) != 0))
+        if (!written || !verify_file(filename, data, length))
         {
             write_log(1, "TTBIN file did not verify correctly\n");
             if (ttbin)
                 free_ttbin(ttbin);
             free(data);
-            free(data1);
             chdir(cwd);
             return;
         }
@@ -135,9 +169,6 @@ static void do_get_activities_callback(uint32_t id, uint32_t length, void *cbdat
             /* delete the file from the watch only if verification passed */
             ttwatch_delete_file(c->watch, id);
         }
-        free(data1);
-
-        fclose(f);
     }
     else
         write_log(1, "Unable to write file: %s\n", filename);
@@ -189,6 +220,9 @@ static void do_get_activities_callback(uint32_t id, uint32_t length, void *cbdat
 void do_get_activities(TTWATCH *watch, OPTIONS *options, uint32_t formats)
 {
     DGACallback dgacallback = { watch, options, formats };
+    export_set_compression(options->compression);
+    export_set_simplify(options->simplify);
+    export_set_threads(options->export_threads);
     if (ttwatch_enumerate_files(watch, TTWATCH_FILE_TTBIN_DATA, do_get_activities_callback, &dgacallback) != TTWATCH_NoError)
         write_log(1, "Unable to enumerate files\n");
 }
@@ -635,6 +635,13 @@ int ttwatch_enumerate_files(TTWATCH *watch, uint32_t type, TTWATCH_FILE_ENUMERAT
 
 //------------------------------------------------------------------------------
 int ttwatch_read_whole_file(TTWATCH *watch, uint32_t id, void **data, uint32_t *length)
+{
+    return ttwatch_read_whole_file_cb(watch, id, data, length, 0, 0);
+}
+
+//------------------------------------------------------------------------------
+int ttwatch_read_whole_file_cb(TTWATCH *watch, uint32_t id, void **data, uint32_t *length,
+    TTWATCH_FILE_DATA_CALLBACK callback, void *cbdata)
 {
     uint8_t *ptr;
     uint32_t size;
@@ -665,6 +672,8 @@ int ttwatch_read_whole_file(TTWATCH *watch, uint32_t id, void **data, uint32_t *
                 *data = 0;
                 break;
             }
+            if (callback)
+                callback(ptr, len, cbdata);
             ptr  += len;
             size -= len;
         }
@@ -3,6 +3,7 @@
 ** Implementation of basic config file loading                                **
 \******************************************************************************/
 
+#include "compression.h"
 #include "export.h"
 #include "options.h"
 #include "log.h"
@@ -48,7 +49,7 @@ int split_conf_line(char *line, char **option, char **value)
         last = first + strlen(first) - 1;
         while (isspace(*last))
             --last;
-        if (last > first)
+        if (last >= first)
         {
             *value = malloc(last - first + 1 + 1);
             memcpy(*value, first, last - first + 1);
@@ -189,6 +190,29 @@ void load_conf_file(const char *filename, OPTIONS *options, ConfLoadType load_ty
         }
         else if (!strcasecmp(option, "SkipElevation"))
             result = get_bool(value, &options->skip_elevation);
+        else if (!strcasecmp(option, "Simplify"))
+        {
+            char *end = value;
+            double tolerance = value ? strtod(value, &end) : -1;
+            result = (tolerance >= 0) && (end != value) && !*end;
+            if (result)
+                options->simplify = tolerance;
+        }
+        else if (!strcasecmp(option, "ExportThreads"))
+        {
+            char *end = value;
+            long threads = value ? strtol(value, &end, 10) : -1;
+            result = (threads >= 0) && (end != value) && !*end;
+            if (result)
+                options->export_threads = (unsigned)threads;
+        }
+        else if (!strcasecmp(option, "Compress"))
+        {
+            int compression = parse_compression(value);
+            result = (compression >= 0);
+            if (result)
+                options->compression = compression;
+        }
         else if (!strcasecmp(option, "Ephemeris7days"))
             result = get_bool(value, &options->eph_7_days);
 
@@ -0,0 +1,201 @@
+/*****************************************************************************\
+** simplify.c                                                                **
+** GPS track simplification                                                  **
+\*****************************************************************************/
+
+#include "simplify.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define EARTH_RADIUS    (6371000.0)     /* metres */
+
+/* a track point, projected onto a plane around the track's first point */
+typedef struct
+{
+    double x, y;                /* metres */
+    double deviation;           /* from the line between prev and next */
+    uint32_t index;             /* into the GPS columns */
+    uint32_t prev, next;        /* neighbours still in the track */
+    uint32_t heap_pos;
+} POINT;
+
+typedef struct
+{
+    POINT *points;
+    uint32_t *heap;             /* point numbers, least deviation first */
+    uint32_t size;
+} HEAP;
+
+/*****************************************************************************/
+
+/* distance from p to the segment from a to b */
+static double segment_distance(const POINT *p, const POINT *a, const POINT *b)
+{
+    double dx = b->x - a->x;
+    double dy = b->y - a->y;
+    double length = dx * dx + dy * dy;
+    double t = 0;
+
+    if (length > 0)
+    {
+        t = ((p->x - a->x) * dx + (p->y - a->y) * dy) / length;
+        if (t < 0)
+            t = 0;
+        else if (t > 1)
+            t = 1;
+    }
+    return hypot(p->x - (a->x + t * dx), p->y - (a->y + t * dy));
+}
+
+/*****************************************************************************/
+
+static void heap_swap(HEAP *heap, uint32_t i, uint32_t j)
+{
+    uint32_t tmp = heap->heap[i];
+    heap->heap[i] = heap->heap[j];
+    heap->heap[j] = tmp;
+    heap->points[heap->heap[i]].heap_pos = i;
+    heap->points[heap->heap[j]].heap_pos = j;
+}
+
+/*****************************************************************************/
+
+static void heap_up(HEAP *heap, uint32_t i)
+{
+    while (i > 0)
+    {
+        uint32_t parent = (i - 1) / 2;
+        if (heap->points[heap->heap[parent]].deviation <= heap->points[heap->heap[i]].deviation)
+            break;
+        heap_swap(heap, i, parent);
+        i = parent;
+    }
+}
+
+/*****************************************************************************/
+
+static void heap_down(HEAP *heap, uint32_t i)
+{
+    for (;;)
+    {
+        uint32_t least = i;
+        uint32_t child = 2 * i + 1;
+        if ((child < heap->size) && (heap->points[heap->heap[child]].deviation < heap->points[heap->heap[least]].deviation))
+            least = child;
+        ++child;
+        if ((child < heap->size) && (heap->points[heap->heap[child]].deviation < heap->points[heap->heap[least]].deviation))
+            least = child;
+        if (least == i)
+            break;
+        heap_swap(heap, i, least);
+        i = least;
+    }
+}
+
+/*****************************************************************************/
+
+/* recalculates a point's deviation once one of its neighbours has gone */
+static void update_point(HEAP *heap, uint32_t n)
+{
+    POINT *point = &heap->points[n];
+    double old = point->deviation;
+
+    point->deviation = segment_distance(point, &heap->points[point->prev], &heap->points[point->next]);
+    if (point->deviation < old)
+        heap_up(heap, point->heap_pos);
+    else
+        heap_down(heap, point->heap_pos);
+}
+
+/*****************************************************************************/
+
+uint8_t *simplify_track(const GPS_COLUMNS *gps, double tolerance)
+{
+    uint8_t *keep;
+    POINT *points;
+    HEAP heap;
+    double scale_x, scale_y;
+    uint32_t count = 0;
+    uint32_t i;
+
+    keep = (uint8_t*)malloc(gps->count ? gps->count : 1);
+    if (!keep)
+        return 0;
+    memset(keep, 1, gps->count);
+
+    /* only the points with a fix make up the track */
+    points = (POINT*)malloc((gps->count ? gps->count : 1) * sizeof(POINT));
+    heap.heap = (uint32_t*)malloc((gps->count ? gps->count : 1) * sizeof(uint32_t));
+    if (!points || !heap.heap)
+    {
+        free(points);
+        free(heap.heap);
+        free(keep);
+        return 0;
+    }
+    for (i = 0; i < gps->count; ++i)
+    {
+        if ((gps->timestamp[i] == 0) || ((gps->latitude[i] == 0) && (gps->longitude[i] == 0)))
+            continue;
+        points[count++].index = i;
+    }
+    if ((count < 3) || !(tolerance > 0))
+    {
+        free(points);
+        free(heap.heap);
+        return keep;
+    }
+
+    /* an equirectangular projection is plenty accurate over a single activity */
+    scale_y = EARTH_RADIUS * M_PI / 180.0;
+    scale_x = scale_y * cos(gps->latitude[points[0].index] * M_PI / 180.0);
+    for (i = 0; i < count; ++i)
+    {
+        points[i].x = (gps->longitude[points[i].index] - gps->longitude[points[0].index]) * scale_x;
+        points[i].y = (gps->latitude[points[i].index]  - gps->latitude[points[0].index])  * scale_y;
+        points[i].prev = i - 1;
+        points[i].next = i + 1;
+    }
+
+    /* the end points go in with an infinite deviation so that they are
+       never taken out */
+    heap.points = points;
+    heap.size = count;
+    for (i = 0; i < count; ++i)
+    {
+        if ((i == 0) || (i == count - 1))
+            points[i].deviation = INFINITY;
+        else
+            points[i].deviation = segment_distance(&points[i], &points[i - 1], &points[i + 1]);
+        heap.heap[i] = i;
+        points[i].heap_pos = i;
+    }
+    for (i = count / 2; i-- > 0; )
+        heap_down(&heap, i);
+
+    while (heap.size > 2)
+    {
+        uint32_t n = heap.heap[0];
+        POINT *point = &points[n];
+        if (point->deviation > tolerance)
+            break;
+
+        /* take the point out of the heap and the track */
+        heap_swap(&heap, 0, --heap.size);
+        heap_down(&heap, 0);
+        keep[point->index] = 0;
+        points[point->prev].next = point->next;
+        points[point->next].prev = point->prev;
+
+        if (point->prev != 0)
+            update_point(&heap, point->prev);
+        if (point->next != count - 1)
+            update_point(&heap, point->next);
+    }
+
+    free(points);
+    free(heap.heap);
+    return keep;
+}
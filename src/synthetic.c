@@ -0,0 +1,402 @@
+/*****************************************************************************\
+** synthetic.c                                                               **
+** Synthetic TTBIN activity generator                                        **
+\*****************************************************************************/
+
+#include "synthetic.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const struct
+{
+    const char *name;
+    uint8_t activity;
+    float speed;        /* typical speed, m/s */
+    float cycles;       /* steps/sec, crank rpm or strokes/min */
+} ACTIVITIES[] = {
+    { "running",      ACTIVITY_RUNNING,      3.0f,  2.8f },
+    { "cycling",      ACTIVITY_CYCLING,      7.5f, 85.0f },
+    { "swimming",     ACTIVITY_SWIMMING,     0.9f, 30.0f },
+    { "treadmill",    ACTIVITY_TREADMILL,    3.0f,  2.8f },
+    { "freestyle",    ACTIVITY_FREESTYLE,    2.0f,  1.5f },
+    { "hiking",       ACTIVITY_HIKING,       1.3f,  1.8f },
+    { "trailrunning", ACTIVITY_TRAILRUNNING, 2.6f,  2.7f },
+};
+#define ACTIVITY_COUNT  (sizeof(ACTIVITIES) / sizeof(ACTIVITIES[0]))
+
+/* record lengths (including the tag byte) as listed in a watch file header */
+static const struct
+{
+    uint8_t  tag;
+    uint16_t length;
+} LENGTHS[] = {
+    { TAG_FILE_HEADER,         117 }, { TAG_STATUS,             7 }, { TAG_GPS,                 28 },
+    { TAG_HEART_RATE,            7 }, { TAG_SUMMARY,           12 }, { TAG_POOL_SIZE,            5 },
+    { TAG_WHEEL_SIZE,            5 }, { TAG_TRAINING_SETUP,    10 }, { TAG_LAP,                 11 },
+    { TAG_CYCLING_CADENCE,      11 }, { TAG_TREADMILL,         17 }, { TAG_SWIM,                21 },
+    { TAG_GOAL_PROGRESS,         6 }, { TAG_INTERVAL_SETUP,    22 }, { TAG_INTERVAL_START,       2 },
+    { TAG_INTERVAL_FINISH,      13 }, { TAG_RACE_SETUP,        41 }, { TAG_RACE_RESULT,         11 },
+    { TAG_ALTITUDE_UPDATE,       8 }, { TAG_HEART_RATE_RECOVERY, 9 }, { TAG_INDOOR_CYCLING,     13 },
+    { TAG_GYM,                  11 }, { TAG_FITNESS_POINT,      9 },
+};
+#define LENGTH_COUNT    (sizeof(LENGTHS) / sizeof(LENGTHS[0]))
+
+typedef struct
+{
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+} BUFFER;
+
+/*****************************************************************************/
+
+static void put(BUFFER *buf, const void *data, size_t length)
+{
+    if (buf->size + length > buf->capacity)
+    {
+        buf->capacity = (buf->capacity + length) * 2;
+        buf->data = realloc(buf->data, buf->capacity);
+    }
+    memcpy(buf->data + buf->size, data, length);
+    buf->size += length;
+}
+
+static void put8(BUFFER *buf, uint8_t value)   { put(buf, &value, 1); }
+static void put16(BUFFER *buf, uint16_t value) { uint8_t b[2] = { value, value >> 8 }; put(buf, b, 2); }
+static void put32(BUFFER *buf, uint32_t value) { uint8_t b[4] = { value, value >> 8, value >> 16, value >> 24 }; put(buf, b, 4); }
+static void putf(BUFFER *buf, float value)     { uint32_t v; memcpy(&v, &value, 4); put32(buf, v); }
+
+/*****************************************************************************/
+
+/* xorshift32, so that the same seed gives the same file everywhere */
+static uint32_t next_random(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+/* uniform in [-1, 1] */
+static float random_unit(uint32_t *state)
+{
+    return (next_random(state) / 2147483647.5f) - 1.0f;
+}
+
+/*****************************************************************************/
+
+static void put_status(BUFFER *buf, uint8_t status, uint8_t activity, uint32_t local_time)
+{
+    put8(buf, TAG_STATUS); put8(buf, status); put8(buf, activity); put32(buf, local_time);
+}
+
+static void put_lap(BUFFER *buf, uint32_t seconds, float distance, uint16_t calories)
+{
+    put8(buf, TAG_LAP); put32(buf, seconds); putf(buf, distance); put16(buf, calories);
+}
+
+static void put_interval_finish(BUFFER *buf, int type, uint32_t seconds, float distance, uint16_t calories)
+{
+    put8(buf, TAG_INTERVAL_FINISH); put16(buf, type); put32(buf, seconds); putf(buf, distance); put16(buf, calories);
+}
+
+/*****************************************************************************/
+
+static BUFFER generate(const SYNTHETIC_ACTIVITY *s)
+{
+    const uint32_t start = 1500000000 + (s->seed % 100000) * 60;
+    const int32_t offset = 3600;
+    const uint8_t activity = ACTIVITIES[s->activity].activity;
+    const unsigned seconds = (unsigned)(s->hours * 3600);
+    const int indoor = (activity == ACTIVITY_TREADMILL) || (activity == ACTIVITY_SWIMMING);
+    BUFFER buf = { 0, 0, 0 };
+    uint8_t zero[96] = { 0 };
+    uint32_t rng = s->seed ? s->seed : 1;
+    double lat = 51.5 + random_unit(&rng) * 0.5;
+    double lon = -0.1 + random_unit(&rng) * 0.5;
+    float heading = (next_random(&rng) % 36000) / 100.0f;
+    float heart_rate = 70.0f;
+    float altitude = 0.0f, climb = 0.0f;
+    float distance = 0.0f, calories = 0.0f;
+    float next_lap = 0.0f;
+    uint32_t steps = 0, strokes = 0, swim_laps = 0;
+    uint32_t wheel_revs = 0, crank_revs = 0;
+    float wheel_time = 0.0f, crank_time = 0.0f;
+    unsigned goal_percent = 0;
+    int race_finished = 0;
+    int phase = 0;
+    uint32_t phase_set = 0;
+    uint32_t phase_end = 0, phase_start = 0;
+    float phase_distance = 0.0f, phase_calories = 0.0f;
+    unsigned i;
+
+    /* header */
+    put8(&buf, TAG_FILE_HEADER);
+    put16(&buf, 8);                 /* file version */
+    put(&buf, "\x01\x02\x03", 3);   /* firmware version */
+    put16(&buf, 0x0e);              /* product id */
+    put32(&buf, start + offset);
+    put(&buf, zero, 16 + 80);
+    put32(&buf, start + offset);
+    put32(&buf, offset);
+    put8(&buf, 0);
+    put8(&buf, LENGTH_COUNT);
+    for (i = 0; i < LENGTH_COUNT; ++i)
+    {
+        put8(&buf, LENGTHS[i].tag);
+        put16(&buf, LENGTHS[i].length);
+    }
+
+    /* training setup */
+    put8(&buf, TAG_TRAINING_SETUP);
+    switch (s->mode)
+    {
+    case MODE_LAPS_TIME:     put8(&buf, TRAINING_LAPS_TIME);     putf(&buf, s->mode_value); break;
+    case MODE_LAPS_DISTANCE: put8(&buf, TRAINING_LAPS_DISTANCE); putf(&buf, s->mode_value); break;
+    case MODE_GOAL_DISTANCE: put8(&buf, TRAINING_GOAL_DISTANCE); putf(&buf, s->mode_value); break;
+    case MODE_RACE:          put8(&buf, TRAINING_RACE);          putf(&buf, s->mode_value); break;
+    case MODE_INTERVALS:     put8(&buf, TRAINING_INTERVALS);     putf(&buf, 0.0f);          break;
+    default:                 put8(&buf, TRAINING_LAPS_MANUAL);   putf(&buf, 0.0f);          break;
+    }
+    putf(&buf, 0.0f);
+
+    if (activity == ACTIVITY_SWIMMING)
+    {
+        put8(&buf, TAG_POOL_SIZE); put32(&buf, 2500);
+    }
+    if ((activity == ACTIVITY_CYCLING) && (s->sensors & SENSOR_CADENCE))
+    {
+        put8(&buf, TAG_WHEEL_SIZE); put32(&buf, 2100);
+    }
+    if (s->mode == MODE_RACE)
+    {
+        /* the target time is the race distance at the typical speed */
+        put8(&buf, TAG_RACE_SETUP);
+        put(&buf, zero, 16);
+        putf(&buf, s->mode_value);
+        put32(&buf, (uint32_t)(s->mode_value / ACTIVITIES[s->activity].speed));
+        put(&buf, "Synthetic race\0\0", 16);
+    }
+    if (s->mode == MODE_INTERVALS)
+    {
+        put8(&buf, TAG_INTERVAL_SETUP);
+        put8(&buf, TTBIN_INTERVAL_TYPE_TIME); put32(&buf, s->intervals[0]);
+        put8(&buf, TTBIN_INTERVAL_TYPE_TIME); put32(&buf, s->intervals[1]);
+        put8(&buf, TTBIN_INTERVAL_TYPE_TIME); put32(&buf, s->intervals[2]);
+        put8(&buf, TTBIN_INTERVAL_TYPE_TIME); put32(&buf, s->intervals[3]);
+        put8(&buf, s->intervals[4]);
+    }
+
+    put_status(&buf, TTBIN_STATUS_READY,  activity, start + offset);
+    put_status(&buf, TTBIN_STATUS_ACTIVE, activity, start + offset);
+
+    if (s->mode == MODE_INTERVALS)
+    {
+        phase = TTBIN_INTERVAL_TYPE_WARMUP;
+        phase_end = s->intervals[0];
+        put8(&buf, TAG_INTERVAL_START); put8(&buf, phase);
+    }
+    if (s->mode == MODE_LAPS_MANUAL)
+        next_lap = 500.0f + (next_random(&rng) % 1500);
+    else if ((s->mode == MODE_LAPS_DISTANCE) || (s->mode == MODE_LAPS_TIME))
+        next_lap = s->mode_value;
+
+    for (i = 0; i < seconds; ++i)
+    {
+        /* effort varies slowly, with harder work intervals */
+        float effort = 0.85f + 0.1f * sinf(i / 900.0f) + 0.05f * random_unit(&rng);
+        float speed, cycles;
+        if (phase == TTBIN_INTERVAL_TYPE_WORK)
+            effort *= 1.25f;
+        else if (phase == TTBIN_INTERVAL_TYPE_REST)
+            effort *= 0.6f;
+        speed  = ACTIVITIES[s->activity].speed * effort;
+        cycles = ACTIVITIES[s->activity].cycles * (0.9f + 0.1f * effort);
+
+        distance += speed;
+        calories += 0.1f + 0.05f * effort;
+        heading += random_unit(&rng) * 5.0f;
+        if (heading < 0.0f)
+            heading += 360.0f;
+        else if (heading >= 360.0f)
+            heading -= 360.0f;
+        lat += speed * cos(heading * M_PI / 180.0) / 111320.0;
+        lon += speed * sin(heading * M_PI / 180.0) / (111320.0 * cos(lat * M_PI / 180.0));
+        heart_rate += (100.0f + 70.0f * effort - heart_rate) * 0.05f + random_unit(&rng);
+        steps += (uint32_t)cycles;
+
+        if ((i % s->rate) == 0)
+        {
+            if (activity == ACTIVITY_TREADMILL)
+            {
+                put8(&buf, TAG_TREADMILL);
+                put32(&buf, start + offset + i);
+                putf(&buf, distance);
+                put16(&buf, (uint16_t)calories);
+                put32(&buf, steps);
+                put16(&buf, (uint16_t)(speed * 100.0f / cycles));
+            }
+            else if (activity == ACTIVITY_SWIMMING)
+            {
+                uint32_t new_strokes = (uint32_t)(cycles * s->rate / 60.0f + 0.5f);
+                strokes += new_strokes;
+                swim_laps = (uint32_t)(distance / 25.0f);
+                put8(&buf, TAG_SWIM);
+                put32(&buf, start + offset + i);
+                putf(&buf, swim_laps * 25.0f);
+                put8(&buf, (uint8_t)cycles);
+                put8(&buf, 1);      /* freestyle */
+                put32(&buf, new_strokes);
+                put32(&buf, swim_laps);
+                put16(&buf, (uint16_t)calories);
+            }
+            else
+            {
+                put8(&buf, TAG_GPS);
+                put32(&buf, (int32_t)(lat * 1e7));
+                put32(&buf, (int32_t)(lon * 1e7));
+                put16(&buf, (uint16_t)(heading * 100.0f));
+                put16(&buf, (uint16_t)(speed * 100.0f));
+                put32(&buf, start + i);
+                put16(&buf, (uint16_t)calories);
+                putf(&buf, speed);
+                putf(&buf, distance);
+                put8(&buf, (uint8_t)cycles);
+            }
+
+            if ((activity == ACTIVITY_CYCLING) && (s->sensors & SENSOR_CADENCE))
+            {
+                wheel_revs += (uint32_t)(speed * s->rate / 2.1f);
+                crank_revs += (uint32_t)(cycles * s->rate / 60.0f);
+                wheel_time += 1024.0f * s->rate;
+                crank_time += 1024.0f * s->rate;
+                put8(&buf, TAG_CYCLING_CADENCE);
+                put32(&buf, wheel_revs);
+                put16(&buf, (uint16_t)fmodf(wheel_time, 65536.0f));
+                put16(&buf, (uint16_t)crank_revs);
+                put16(&buf, (uint16_t)fmodf(crank_time, 65536.0f));
+            }
+        }
+
+        if (s->sensors & SENSOR_HEART_RATE)
+        {
+            put8(&buf, TAG_HEART_RATE);
+            put8(&buf, (uint8_t)heart_rate);
+            put8(&buf, 0);
+            put32(&buf, start + offset + i);
+        }
+
+        if ((s->sensors & SENSOR_ALTITUDE) && !indoor && ((i % 60) == 0))
+        {
+            float change = random_unit(&rng) * 3.0f;
+            altitude += change;
+            if (change > 0.0f)
+                climb += change;
+            put8(&buf, TAG_ALTITUDE_UPDATE);
+            put16(&buf, (int16_t)altitude);
+            putf(&buf, climb);
+            put8(&buf, 0);
+        }
+
+        switch (s->mode)
+        {
+        case MODE_LAPS_MANUAL:
+        case MODE_LAPS_DISTANCE:
+            if (distance >= next_lap)
+            {
+                put_lap(&buf, i + 1, distance, (uint16_t)calories);
+                next_lap += (s->mode == MODE_LAPS_MANUAL) ? 500.0f + (next_random(&rng) % 1500) : s->mode_value;
+            }
+            break;
+        case MODE_LAPS_TIME:
+            if (i + 1 >= next_lap)
+            {
+                put_lap(&buf, i + 1, distance, (uint16_t)calories);
+                next_lap += s->mode_value;
+            }
+            break;
+        case MODE_GOAL_DISTANCE:
+            while ((goal_percent < 100) && (distance * 100.0f >= s->mode_value * (goal_percent + 1)))
+            {
+                ++goal_percent;
+                put8(&buf, TAG_GOAL_PROGRESS); put8(&buf, goal_percent); put32(&buf, (uint32_t)distance);
+            }
+            break;
+        case MODE_RACE:
+            if (!race_finished && (distance >= s->mode_value))
+            {
+                put8(&buf, TAG_RACE_RESULT); put32(&buf, i + 1); putf(&buf, distance); put16(&buf, (uint16_t)calories);
+                race_finished = 1;
+            }
+            break;
+        case MODE_INTERVALS:
+            if (phase && (phase != TTBIN_INTERVAL_TYPE_FINISHED) && (i + 1 >= phase_end))
+            {
+                put_interval_finish(&buf, phase, i + 1 - phase_start,
+                    distance - phase_distance, (uint16_t)(calories - phase_calories));
+                phase_start = i + 1;
+                phase_distance = distance;
+                phase_calories = calories;
+
+                /* warmup, then work and rest for each set, then cool down */
+                switch (phase)
+                {
+                case TTBIN_INTERVAL_TYPE_WARMUP:
+                    phase = TTBIN_INTERVAL_TYPE_WORK;
+                    break;
+                case TTBIN_INTERVAL_TYPE_WORK:
+                    phase = (++phase_set < s->intervals[4]) ? TTBIN_INTERVAL_TYPE_REST : TTBIN_INTERVAL_TYPE_COOLDOWN;
+                    break;
+                case TTBIN_INTERVAL_TYPE_REST:
+                    phase = TTBIN_INTERVAL_TYPE_WORK;
+                    break;
+                default:
+                    phase = TTBIN_INTERVAL_TYPE_FINISHED;
+                    break;
+                }
+                put8(&buf, TAG_INTERVAL_START); put8(&buf, phase);
+                if (phase != TTBIN_INTERVAL_TYPE_FINISHED)
+                    phase_end += s->intervals[phase - 1];
+            }
+            break;
+        }
+    }
+
+    put_status(&buf, TTBIN_STATUS_STOPPED, activity, start + offset + seconds);
+    if (s->sensors & SENSOR_HEART_RATE)
+    {
+        put8(&buf, TAG_HEART_RATE_RECOVERY); put32(&buf, 3); put32(&buf, 25);
+    }
+
+    put8(&buf, TAG_SUMMARY);
+    put8(&buf, activity);
+    putf(&buf, distance);
+    put32(&buf, seconds);
+    put16(&buf, (uint16_t)calories);
+    return buf;
+}
+
+/*****************************************************************************/
+
+int find_synthetic_activity(const char *name)
+{
+    unsigned i;
+    for (i = 0; i < ACTIVITY_COUNT; ++i)
+    {
+        if (!strcasecmp(name, ACTIVITIES[i].name))
+            return i;
+    }
+    return -1;
+}
+
+/*****************************************************************************/
+
+uint8_t *generate_ttbin(const SYNTHETIC_ACTIVITY *activity, size_t *size)
+{
+    BUFFER buf = generate(activity);
+    *size = buf.size;
+    return buf.data;
+}
@@ -4,6 +4,8 @@
 \*****************************************************************************/
 
 #include "ttbin.h"
+#include "compression.h"
+#include "cycling_cadence.h"
 
 #include <ctype.h>
 #include <stddef.h>
@@ -12,6 +14,11 @@
 #include <string.h>
 #include <math.h>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <curl/curl.h>
 
 #define max(a, b)   ((a) > (b) ? (a) : (b))
@@ -218,30 +225,386 @@ typedef struct __attribute__((packed))
 
 /*****************************************************************************/
 
+/* The layout of every fixed-format record, from which both decode_record and
+   serialize_ttbin are generated. Each line maps a field of the FILE_ record
+   to a field of the TTBIN_RECORD member, with a codec for the conversion:
+     COPY       same value in both
+     LOCAL      local time in the file, utc in memory
+     DEGREES    degrees * 1e7 in the file
+     CENTI      hundredths in the file (rounded when written)
+     BYTES      array copied as is
+   File fields that aren't listed are written as zero */
+#define STATUS_FIELDS(F, r) \
+    F(r, status,                 status,                 COPY)      \
+    F(r, activity,               activity,               COPY)      \
+    F(r, timestamp,              timestamp,              LOCAL)
+
+#define GPS_FIELDS(F, r) \
+    F(r, latitude,               latitude,               DEGREES)   \
+    F(r, longitude,              longitude,              DEGREES)   \
+    F(r, heading,                heading,                CENTI)     \
+    F(r, gps_speed,              gps_speed,              COPY)      \
+    F(r, timestamp,              timestamp,              COPY)      \
+    F(r, calories,               calories,               COPY)      \
+    F(r, instant_speed,          instant_speed,          COPY)      \
+    F(r, cum_distance,           cum_distance,           COPY)      \
+    F(r, cycles,                 cycles,                 COPY)
+
+/* the compact in-memory form keeps the file's encoding */
+#define COMPACT_GPS_FIELDS(F, r) \
+    F(r, latitude,               latitude,               COPY)      \
+    F(r, longitude,              longitude,              COPY)      \
+    F(r, heading,                heading,                COPY)      \
+    F(r, gps_speed,              gps_speed,              COPY)      \
+    F(r, timestamp,              timestamp,              COPY)      \
+    F(r, calories,               calories,               COPY)      \
+    F(r, instant_speed,          instant_speed,          COPY)      \
+    F(r, cum_distance,           cum_distance,           COPY)      \
+    F(r, cycles,                 cycles,                 COPY)
+
+#define HEART_RATE_FIELDS(F, r) \
+    F(r, heart_rate,             heart_rate,             COPY)      \
+    F(r, timestamp,              timestamp,              LOCAL)
+
+#define LAP_FIELDS(F, r) \
+    F(r, total_time,             total_time,             COPY)      \
+    F(r, total_distance,         total_distance,         COPY)      \
+    F(r, total_calories,         total_calories,         COPY)
+
+#define CYCLING_CADENCE_FIELDS(F, r) \
+    F(r, wheel_revolutions,      wheel_revolutions,      COPY)      \
+    F(r, wheel_revolutions_time, wheel_revolutions_time, COPY)      \
+    F(r, crank_revolutions,      crank_revolutions,      COPY)      \
+    F(r, crank_revolutions_time, crank_revolutions_time, COPY)
+
+#define TREADMILL_FIELDS(F, r) \
+    F(r, timestamp,              timestamp,              LOCAL)     \
+    F(r, distance,               distance,               COPY)      \
+    F(r, calories,               calories,               COPY)      \
+    F(r, steps,                  steps,                  COPY)      \
+    F(r, step_length,            step_length,            COPY)
+
+#define SWIM_FIELDS(F, r) \
+    F(r, timestamp,              timestamp,              LOCAL)     \
+    F(r, total_distance,         total_distance,         COPY)      \
+    F(r, frequency,              frequency,              COPY)      \
+    F(r, stroke_type,            stroke_type,            COPY)      \
+    F(r, strokes,                strokes,                COPY)      \
+    F(r, completed_laps,         completed_laps,         COPY)      \
+    F(r, total_calories,         total_calories,         COPY)
+
+#define RACE_SETUP_FIELDS(F, r) \
+    F(r, race_id,                race_id,                BYTES)     \
+    F(r, distance,               distance,               COPY)      \
+    F(r, duration,               duration,               COPY)      \
+    F(r, name,                   name,                   BYTES)
+
+#define RACE_RESULT_FIELDS(F, r) \
+    F(r, duration,               duration,               COPY)      \
+    F(r, distance,               distance,               COPY)      \
+    F(r, calories,               calories,               COPY)
+
+#define TRAINING_SETUP_FIELDS(F, r) \
+    F(r, type,                   type,                   COPY)      \
+    F(r, min,                    value_min,              COPY)      \
+    F(r, max,                    max,                    COPY)
+
+#define GOAL_PROGRESS_FIELDS(F, r) \
+    F(r, percent,                percent,                COPY)      \
+    F(r, value,                  value,                  COPY)
+
+#define INTERVAL_SETUP_FIELDS(F, r) \
+    F(r, warm_type,              warm_type,              COPY)      \
+    F(r, warm,                   warm,                   COPY)      \
+    F(r, work_type,              work_type,              COPY)      \
+    F(r, work,                   work,                   COPY)      \
+    F(r, rest_type,              rest_type,              COPY)      \
+    F(r, rest,                   rest,                   COPY)      \
+    F(r, cool_type,              cool_type,              COPY)      \
+    F(r, cool,                   cool,                   COPY)      \
+    F(r, sets,                   sets,                   COPY)
+
+#define INTERVAL_START_FIELDS(F, r) \
+    F(r, type,                   type,                   COPY)
+
+#define INTERVAL_FINISH_FIELDS(F, r) \
+    F(r, type,                   type,                   COPY)      \
+    F(r, total_time,             total_time,             COPY)      \
+    F(r, total_distance,         total_distance,         COPY)      \
+    F(r, total_calories,         total_calories,         COPY)
+
+#define ALTITUDE_FIELDS(F, r) \
+    F(r, rel_altitude,           rel_altitude,           COPY)      \
+    F(r, total_climb,            total_climb,            COPY)      \
+    F(r, qualifier,              qualifier,              COPY)
+
+#define POOL_SIZE_FIELDS(F, r) \
+    F(r, pool_size,              pool_size,              COPY)
+
+#define WHEEL_SIZE_FIELDS(F, r) \
+    F(r, wheel_size,             wheel_size,             COPY)
+
+#define HEART_RATE_RECOVERY_FIELDS(F, r) \
+    F(r, status,                 status,                 COPY)      \
+    F(r, heart_rate,             heart_rate,             COPY)
+
+#define GYM_FIELDS(F, r) \
+    F(r, timestamp,              timestamp,              COPY)      \
+    F(r, total_calories,         total_calories,         COPY)      \
+    F(r, total_cycles,           total_cycles,           COPY)
+
+#define FITNESS_POINT_FIELDS(F, r) \
+    F(r, timestamp,              timestamp,              COPY)      \
+    F(r, points1,                points1,                COPY)      \
+    F(r, points2,                points2,                COPY)
+
+/* tag, file record, TTBIN_RECORD member, fields */
+#define RECORD_TYPES(R) \
+    R(TAG_STATUS,              FILE_STATUS_RECORD,              status,              STATUS_FIELDS)              \
+    R(TAG_GPS,                 FILE_GPS_RECORD,                 gps,                 GPS_FIELDS)                 \
+    R(TAG_HEART_RATE,          FILE_HEART_RATE_RECORD,          heart_rate,          HEART_RATE_FIELDS)          \
+    R(TAG_LAP,                 FILE_LAP_RECORD,                 lap,                 LAP_FIELDS)                 \
+    R(TAG_CYCLING_CADENCE,     FILE_CYCLING_CADENCE_RECORD,     cycling_cadence,     CYCLING_CADENCE_FIELDS)     \
+    R(TAG_TREADMILL,           FILE_TREADMILL_RECORD,           treadmill,           TREADMILL_FIELDS)           \
+    R(TAG_SWIM,                FILE_SWIM_RECORD,                swim,                SWIM_FIELDS)                \
+    R(TAG_RACE_SETUP,          FILE_RACE_SETUP_RECORD,          race_setup,          RACE_SETUP_FIELDS)          \
+    R(TAG_RACE_RESULT,         FILE_RACE_RESULT_RECORD,         race_result,         RACE_RESULT_FIELDS)         \
+    R(TAG_TRAINING_SETUP,      FILE_TRAINING_SETUP_RECORD,      training_setup,      TRAINING_SETUP_FIELDS)      \
+    R(TAG_GOAL_PROGRESS,       FILE_GOAL_PROGRESS_RECORD,       goal_progress,       GOAL_PROGRESS_FIELDS)       \
+    R(TAG_INTERVAL_SETUP,      FILE_INTERVAL_SETUP_RECORD,      interval_setup,      INTERVAL_SETUP_FIELDS)      \
+    R(TAG_INTERVAL_START,      FILE_INTERVAL_START_RECORD,      interval_start,      INTERVAL_START_FIELDS)      \
+    R(TAG_INTERVAL_FINISH,     FILE_INTERVAL_FINISH_RECORD,     interval_finish,     INTERVAL_FINISH_FIELDS)     \
+    R(TAG_ALTITUDE_UPDATE,     FILE_ALTITUDE_RECORD,            altitude,            ALTITUDE_FIELDS)            \
+    R(TAG_POOL_SIZE,           FILE_POOL_SIZE_RECORD,           pool_size,           POOL_SIZE_FIELDS)           \
+    R(TAG_WHEEL_SIZE,          FILE_WHEEL_SIZE_RECORD,          wheel_size,          WHEEL_SIZE_FIELDS)          \
+    R(TAG_HEART_RATE_RECOVERY, FILE_HEART_RATE_RECOVERY_RECORD, heart_rate_recovery, HEART_RATE_RECOVERY_FIELDS) \
+    R(TAG_GYM,                 FILE_GYM_RECORD,                 gym,                 GYM_FIELDS)                 \
+    R(TAG_FITNESS_POINT,       FILE_FITNESS_POINT_RECORD,       fitness_point,       FITNESS_POINT_FIELDS)
+
+/* file value -> record value */
+#define DECODE_COPY(dst, src)       (dst) = (src)
+#define DECODE_LOCAL(dst, src)      (dst) = (src) - utc_offset
+#define DECODE_DEGREES(dst, src)    (dst) = (src) / 1e7
+#define DECODE_CENTI(dst, src)      (dst) = (src) / 100.0f
+#define DECODE_BYTES(dst, src)      memcpy((dst), (src), sizeof(src))
+
+/* record value -> file value */
+#define ENCODE_COPY(dst, src)       (dst) = (src)
+#define ENCODE_LOCAL(dst, src)      (dst) = (src) + utc_offset
+#define ENCODE_DEGREES(dst, src)    (dst) = (int32_t)((src) * 1e7)
+#define ENCODE_CENTI(dst, src)      (dst) = (uint16_t)((src) * 100.0f + 0.5f)
+#define ENCODE_BYTES(dst, src)      memcpy((dst), (src), sizeof(dst))
+
+#define DECODE_FIELD(r, file_field, field, codec)   DECODE_##codec(record->r.field, in->file_field);
+#define ENCODE_FIELD(r, file_field, field, codec)   ENCODE_##codec(out->file_field, record->r.field);
+
+/*****************************************************************************/
+
 TTBIN_FILE *read_ttbin_file(FILE *file)
 {
-    uint32_t size = 0;
-    uint8_t *data = 0;
-    TTBIN_FILE *ttbin;
+    uint8_t data[65536];
+    TTBIN_PARSER *parser;
+    FILE *input;
+    size_t size;
+
+    /* compressed files are decompressed as they are read */
+    input = decompress_stream(file);
+    if (!input)
+        return 0;
+
+    /* feed the parser as the data arrives, so the whole file never has
+       to be held in memory */
+    parser = ttbin_parser_create(0, 0);
+    if (!parser)
+    {
+        fclose(input);
+        return 0;
+    }
 
-    while (!feof(file))
+    while ((size = fread(data, 1, sizeof(data), input)) > 0)
     {
-        data = realloc(data, size + 1024);
-        size += fread(data + size, 1, 1024, file);
+        if (!ttbin_parser_feed(parser, data, size))
+            break;
     }
 
-    ttbin = parse_ttbin_data(data, size);
+    /* a read error, or compressed data that stops short, leaves the file
+       incomplete */
+    if (ferror(input))
+    {
+        fclose(input);
+        free_ttbin(ttbin_parser_finish(parser));
+        return 0;
+    }
 
-    free(data);
+    fclose(input);
+    return ttbin_parser_finish(parser);
+}
+
+/*****************************************************************************/
+
+TTBIN_FILE *read_ttbin_fd(int fd)
+{
+    struct stat st;
+    uint8_t *data;
+    uint8_t magic[4];
+    TTBIN_FILE *ttbin = 0;
+
+    if (fstat(fd, &st) < 0)
+        return 0;
+
+    /* pipes, terminals etc. can't be mapped or sized, so just read them,
+       as are compressed files, which have to be decompressed first */
+    if (!S_ISREG(st.st_mode) || ((pread(fd, magic, sizeof(magic), 0) == sizeof(magic))
+        && (detect_compression(magic, sizeof(magic)) != COMPRESSION_NONE)))
+    {
+        FILE *file;
+        if (S_ISREG(st.st_mode))
+            lseek(fd, 0, SEEK_SET);
+        file = fdopen(dup(fd), "r");
+        if (!file)
+            return 0;
+        ttbin = read_ttbin_file(file);
+        fclose(file);
+        return ttbin;
+    }
+
+    if ((st.st_size == 0) || (st.st_size > UINT32_MAX))
+        return 0;
+
+    /* map the file so that the parser reads straight out of the page cache */
+    data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED)
+    {
+        ttbin = parse_ttbin_data(data, st.st_size);
+        munmap(data, st.st_size);
+        return ttbin;
+    }
+
+    /* mapping failed, so fall back to a single read of the whole file */
+    data = malloc(st.st_size);
+    if (data)
+    {
+        off_t size = 0;
+        ssize_t len = 1;
+        while ((size < st.st_size) && (len > 0))
+        {
+            len = pread(fd, data + size, st.st_size - size, size);
+            if (len > 0)
+                size += len;
+        }
+        if (size == st.st_size)
+            ttbin = parse_ttbin_data(data, size);
+        free(data);
+    }
+    return ttbin;
+}
+
+/*****************************************************************************/
+
+TTBIN_FILE *read_ttbin_path(const char *filename)
+{
+    TTBIN_FILE *ttbin;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    ttbin = read_ttbin_fd(fd);
+
+    close(fd);
     return ttbin;
 }
 
 /*****************************************************************************/
 
-static TTBIN_RECORD *append_record(TTBIN_FILE *ttbin, uint8_t tag, uint16_t length)
+/* records are carved out of large slabs rather than being individually
+   allocated; slabs start small and double in size up to a limit */
+#define SLAB_MIN_SIZE   (16 * 1024)
+#define SLAB_MAX_SIZE   (1024 * 1024)
+#define SLAB_ALIGN(x)   (((x) + 7) & ~(size_t)7)
+
+typedef struct _TTBIN_SLAB
+{
+    struct _TTBIN_SLAB *next;
+    size_t size;
+    size_t used;
+} TTBIN_SLAB;
+
+static void *arena_alloc(TTBIN_FILE *ttbin, size_t size)
+{
+    TTBIN_SLAB *slab = ttbin->slabs;
+    size_t slab_size;
+    void *ptr;
+
+    size = SLAB_ALIGN(size);
+    if (slab && (slab->used + size <= slab->size))
+    {
+        ptr = (uint8_t*)slab + SLAB_ALIGN(sizeof(TTBIN_SLAB)) + slab->used;
+        slab->used += size;
+        return ptr;
+    }
+
+    slab_size = slab ? slab->size * 2 : SLAB_MIN_SIZE;
+    if (slab_size > SLAB_MAX_SIZE)
+        slab_size = SLAB_MAX_SIZE;
+
+    if (slab && (size > slab_size / 4))
+    {
+        /* large blocks (mostly record arrays) get a slab of their own, which
+           is kept behind the current one so it can carry on being used */
+        TTBIN_SLAB *big = malloc(SLAB_ALIGN(sizeof(TTBIN_SLAB)) + size);
+        if (!big)
+            return 0;
+        big->size = big->used = size;
+        big->next = slab->next;
+        slab->next = big;
+        return (uint8_t*)big + SLAB_ALIGN(sizeof(TTBIN_SLAB));
+    }
+
+    if (slab_size < size)
+        slab_size = size;
+    slab = malloc(SLAB_ALIGN(sizeof(TTBIN_SLAB)) + slab_size);
+    if (!slab)
+        return 0;
+    slab->size = slab_size;
+    slab->used = size;
+    slab->next = ttbin->slabs;
+    ttbin->slabs = slab;
+    return (uint8_t*)slab + SLAB_ALIGN(sizeof(TTBIN_SLAB));
+}
+
+/*****************************************************************************/
+
+/* makes sure the next 'size' bytes of allocations fit in one slab */
+static int arena_reserve(TTBIN_FILE *ttbin, size_t size)
+{
+    TTBIN_SLAB *slab = ttbin->slabs;
+
+    if (slab && (slab->used + size <= slab->size))
+        return 1;
+
+    slab = malloc(SLAB_ALIGN(sizeof(TTBIN_SLAB)) + size);
+    if (!slab)
+        return 0;
+    slab->size = size;
+    slab->used = 0;
+    slab->next = ttbin->slabs;
+    ttbin->slabs = slab;
+    return 1;
+}
+
+/*****************************************************************************/
+
+static size_t record_size(const TTBIN_FILE *ttbin, uint8_t tag, uint16_t length)
+{
+    /* compact GPS records are the bulk of a file, so only take the space
+       they need rather than the size of the whole union */
+    if (ttbin->compact_gps && (tag == TAG_GPS))
+        return offsetof(TTBIN_RECORD, gps_compact) + sizeof(COMPACT_GPS_RECORD);
+    return max(sizeof(TTBIN_RECORD), offsetof(TTBIN_RECORD, data) + length - 1);
+}
+
+static void append_record(TTBIN_FILE *ttbin, TTBIN_RECORD *record)
 {
-    size_t size = offsetof(TTBIN_RECORD, data) + length - 1;
-    TTBIN_RECORD *record = (TTBIN_RECORD*)malloc(max(sizeof(TTBIN_RECORD), size));
     if (ttbin->last)
     {
         record->prev = ttbin->last;
@@ -254,319 +617,1498 @@ static TTBIN_RECORD *append_record(TTBIN_FILE *ttbin, uint8_t tag, uint16_t leng
     }
     ttbin->last = record;
     record->next = 0;
+}
+
+/*****************************************************************************/
+
+static int append_array(TTBIN_FILE *ttbin, RECORD_ARRAY* array, TTBIN_RECORD *ptr)
+{
+    /* when the array is full it is moved to a block twice the size; the old
+       block stays in the arena until the file is freed, which costs at most
+       as much again as the final array */
+    if (array->count == array->capacity)
+    {
+        unsigned capacity = array->capacity ? array->capacity * 2 : 16;
+        TTBIN_RECORD **records = arena_alloc(ttbin, capacity * sizeof(TTBIN_RECORD*));
+        if (!records)
+            return 0;
+        if (array->count)
+            memcpy(records, array->records, array->count * sizeof(TTBIN_RECORD*));
+        array->records  = records;
+        array->capacity = capacity;
+    }
+    array->records[array->count++] = ptr;
+    return 1;
+}
+
+/*****************************************************************************/
+
+static void remove_array(RECORD_ARRAY *array, TTBIN_RECORD *record)
+{
+    /* search backwards, records are usually removed from the end of the file */
+    unsigned i = array->count;
+    while (i > 0)
+    {
+        if (array->records[--i] == record)
+        {
+            --array->count;
+            memmove(array->records + i, array->records + i + 1,
+                (array->count - i) * sizeof(TTBIN_RECORD*));
+            break;
+        }
+    }
+}
+
+
+struct _TTBIN_PARSER
+{
+    TTBIN_PARSER_CALLBACKS callbacks;
+    void *data;
+
+    TTBIN_FILE *ttbin;
+    int have_header;
+    int error;
+    uint16_t tag_lengths[256];  /* zero for tags not listed in the header */
+    uint32_t position;          /* offset of the next header or record */
+
+    /* only present when indexing rather than parsing */
+    TTBIN_INDEX *index;
+    uint32_t index_capacity;
+
+    int have_race_setup;        /* a race result is only valid after one */
+
+    /* a header or record that was split between calls to ttbin_parser_feed */
+    uint8_t *carry;
+    size_t carry_size;
+    size_t carry_capacity;
+
+    /* the record handed to the record callback; only records with unknown
+       tags need more space than the built-in one */
+    TTBIN_RECORD *record;
+    size_t record_capacity;
+    TTBIN_RECORD record_buffer;
+};
+
+/*****************************************************************************/
+
+/* returns the length of the header or record at the start of the data, the
+   negated number of bytes needed to find out the length if there are not
+   enough, or 0 if the data is not valid */
+static long item_length(const TTBIN_PARSER *parser, const uint8_t *data, size_t size)
+{
+    long length;
+
+    if (!parser->have_header)
+    {
+        const size_t header_size = sizeof(FILE_HEADER) - sizeof(RECORD_LENGTH);
+        uint8_t file_version;
+
+        length = 1 + sizeof(FILE_VERSION_HEADER);
+        if (size < (size_t)length)
+            return -length;
+        if (data[0] != TAG_FILE_HEADER)
+            return 0;
+
+        file_version = ((const FILE_VERSION_HEADER*)(data + 1))->file_version;
+        if (file_version <= 9)
+            length += sizeof(FIRMWARE_VERSION_HEADER_09) + header_size;
+        else if (file_version == 10)
+            length += sizeof(FIRMWARE_VERSION_HEADER_10) + header_size;
+        else
+            return 0;
+        if (size < (size_t)length)
+            return -length;
+
+        return length + ((const FILE_HEADER*)(data + length - header_size))->length_count * sizeof(RECORD_LENGTH);
+    }
+
+    if (size < 1)
+        return -1;
+    length = parser->tag_lengths[data[0]];
+    if (length == 0xffff)
+    {
+        /* variable length record, the length follows the tag */
+        if (size < 3)
+            return -3;
+        length = data[2] * 256 + data[1] + 3; // 3 to skip over tag plus length
+    }
+    return length;
+}
+
+/*****************************************************************************/
+
+static int parse_header(TTBIN_PARSER *parser, const uint8_t *data)
+{
+    TTBIN_FILE *file = parser->ttbin;
+    const FILE_HEADER *file_header;
+    unsigned i;
+
+    file->file_version = ((const FILE_VERSION_HEADER*)(data + 1))->file_version;
+    data += 1 + sizeof(FILE_VERSION_HEADER);
+
+    if (file->file_version <= 9)
+    {
+        const FIRMWARE_VERSION_HEADER_09 *firmware_version = (const FIRMWARE_VERSION_HEADER_09*)data;
+        data += sizeof(FIRMWARE_VERSION_HEADER_09);
+        memcpy(file->firmware_version, firmware_version->firmware_version, sizeof(firmware_version->firmware_version));
+    }
+    else
+    {
+        const FIRMWARE_VERSION_HEADER_10 *firmware_version = (const FIRMWARE_VERSION_HEADER_10*)data;
+        data += sizeof(FIRMWARE_VERSION_HEADER_10);
+        memcpy(file->firmware_version, firmware_version->firmware_version, sizeof(firmware_version->firmware_version));
+    }
+
+    file_header = (const FILE_HEADER*)data;
+    file->product_id      = file_header->product_id;
+    file->timestamp_local = file_header->start_time;
+    file->timestamp_utc   = file_header->start_time - file_header->local_time_offset;
+    file->utc_offset      = file_header->local_time_offset;
+
+    /* index the record lengths by tag, so the record walk doesn't have to
+       search the header for every record; a zero length marks an unknown tag */
+    for (i = 0; i < file_header->length_count; ++i)
+    {
+        if (!parser->tag_lengths[file_header->lengths[i].tag])
+            parser->tag_lengths[file_header->lengths[i].tag] = file_header->lengths[i].length;
+    }
+
+    parser->have_header = 1;
+    return !parser->callbacks.header || parser->callbacks.header(file, parser->data);
+}
+
+/*****************************************************************************/
+
+/* converts a record from the file format into the in-memory format; returns
+   0 if the record doesn't produce a TTBIN_RECORD (the summary is stored in
+   the file itself, and GPS records without a fix are dropped) */
+static int decode_record(TTBIN_FILE *file, const uint8_t *data, unsigned length, TTBIN_RECORD *record)
+{
+    const unsigned utc_offset = file->utc_offset;
+
+    record->prev   = 0;
+    record->next   = 0;
     record->length = length;
-    record->tag = tag;
+    record->tag    = data[0];
 
-    return record;
+    switch (data[0])
+    {
+    case TAG_SUMMARY: {
+        const FILE_SUMMARY_RECORD *in = (const FILE_SUMMARY_RECORD*)(data + 1);
+        file->activity       = in->activity;
+        file->total_distance = in->distance;
+        file->duration       = in->duration;
+        file->total_calories = in->calories;
+        return 0;
+    }
+    case TAG_GPS:
+        /* if the GPS signal is lost, 0xffffffff is stored in the file */
+        if (((const FILE_GPS_RECORD*)(data + 1))->timestamp == 0xffffffff)
+            return 0;
+        if (file->compact_gps)
+        {
+            const FILE_GPS_RECORD *in = (const FILE_GPS_RECORD*)(data + 1);
+            COMPACT_GPS_FIELDS(DECODE_FIELD, gps_compact)
+            record->gps_compact.elevation = NAN;
+            return 1;
+        }
+        record->gps.elevation = NAN; /* was 0.0f */
+        break;
+    }
+
+    switch (data[0])
+    {
+#define DECODE_RECORD(tag, type, r, FIELDS)                 \
+    case tag: {                                             \
+        const type *in = (const type*)(data + 1);           \
+        FIELDS(DECODE_FIELD, r)                             \
+        break;                                              \
+    }
+    RECORD_TYPES(DECODE_RECORD)
+#undef DECODE_RECORD
+    default:
+        memcpy(record->data, data + 1, length - 1);
+        break;
+    }
+    return 1;
+}
+
+/*****************************************************************************/
+
+/* returns the array that holds records with the tag, if there is one */
+static RECORD_ARRAY *record_array(TTBIN_FILE *file, uint8_t tag)
+{
+    switch (tag)
+    {
+    case TAG_STATUS:          return &file->status_records;
+    case TAG_GPS:             return &file->gps_records;
+    case TAG_HEART_RATE:      return &file->heart_rate_records;
+    case TAG_LAP:             return &file->lap_records;
+    case TAG_CYCLING_CADENCE: return &file->cycling_cadence_records;
+    case TAG_TREADMILL:       return &file->treadmill_records;
+    case TAG_SWIM:            return &file->swim_records;
+    case TAG_GOAL_PROGRESS:   return &file->goal_progress_records;
+    case TAG_INTERVAL_START:  return &file->interval_start_records;
+    case TAG_INTERVAL_FINISH: return &file->interval_finish_records;
+    case TAG_ALTITUDE_UPDATE: return &file->altitude_records;
+    case TAG_GYM:             return &file->gym_records;
+    case TAG_FITNESS_POINT:   return &file->fitness_point_records;
+    default:                  return 0;
+    }
+}
+
+/*****************************************************************************/
+
+/* adds a record to the file's lookup arrays or single record pointers,
+   returns 0 if there is no memory */
+static int track_record(TTBIN_FILE *file, TTBIN_RECORD *record)
+{
+    RECORD_ARRAY *array = record_array(file, record->tag);
+    if (array)
+        return append_array(file, array, record);
+
+    switch (record->tag)
+    {
+    case TAG_RACE_SETUP:          file->race_setup          = record; break;
+    case TAG_RACE_RESULT:         file->race_result         = record; break;
+    case TAG_TRAINING_SETUP:      file->training_setup      = record; break;
+    case TAG_INTERVAL_SETUP:      file->interval_setup      = record; break;
+    case TAG_POOL_SIZE:           file->pool_size           = record; break;
+    case TAG_WHEEL_SIZE:          file->wheel_size          = record; break;
+    case TAG_HEART_RATE_RECOVERY: file->heart_rate_recovery = record; break;
+    }
+    return 1;
+}
+
+/*****************************************************************************/
+
+/* adds a decoded record to the file's record list and lookup arrays */
+static int store_record(TTBIN_FILE *file, TTBIN_RECORD *record)
+{
+    append_record(file, record);
+    return track_record(file, record);
+}
+
+/*****************************************************************************/
+
+static int index_record(TTBIN_PARSER *parser, const uint8_t *data, unsigned length)
+{
+    TTBIN_INDEX *index = parser->index;
+    TTBIN_INDEX_ENTRY *entry;
+
+    switch (data[0])
+    {
+    case TAG_SUMMARY:
+        /* the summary belongs in the file itself, so decode it now */
+        decode_record(parser->ttbin, data, length, &parser->record_buffer);
+        return 1;
+    case TAG_GPS:
+        /* skip the same records that parse_ttbin_data drops */
+        if (((const FILE_GPS_RECORD*)(data + 1))->timestamp == 0xffffffff)
+            return 1;
+        break;
+    }
+
+    if (index->count == parser->index_capacity)
+    {
+        uint32_t capacity = parser->index_capacity ? parser->index_capacity * 2 : 1024;
+        entry = realloc(index->entries, capacity * sizeof(TTBIN_INDEX_ENTRY));
+        if (!entry)
+            return 0;
+        index->entries = entry;
+        parser->index_capacity = capacity;
+    }
+
+    entry = &index->entries[index->count++];
+    entry->offset = parser->position;
+    entry->length = length;
+    entry->tag    = data[0];
+    return 1;
+}
+
+/*****************************************************************************/
+
+static int parse_record(TTBIN_PARSER *parser, const uint8_t *data, unsigned length)
+{
+    TTBIN_RECORD *record;
+    size_t size;
+
+    /* a race result without the race setup before it makes the file invalid,
+       however it is being parsed */
+    if (data[0] == TAG_RACE_SETUP)
+        parser->have_race_setup = 1;
+    else if ((data[0] == TAG_RACE_RESULT) && !parser->have_race_setup)
+        return 0;
+
+    if (parser->index)
+        return index_record(parser, data, length);
+
+    size = record_size(parser->ttbin, data[0], length);
+
+    /* when building the whole file, decode straight into the file's arena;
+       the odd record that is dropped just leaves a small unused block */
+    if (!parser->callbacks.record)
+    {
+        record = (TTBIN_RECORD*)arena_alloc(parser->ttbin, size);
+        if (!record)
+            return 0;
+        if (decode_record(parser->ttbin, data, length, record))
+            return store_record(parser->ttbin, record);
+        return 1;
+    }
+
+    if (size > parser->record_capacity)
+    {
+        record = malloc(size);
+        if (!record)
+            return 0;
+        if (parser->record != &parser->record_buffer)
+            free(parser->record);
+        parser->record = record;
+        parser->record_capacity = size;
+    }
+
+    if (!decode_record(parser->ttbin, data, length, parser->record))
+        return 1;
+
+    return parser->callbacks.record(parser->ttbin, parser->record, parser->data);
+}
+
+/*****************************************************************************/
+
+TTBIN_PARSER *ttbin_parser_create(const TTBIN_PARSER_CALLBACKS *callbacks, void *data)
+{
+    TTBIN_PARSER *parser = calloc(1, sizeof(TTBIN_PARSER));
+    if (!parser)
+        return 0;
+
+    parser->ttbin = calloc(1, sizeof(TTBIN_FILE));
+    if (!parser->ttbin)
+    {
+        free(parser);
+        return 0;
+    }
+
+    if (callbacks)
+        parser->callbacks = *callbacks;
+    parser->data = data;
+    parser->record = &parser->record_buffer;
+    parser->record_capacity = sizeof(parser->record_buffer);
+    return parser;
+}
+
+/*****************************************************************************/
+
+static int parse_item(TTBIN_PARSER *parser, const uint8_t *data, unsigned length)
+{
+    int result;
+    if (!parser->have_header)
+        result = parse_header(parser, data);
+    else
+        result = parse_record(parser, data, length);
+    parser->position += length;
+    return result;
+}
+
+int ttbin_parser_feed(TTBIN_PARSER *parser, const uint8_t *data, size_t size)
+{
+    long length;
+
+    if (parser->error)
+        return 0;
+
+    /* first complete the item left over from the previous call, only taking
+       as much data as is needed to find its length and then to finish it */
+    while (parser->carry_size && size)
+    {
+        size_t needed;
+
+        length = item_length(parser, parser->carry, parser->carry_size);
+        if (!length)
+            return parser->error = 1, 0;
+
+        needed = labs(length) - parser->carry_size;
+        if (needed > size)
+            needed = size;
+        memcpy(parser->carry + parser->carry_size, data, needed);
+        parser->carry_size += needed;
+        data += needed;
+        size -= needed;
+
+        length = item_length(parser, parser->carry, parser->carry_size);
+        if (!length)
+            return parser->error = 1, 0;
+        if ((size_t)length == parser->carry_size)
+        {
+            parser->carry_size = 0;
+            if (!parse_item(parser, parser->carry, length))
+                return parser->error = 1, 0;
+        }
+        else if ((size_t)labs(length) > parser->carry_capacity)
+        {
+            uint8_t *carry = realloc(parser->carry, labs(length));
+            if (!carry)
+                return parser->error = 1, 0;
+            parser->carry = carry;
+            parser->carry_capacity = labs(length);
+        }
+    }
+
+    /* then parse whole items straight out of the caller's buffer */
+    while (size)
+    {
+        length = item_length(parser, data, size);
+        if (!length)
+            return parser->error = 1, 0;
+        if ((length < 0) || ((size_t)length > size))
+            break;
+
+        if (!parse_item(parser, data, length))
+            return parser->error = 1, 0;
+        data += length;
+        size -= length;
+    }
+
+    /* and keep whatever is left until more data arrives */
+    if (size)
+    {
+        size_t capacity = max(size, (size_t)labs(length));
+        if (capacity > parser->carry_capacity)
+        {
+            uint8_t *carry = realloc(parser->carry, capacity);
+            if (!carry)
+                return parser->error = 1, 0;
+            parser->carry = carry;
+            parser->carry_capacity = capacity;
+        }
+        memcpy(parser->carry, data, size);
+        parser->carry_size = size;
+    }
+    return 1;
+}
+
+/*****************************************************************************/
+
+TTBIN_FILE *ttbin_parser_finish(TTBIN_PARSER *parser)
+{
+    TTBIN_FILE *ttbin = parser->ttbin;
+
+    /* an incomplete record at the end of the data is ignored */
+    if (parser->error || !parser->have_header)
+    {
+        free_ttbin(ttbin);
+        ttbin = 0;
+    }
+
+    if (parser->record != &parser->record_buffer)
+        free(parser->record);
+    free(parser->carry);
+    free(parser);
+    return ttbin;
+}
+
+/*****************************************************************************/
+
+/* sizes the record arrays and the arena for the records that follow the
+   header, by walking the tags without decoding anything */
+static void reserve_records(TTBIN_PARSER *parser, const uint8_t *data, size_t size)
+{
+    TTBIN_FILE *file = parser->ttbin;
+    unsigned counts[256] = {0};
+    size_t bytes = 0;
+    long length;
+    unsigned i;
+
+    while (size)
+    {
+        length = item_length(parser, data, size);
+        if ((length <= 0) || ((size_t)length > size))
+            break;
+        ++counts[data[0]];
+        bytes += SLAB_ALIGN(record_size(file, data[0], length));
+        data += length;
+        size -= length;
+    }
+
+    for (i = 0; i < 256; ++i)
+    {
+        RECORD_ARRAY *array = record_array(file, i);
+        if (array && counts[i])
+            bytes += SLAB_ALIGN(counts[i] * sizeof(TTBIN_RECORD*));
+    }
+    if (!bytes || !arena_reserve(file, bytes))
+        return;
+
+    for (i = 0; i < 256; ++i)
+    {
+        RECORD_ARRAY *array = record_array(file, i);
+        if (array && counts[i])
+        {
+            array->records  = arena_alloc(file, counts[i] * sizeof(TTBIN_RECORD*));
+            array->capacity = array->records ? counts[i] : 0;
+        }
+    }
+}
+
+/*****************************************************************************/
+
+TTBIN_FILE *parse_ttbin_data(const uint8_t *data, uint32_t size)
+{
+    return parse_ttbin_data_ex(data, size, 0);
+}
+
+/*****************************************************************************/
+
+TTBIN_FILE *parse_ttbin_data_ex(const uint8_t *data, uint32_t size, uint32_t flags)
+{
+    TTBIN_PARSER *parser;
+    TTBIN_FILE *file;
+    long length;
+
+    parser = ttbin_parser_create(0, 0);
+    if (!parser)
+        return 0;
+    parser->ttbin->compact_gps = !!(flags & TTBIN_PARSE_COMPACT_GPS);
+
+    /* all the data is here, so count the records before building anything */
+    length = item_length(parser, data, size);
+    if ((length > 0) && ((size_t)length <= size) && ttbin_parser_feed(parser, data, length))
+    {
+        reserve_records(parser, data + length, size - length);
+        data += length;
+        size -= length;
+    }
+
+    ttbin_parser_feed(parser, data, size);
+    file = ttbin_parser_finish(parser);
+
+    if (file && (flags & TTBIN_PARSE_COLUMNS) && !build_ttbin_columns(file))
+    {
+        free_ttbin(file);
+        return 0;
+    }
+
+    return file;
+}
+
+/*****************************************************************************/
+
+TTBIN_INDEX *index_ttbin_data(const uint8_t *data, uint32_t size)
+{
+    TTBIN_PARSER *parser;
+    TTBIN_INDEX *index;
+
+    index = calloc(1, sizeof(TTBIN_INDEX));
+    if (!index)
+        return 0;
+
+    parser = ttbin_parser_create(0, 0);
+    if (!parser)
+    {
+        free(index);
+        return 0;
+    }
+    parser->index = index;
+
+    ttbin_parser_feed(parser, data, size);
+    index->ttbin = ttbin_parser_finish(parser);
+    if (!index->ttbin)
+    {
+        free_ttbin_index(index);
+        return 0;
+    }
+
+    index->data = data;
+    index->size = size;
+    index->records = calloc(index->count ? index->count : 1, sizeof(TTBIN_RECORD*));
+    if (!index->records)
+    {
+        free_ttbin_index(index);
+        return 0;
+    }
+    return index;
+}
+
+/*****************************************************************************/
+
+TTBIN_INDEX *index_ttbin_path(const char *filename)
+{
+    TTBIN_INDEX *index;
+    struct stat st;
+    void *data;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    if ((fstat(fd, &st) < 0) || !S_ISREG(st.st_mode) || (st.st_size == 0) || (st.st_size > UINT32_MAX))
+    {
+        close(fd);
+        return 0;
+    }
+
+    data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return 0;
+
+    index = index_ttbin_data(data, st.st_size);
+    if (!index)
+    {
+        munmap(data, st.st_size);
+        return 0;
+    }
+    index->mapping = data;
+    return index;
+}
+
+/*****************************************************************************/
+
+const TTBIN_RECORD *ttbin_index_record(TTBIN_INDEX *index, uint32_t i)
+{
+    const TTBIN_INDEX_ENTRY *entry;
+    TTBIN_RECORD *record;
+
+    if (i >= index->count)
+        return 0;
+    if (index->records[i])
+        return index->records[i];
+
+    entry = &index->entries[i];
+    record = (TTBIN_RECORD*)arena_alloc(index->ttbin, record_size(index->ttbin, entry->tag, entry->length));
+    if (!record)
+        return 0;
+    decode_record(index->ttbin, index->data + entry->offset, entry->length, record);
+    index->records[i] = record;
+    return record;
+}
+
+/*****************************************************************************/
+
+uint32_t ttbin_index_find(const TTBIN_INDEX *index, uint8_t tag, uint32_t start)
+{
+    while ((start < index->count) && (index->entries[start].tag != tag))
+        ++start;
+    return start;
+}
+
+/*****************************************************************************/
+
+void free_ttbin_index(TTBIN_INDEX *index)
+{
+    if (!index)
+        return;
+    /* the decoded records live in the file's arena */
+    free_ttbin(index->ttbin);
+    free(index->records);
+    free(index->entries);
+    if (index->mapping)
+        munmap(index->mapping, index->size);
+    free(index);
+}
+
+/*****************************************************************************/
+
+/* hands out consecutive, suitably aligned pieces of the columns block */
+#define CARVE_COLUMN(ptr, column, count) \
+    do { (column) = (void*)(ptr); (ptr) += SLAB_ALIGN((count) * sizeof(*(column))); } while (0)
+
+int build_ttbin_columns(TTBIN_FILE *ttbin)
+{
+    unsigned gps_count = ttbin->gps_records.count;
+    unsigned hr_count  = ttbin->heart_rate_records.count;
+    TTBIN_COLUMNS *columns;
+    GPS_COLUMNS *gps;
+    HEART_RATE_COLUMNS *hr;
+    TTBIN_RECORD *record;
+    const GPS_RECORD *g;
+    GPS_RECORD expanded;
+    uint8_t heart_rate = 0;
+    unsigned i = 0, j = 0;
+    size_t size;
+    uint8_t *ptr;
+
+    free_ttbin_columns(ttbin);
+
+    size = SLAB_ALIGN(sizeof(TTBIN_COLUMNS))
+        + 2 * SLAB_ALIGN(gps_count * sizeof(double))
+        + SLAB_ALIGN(gps_count * sizeof(time_t))
+        + 4 * SLAB_ALIGN(gps_count * sizeof(float))
+        + 2 * SLAB_ALIGN(gps_count * sizeof(uint16_t))
+        + 2 * SLAB_ALIGN(gps_count * sizeof(uint8_t))
+        + SLAB_ALIGN(hr_count * sizeof(time_t))
+        + SLAB_ALIGN(hr_count * sizeof(uint8_t));
+    columns = malloc(size);
+    if (!columns)
+        return 0;
+
+    gps = &columns->gps;
+    hr  = &columns->heart_rate;
+    ptr = (uint8_t*)columns + SLAB_ALIGN(sizeof(TTBIN_COLUMNS));
+    CARVE_COLUMN(ptr, gps->latitude,      gps_count);
+    CARVE_COLUMN(ptr, gps->longitude,     gps_count);
+    CARVE_COLUMN(ptr, gps->timestamp,     gps_count);
+    CARVE_COLUMN(ptr, gps->elevation,     gps_count);
+    CARVE_COLUMN(ptr, gps->heading,       gps_count);
+    CARVE_COLUMN(ptr, gps->instant_speed, gps_count);
+    CARVE_COLUMN(ptr, gps->cum_distance,  gps_count);
+    CARVE_COLUMN(ptr, gps->gps_speed,     gps_count);
+    CARVE_COLUMN(ptr, gps->calories,      gps_count);
+    CARVE_COLUMN(ptr, gps->cycles,        gps_count);
+    CARVE_COLUMN(ptr, gps->heart_rate,    gps_count);
+    CARVE_COLUMN(ptr, hr->timestamp,      hr_count);
+    CARVE_COLUMN(ptr, hr->heart_rate,     hr_count);
+
+    /* walk the list rather than the arrays so that each GPS point can be
+       paired with the heart rate recorded since the previous one */
+    for (record = ttbin->first; record; record = record->next)
+    {
+        if ((record->tag == TAG_GPS) && (i < gps_count))
+        {
+            g = &record->gps;
+            if (ttbin->compact_gps)
+            {
+                ttbin_gps_get(ttbin, record, &expanded);
+                g = &expanded;
+            }
+            gps->latitude[i]      = g->latitude;
+            gps->longitude[i]     = g->longitude;
+            gps->timestamp[i]     = g->timestamp;
+            gps->elevation[i]     = g->elevation;
+            gps->heading[i]       = g->heading;
+            gps->instant_speed[i] = g->instant_speed;
+            gps->cum_distance[i]  = g->cum_distance;
+            gps->gps_speed[i]     = g->gps_speed;
+            gps->calories[i]      = g->calories;
+            gps->cycles[i]        = g->cycles;
+            gps->heart_rate[i]    = heart_rate;
+            heart_rate = 0;
+            ++i;
+        }
+        else if ((record->tag == TAG_HEART_RATE) && (j < hr_count))
+        {
+            hr->timestamp[j]  = record->heart_rate.timestamp;
+            hr->heart_rate[j] = record->heart_rate.heart_rate;
+            heart_rate = record->heart_rate.heart_rate;
+            ++j;
+        }
+    }
+    gps->count = i;
+    hr->count  = j;
+
+    ttbin->columns = columns;
+    return 1;
+}
+
+/*****************************************************************************/
+
+void free_ttbin_columns(TTBIN_FILE *ttbin)
+{
+    free(ttbin->columns);
+    ttbin->columns = 0;
+}
+
+/*****************************************************************************/
+
+#define EXPAND_FIELD(r, file_field, field, codec)   DECODE_##codec(gps->field, in->file_field);
+
+void ttbin_gps_get(const TTBIN_FILE *ttbin, const TTBIN_RECORD *record, GPS_RECORD *gps)
+{
+    const COMPACT_GPS_RECORD *in = &record->gps_compact;
+
+    if (!ttbin->compact_gps)
+    {
+        *gps = record->gps;
+        return;
+    }
+
+    /* the same conversions as decoding the file record */
+    GPS_FIELDS(EXPAND_FIELD, gps)
+    gps->elevation = in->elevation;
+}
+
+#undef EXPAND_FIELD
+
+/*****************************************************************************/
+
+double ttbin_gps_latitude(const TTBIN_FILE *ttbin, const TTBIN_RECORD *record)
+{
+    return ttbin->compact_gps ? record->gps_compact.latitude / 1e7 : record->gps.latitude;
+}
+
+/*****************************************************************************/
+
+double ttbin_gps_longitude(const TTBIN_FILE *ttbin, const TTBIN_RECORD *record)
+{
+    return ttbin->compact_gps ? record->gps_compact.longitude / 1e7 : record->gps.longitude;
+}
+
+/*****************************************************************************/
+
+time_t ttbin_gps_timestamp(const TTBIN_FILE *ttbin, const TTBIN_RECORD *record)
+{
+    return ttbin->compact_gps ? record->gps_compact.timestamp : record->gps.timestamp;
+}
+
+/*****************************************************************************/
+
+float ttbin_gps_cum_distance(const TTBIN_FILE *ttbin, const TTBIN_RECORD *record)
+{
+    return ttbin->compact_gps ? record->gps_compact.cum_distance : record->gps.cum_distance;
+}
+
+/*****************************************************************************/
+
+/* the streams with timestamps, in the order they are kept in the index */
+static const uint8_t TIME_STREAM_TAGS[] = {
+    TAG_GPS, TAG_HEART_RATE, TAG_STATUS, TAG_TREADMILL, TAG_SWIM, TAG_GYM, TAG_FITNESS_POINT
+};
+
+#define TIME_STREAM_COUNT   (sizeof(TIME_STREAM_TAGS) / sizeof(TIME_STREAM_TAGS[0]))
+
+typedef struct
+{
+    unsigned count;
+    time_t *timestamp;          /* sorted */
+    TTBIN_RECORD **records;     /* in the same order */
+} TIME_STREAM;
+
+struct _TTBIN_TIME_INDEX
+{
+    TIME_STREAM streams[TIME_STREAM_COUNT];
+};
+
+typedef struct
+{
+    time_t timestamp;
+    unsigned position;
+} TIME_SORT_ENTRY;
+
+/*****************************************************************************/
+
+static time_t record_timestamp(const TTBIN_FILE *ttbin, const TTBIN_RECORD *record)
+{
+    switch (record->tag)
+    {
+    case TAG_GPS:           return ttbin_gps_timestamp(ttbin, record);
+    case TAG_HEART_RATE:    return record->heart_rate.timestamp;
+    case TAG_STATUS:        return record->status.timestamp;
+    case TAG_TREADMILL:     return record->treadmill.timestamp;
+    case TAG_SWIM:          return record->swim.timestamp;
+    case TAG_GYM:           return record->gym.timestamp;
+    case TAG_FITNESS_POINT: return record->fitness_point.timestamp;
+    default:                return 0;
+    }
+}
+
+/*****************************************************************************/
+
+static int compare_time_sort_entries(const void *a, const void *b)
+{
+    const TIME_SORT_ENTRY *x = (const TIME_SORT_ENTRY*)a;
+    const TIME_SORT_ENTRY *y = (const TIME_SORT_ENTRY*)b;
+    if (x->timestamp != y->timestamp)
+        return (x->timestamp < y->timestamp) ? -1 : 1;
+    return (x->position < y->position) ? -1 : (x->position > y->position);
+}
+
+/*****************************************************************************/
+
+/* puts a stream into time order, keeping records with the same time in
+   file order; the watch writes them in order, so this is rarely needed */
+static int sort_time_stream(TIME_STREAM *stream)
+{
+    TIME_SORT_ENTRY *entries;
+    TTBIN_RECORD **records;
+    unsigned i;
+
+    for (i = 1; i < stream->count; ++i)
+    {
+        if (stream->timestamp[i] < stream->timestamp[i - 1])
+            break;
+    }
+    if (i >= stream->count)
+        return 1;
+
+    entries = malloc(stream->count * (sizeof(TIME_SORT_ENTRY) + sizeof(TTBIN_RECORD*)));
+    if (!entries)
+        return 0;
+    records = (TTBIN_RECORD**)(entries + stream->count);
+
+    for (i = 0; i < stream->count; ++i)
+    {
+        entries[i].timestamp = stream->timestamp[i];
+        entries[i].position  = i;
+        records[i] = stream->records[i];
+    }
+    qsort(entries, stream->count, sizeof(TIME_SORT_ENTRY), compare_time_sort_entries);
+    for (i = 0; i < stream->count; ++i)
+    {
+        stream->timestamp[i] = entries[i].timestamp;
+        stream->records[i]   = records[entries[i].position];
+    }
+
+    free(entries);
+    return 1;
+}
+
+/*****************************************************************************/
+
+int build_ttbin_time_index(TTBIN_FILE *ttbin)
+{
+    TTBIN_TIME_INDEX *index;
+    size_t size;
+    uint8_t *ptr;
+    unsigned i, j;
+
+    free_ttbin_time_index(ttbin);
+
+    size = SLAB_ALIGN(sizeof(TTBIN_TIME_INDEX));
+    for (i = 0; i < TIME_STREAM_COUNT; ++i)
+    {
+        unsigned count = record_array(ttbin, TIME_STREAM_TAGS[i])->count;
+        size += SLAB_ALIGN(count * sizeof(time_t)) + SLAB_ALIGN(count * sizeof(TTBIN_RECORD*));
+    }
+    index = malloc(size);
+    if (!index)
+        return 0;
+
+    ptr = (uint8_t*)index + SLAB_ALIGN(sizeof(TTBIN_TIME_INDEX));
+    for (i = 0; i < TIME_STREAM_COUNT; ++i)
+    {
+        const RECORD_ARRAY *array = record_array(ttbin, TIME_STREAM_TAGS[i]);
+        TIME_STREAM *stream = &index->streams[i];
+
+        stream->count = array->count;
+        CARVE_COLUMN(ptr, stream->timestamp, array->count);
+        CARVE_COLUMN(ptr, stream->records,   array->count);
+        for (j = 0; j < array->count; ++j)
+        {
+            stream->records[j]   = array->records[j];
+            stream->timestamp[j] = record_timestamp(ttbin, array->records[j]);
+        }
+
+        if (!sort_time_stream(stream))
+        {
+            free(index);
+            return 0;
+        }
+    }
+
+    ttbin->time_index = index;
+    return 1;
+}
+
+/*****************************************************************************/
+
+void free_ttbin_time_index(TTBIN_FILE *ttbin)
+{
+    free(ttbin->time_index);
+    ttbin->time_index = 0;
+}
+
+/*****************************************************************************/
+
+/* returns the indexed stream for the tag, building the index if need be */
+static const TIME_STREAM *time_stream(TTBIN_FILE *ttbin, uint8_t tag)
+{
+    unsigned i;
+
+    for (i = 0; i < TIME_STREAM_COUNT; ++i)
+    {
+        if (TIME_STREAM_TAGS[i] == tag)
+            break;
+    }
+    if (i >= TIME_STREAM_COUNT)
+        return 0;
+
+    if (!ttbin->time_index && !build_ttbin_time_index(ttbin))
+        return 0;
+    return &ttbin->time_index->streams[i];
+}
+
+/*****************************************************************************/
+
+/* returns the position of the first timestamp after t (upper = 1) or at or
+   after t (upper = 0) */
+static unsigned search_time_stream(const TIME_STREAM *stream, time_t t, int upper)
+{
+    unsigned low = 0, high = stream->count;
+    while (low < high)
+    {
+        unsigned mid = low + (high - low) / 2;
+        if ((stream->timestamp[mid] < t) || (upper && (stream->timestamp[mid] == t)))
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+/*****************************************************************************/
+
+const TTBIN_RECORD *ttbin_value_at(TTBIN_FILE *ttbin, uint8_t tag, time_t t)
+{
+    const TIME_STREAM *stream = time_stream(ttbin, tag);
+    unsigned i;
+
+    if (!stream)
+        return 0;
+
+    i = search_time_stream(stream, t, 1);
+    return i ? stream->records[i - 1] : 0;
+}
+
+/*****************************************************************************/
+
+unsigned ttbin_range(TTBIN_FILE *ttbin, uint8_t tag, time_t t0, time_t t1, TTBIN_RECORD *const **records)
+{
+    const TIME_STREAM *stream = time_stream(ttbin, tag);
+    unsigned first, last;
+
+    *records = 0;
+    if (!stream || (t1 <= t0))
+        return 0;
+
+    first = search_time_stream(stream, t0, 0);
+    last  = search_time_stream(stream, t1, 0);
+    *records = stream->records + first;
+    return last - first;
+}
+
+/*****************************************************************************/
+
+/* returns 1 if the record is a position the timeline should have a sample for */
+static int is_timeline_record(const TTBIN_FILE *ttbin, const TTBIN_RECORD *record)
+{
+    switch (record->tag)
+    {
+    case TAG_GPS:
+        /* this will happen if the activity is paused and then resumed, or if the GPS signal is lost */
+        return (ttbin_gps_timestamp(ttbin, record) != 0)
+            && ((ttbin_gps_latitude(ttbin, record) != 0) || (ttbin_gps_longitude(ttbin, record) != 0));
+    case TAG_TREADMILL:         return record->treadmill.timestamp != 0;
+    case TAG_SWIM:              return record->swim.timestamp != 0;
+    case TAG_GYM:               return record->gym.timestamp != 0;
+    case TAG_INDOOR_CYCLING:    return record->indoor_cycling.timestamp != 0;
+    default:                    return 0;
+    }
+}
+
+/*****************************************************************************/
+
+struct _TTBIN_SAMPLER
+{
+    CyclingCadenceData cc_data;
+    uint8_t heart_rate;
+    uint8_t last_heart_rate;
+    unsigned lap;
+    double distance;
+    double distance_factor;
+};
+
+static void init_sampler(TTBIN_SAMPLER *sampler, double distance_factor)
+{
+    sampler->cc_data         = cc_initialize();
+    sampler->heart_rate      = 0;
+    sampler->last_heart_rate = 0;
+    sampler->lap             = 0;
+    sampler->distance        = 0;
+    sampler->distance_factor = distance_factor;
+}
+
+/*****************************************************************************/
+
+TTBIN_SAMPLER *ttbin_sampler_create(double distance_factor)
+{
+    TTBIN_SAMPLER *sampler = malloc(sizeof(TTBIN_SAMPLER));
+    if (sampler)
+        init_sampler(sampler, distance_factor);
+    return sampler;
+}
+
+/*****************************************************************************/
+
+int ttbin_sampler_add(TTBIN_SAMPLER *sampler, const TTBIN_FILE *ttbin, TTBIN_RECORD *record, TTBIN_SAMPLE *sample)
+{
+    GPS_RECORD gps;
+
+    switch (record->tag)
+    {
+    case TAG_HEART_RATE:
+        sampler->heart_rate = sampler->last_heart_rate = record->heart_rate.heart_rate;
+        return 0;
+    case TAG_WHEEL_SIZE:
+        cc_set_wheel_size(&sampler->cc_data, &record->wheel_size);
+        return 0;
+    case TAG_CYCLING_CADENCE:
+        cc_sensor_packet(&sampler->cc_data, &record->cycling_cadence);
+        return 0;
+    case TAG_LAP:
+        ++sampler->lap;
+        return 0;
+    }
+
+    if (!is_timeline_record(ttbin, record))
+        return 0;
+
+    sample->record    = record;
+    sample->latitude  = 0;
+    sample->longitude = 0;
+    sample->elevation = NAN;
+    sample->speed     = 0;
+    sample->calories  = 0;
+    sample->cycles    = 0;
+    switch (record->tag)
+    {
+    case TAG_GPS:
+        ttbin_gps_get(ttbin, record, &gps);
+        sample->timestamp = gps.timestamp;
+        sample->latitude  = gps.latitude;
+        sample->longitude = gps.longitude;
+        sample->elevation = gps.elevation;
+        sample->speed     = gps.instant_speed;
+        sample->calories  = gps.calories;
+        sample->cycles    = gps.cycles;
+        sampler->distance = gps.cum_distance;
+        break;
+    case TAG_TREADMILL:
+        sample->timestamp = record->treadmill.timestamp;
+        sampler->distance = record->treadmill.distance * sampler->distance_factor;
+        break;
+    case TAG_SWIM:
+        sample->timestamp = record->swim.timestamp;
+        sampler->distance = record->swim.total_distance;
+        break;
+    case TAG_GYM:
+        /* gym records have no distance, so the last one carries over */
+        sample->timestamp = record->gym.timestamp;
+        break;
+    case TAG_INDOOR_CYCLING:
+        sample->timestamp = record->indoor_cycling.timestamp;
+        sampler->distance = record->indoor_cycling.distance_meters;
+        break;
+    }
+    sample->distance          = sampler->distance;
+    sample->heart_rate        = sampler->heart_rate;
+    sample->last_heart_rate   = sampler->last_heart_rate;
+    sample->cadence_available = sampler->cc_data.cadence_available;
+    sample->cycling_cadence   = sampler->cc_data.cycling_cadence;
+    sample->wheel_speed       = sampler->cc_data.wheel_speed;
+    sample->lap               = sampler->lap;
+
+    /* the cadence values expire if the sensor stops reporting */
+    cc_gps_packet_tick(&sampler->cc_data);
+    sampler->heart_rate = 0;
+    return 1;
+}
+
+/*****************************************************************************/
+
+void ttbin_sampler_free(TTBIN_SAMPLER *sampler)
+{
+    free(sampler);
+}
+
+/*****************************************************************************/
+
+int build_ttbin_timeline(TTBIN_FILE *ttbin)
+{
+    TTBIN_TIMELINE *timeline;
+    TTBIN_SAMPLE *sample;
+    TTBIN_RECORD *record;
+    TTBIN_SAMPLER sampler;
+    unsigned count = 0;
+
+    free_ttbin_timeline(ttbin);
+
+    for (record = ttbin->first; record; record = record->next)
+        count += is_timeline_record(ttbin, record);
+
+    timeline = malloc(SLAB_ALIGN(sizeof(TTBIN_TIMELINE)) + count * sizeof(TTBIN_SAMPLE));
+    if (!timeline)
+        return 0;
+    timeline->samples = (TTBIN_SAMPLE*)((uint8_t*)timeline + SLAB_ALIGN(sizeof(TTBIN_TIMELINE)));
+    timeline->count = count;
+
+    /* the treadmill distances are only estimates, scale them so that the
+       last one matches the summary */
+    timeline->distance_factor = 1;
+    if (ttbin->activity == ACTIVITY_TREADMILL)
+    {
+        for (record = ttbin->last; record; record = record->prev)
+        {
+            if ((record->tag == TAG_TREADMILL) && record->treadmill.distance)
+            {
+                timeline->distance_factor = ttbin->total_distance / record->treadmill.distance;
+                break;
+            }
+        }
+    }
+
+    init_sampler(&sampler, timeline->distance_factor);
+    sample = timeline->samples;
+    for (record = ttbin->first; record; record = record->next)
+        sample += ttbin_sampler_add(&sampler, ttbin, record, sample);
+
+    ttbin->timeline = timeline;
+    return 1;
+}
+
+/*****************************************************************************/
+
+void free_ttbin_timeline(TTBIN_FILE *ttbin)
+{
+    free(ttbin->timeline);
+    ttbin->timeline = 0;
+}
+
+/*****************************************************************************/
+
+const TTBIN_TIMELINE *ttbin_timeline(TTBIN_FILE *ttbin)
+{
+    if (!ttbin->timeline && !build_ttbin_timeline(ttbin))
+        return 0;
+    return ttbin->timeline;
+}
+
+/*****************************************************************************/
+
+struct _TTBIN_LAP_BUILDER
+{
+    double distance_factor;
+    uint8_t trigger;
+    uint8_t resting;
+
+    /* the totals when the current lap started */
+    uint32_t start_time;
+    float start_distance;
+    uint32_t start_calories;
+
+    /* accumulated over the current lap */
+    uint32_t move_count;
+    float total_speed;
+    float max_speed;
+    uint32_t heart_rate_count;
+    uint32_t total_heart_rate;
+    uint32_t max_heart_rate;
+    uint32_t steps;
+    uint32_t steps_prev;
+};
+
+static void init_lap_builder(TTBIN_LAP_BUILDER *builder, double distance_factor)
+{
+    memset(builder, 0, sizeof(TTBIN_LAP_BUILDER));
+    builder->distance_factor = distance_factor;
+    builder->trigger = TTBIN_LAP_TRIGGER_MANUAL;
+}
+
+/*****************************************************************************/
+
+/* fills in the lap that ends with the given totals, and starts the next one */
+static void end_lap(TTBIN_LAP_BUILDER *builder, const TTBIN_FILE *ttbin, uint8_t tag,
+    uint32_t total_time, float total_distance, uint32_t total_calories, TTBIN_LAP_SUMMARY *lap)
+{
+    lap->end_tag        = tag;
+    lap->trigger        = builder->trigger;
+    lap->resting        = builder->resting;
+    lap->total_time     = total_time;
+    lap->total_distance = total_distance;
+    lap->total_calories = total_calories;
+
+    lap->time = total_time - builder->start_time;
+    /* the treadmill's own distances are estimates, the summary's is the real one */
+    if ((ttbin->activity == ACTIVITY_TREADMILL) && ((tag == TAG_LAP) || (tag == TAG_INTERVAL_FINISH)))
+        lap->distance = builder->distance_factor * (double)(total_distance - builder->start_distance);
+    else
+        lap->distance = total_distance - builder->start_distance;
+    lap->calories = total_calories - builder->start_calories;
+
+    /* the treadmill doesn't record its speed */
+    if (ttbin->activity == ACTIVITY_TREADMILL)
+        lap->avg_speed = lap->distance / builder->move_count;
+    else
+        lap->avg_speed = builder->total_speed / builder->move_count;
+    lap->max_speed = builder->max_speed;
+    if (builder->heart_rate_count > 0)
+        lap->avg_heart_rate = (builder->total_heart_rate + (builder->heart_rate_count >> 1)) / builder->heart_rate_count;
+    else
+        lap->avg_heart_rate = 0;
+    lap->max_heart_rate = builder->max_heart_rate;
+    lap->steps = builder->steps;
+
+    builder->start_time       = total_time;
+    builder->start_distance   = total_distance;
+    builder->start_calories   = total_calories;
+    builder->move_count       = 0;
+    builder->total_speed      = 0;
+    builder->max_speed        = 0;
+    builder->heart_rate_count = 0;
+    builder->total_heart_rate = 0;
+    builder->max_heart_rate   = 0;
+    builder->steps            = 0;
+}
+
+/*****************************************************************************/
+
+TTBIN_LAP_BUILDER *ttbin_lap_builder_create(double distance_factor)
+{
+    TTBIN_LAP_BUILDER *builder = malloc(sizeof(TTBIN_LAP_BUILDER));
+    if (builder)
+        init_lap_builder(builder, distance_factor);
+    return builder;
+}
+
+/*****************************************************************************/
+
+int ttbin_lap_builder_add(TTBIN_LAP_BUILDER *builder, const TTBIN_FILE *ttbin,
+    const TTBIN_RECORD *record, const TTBIN_SAMPLE *sample, TTBIN_LAP_SUMMARY *lap)
+{
+    switch (record->tag)
+    {
+    case TAG_TRAINING_SETUP:
+        switch (record->training_setup.type)
+        {
+        case TRAINING_LAPS_TIME:     builder->trigger = TTBIN_LAP_TRIGGER_TIME;     break;
+        case TRAINING_LAPS_DISTANCE: builder->trigger = TTBIN_LAP_TRIGGER_DISTANCE; break;
+        }
+        return 0;
+    case TAG_HEART_RATE:
+        if (record->heart_rate.heart_rate > builder->max_heart_rate)
+            builder->max_heart_rate = record->heart_rate.heart_rate;
+        builder->total_heart_rate += record->heart_rate.heart_rate;
+        ++builder->heart_rate_count;
+        return 0;
+    case TAG_LAP:
+        end_lap(builder, ttbin, TAG_LAP, record->lap.total_time,
+            record->lap.total_distance, record->lap.total_calories, lap);
+        return 1;
+    case TAG_INTERVAL_FINISH:
+        builder->resting = (record->interval_finish.type != TTBIN_INTERVAL_TYPE_WORK);
+        end_lap(builder, ttbin, TAG_INTERVAL_FINISH, record->interval_finish.total_time,
+            record->interval_finish.total_distance, record->interval_finish.total_calories, lap);
+        return 1;
+    }
+
+    /* only the samples count towards the lap */
+    if (!sample)
+        return 0;
+
+    switch (record->tag)
+    {
+    case TAG_GPS:
+        if (sample->speed > builder->max_speed)
+            builder->max_speed = sample->speed;
+        builder->total_speed += sample->speed;
+        if (ttbin->activity == ACTIVITY_RUNNING)
+            builder->steps += ttbin->compact_gps ? record->gps_compact.cycles : record->gps.cycles;
+        break;
+    case TAG_TREADMILL:
+        builder->steps += record->treadmill.steps - builder->steps_prev;
+        builder->steps_prev = record->treadmill.steps;
+        break;
+    case TAG_GYM:
+        builder->steps += record->gym.total_cycles - builder->steps_prev;
+        builder->steps_prev = record->gym.total_cycles;
+        break;
+    case TAG_SWIM:
+        builder->steps += record->swim.strokes;
+        break;
+    }
+    ++builder->move_count;
+
+    /* every length of the pool is a lap */
+    if ((record->tag == TAG_SWIM) && (builder->start_distance < sample->distance))
+    {
+        builder->trigger = TTBIN_LAP_TRIGGER_DISTANCE;
+        end_lap(builder, ttbin, TAG_SWIM, (uint32_t)(sample->timestamp - ttbin->timestamp_utc),
+            record->swim.total_distance, record->swim.total_calories, lap);
+        return 1;
+    }
+    return 0;
 }
 
 /*****************************************************************************/
 
-static void append_array(RECORD_ARRAY* array, TTBIN_RECORD *ptr)
+int ttbin_lap_builder_finish(TTBIN_LAP_BUILDER *builder, const TTBIN_FILE *ttbin, TTBIN_LAP_SUMMARY *lap)
 {
-    array->records = realloc(array->records, (array->count + 1) * sizeof(TTBIN_RECORD*));
-    array->records[array->count++] = ptr;
+    int moved = (builder->move_count > 0);
+    end_lap(builder, ttbin, 0, ttbin->duration, ttbin->total_distance, ttbin->total_calories, lap);
+    return moved;
 }
 
 /*****************************************************************************/
 
-static void remove_array(RECORD_ARRAY *array, TTBIN_RECORD *record)
+void ttbin_lap_builder_free(TTBIN_LAP_BUILDER *builder)
 {
-    unsigned i;
-    for (i = 0; i < array->count; ++i)
-    {
-        if (array->records[i] == record)
-        {
-            --array->count;
-            if (i != array->count)
-                memmove(array->records + i, array->records + i + 1, sizeof(TTBIN_RECORD*));
-            break;
-        }
-    }
+    free(builder);
 }
 
+/*****************************************************************************/
 
-TTBIN_FILE *parse_ttbin_data(const uint8_t *data, uint32_t size)
+int build_ttbin_laps(TTBIN_FILE *ttbin)
 {
-    const uint8_t *const end = data + size;
-    TTBIN_FILE *file;
-    unsigned length;
-
-    const FILE_VERSION_HEADER *file_version = 0;
-    const FILE_HEADER *file_header = 0;
-    union
-    {
-        const uint8_t *data;
-        struct
-        {
-            uint8_t tag;
-            union
-            {
-                FILE_SUMMARY_RECORD             summary;
-                FILE_GPS_RECORD                 gps;
-                FILE_HEART_RATE_RECORD          heart_rate;
-                FILE_STATUS_RECORD              status;
-                FILE_TREADMILL_RECORD           treadmill;
-                FILE_SWIM_RECORD                swim;
-                FILE_GYM_RECORD                 gym;
-                FILE_FITNESS_POINT_RECORD       fitness_point;
-                FILE_LAP_RECORD                 lap;
-                FILE_RACE_SETUP_RECORD          race_setup;
-                FILE_RACE_RESULT_RECORD         race_result;
-                FILE_TRAINING_SETUP_RECORD      training_setup;
-                FILE_GOAL_PROGRESS_RECORD       goal_progress;
-                FILE_INTERVAL_SETUP_RECORD      interval_setup;
-                FILE_INTERVAL_START_RECORD      interval_start;
-                FILE_INTERVAL_FINISH_RECORD     interval_finish;
-                FILE_ALTITUDE_RECORD            altitude;
-                FILE_POOL_SIZE_RECORD           pool_size;
-                FILE_WHEEL_SIZE_RECORD          wheel_size;
-                FILE_HEART_RATE_RECOVERY_RECORD heart_rate_recovery;
-                FILE_CYCLING_CADENCE_RECORD     cycling_cadence;
-            };
-        } const *record;
-    } p;
-
+    const TTBIN_TIMELINE *timeline;
+    const TTBIN_SAMPLE *sample, *end, *current;
+    TTBIN_LAP_BUILDER builder;
+    TTBIN_LAP_LIST *laps;
     TTBIN_RECORD *record;
+    unsigned count;
 
-    /* check that the file is long enough */
-    if (size < (sizeof(FILE_HEADER) - sizeof(RECORD_LENGTH)))
-        return 0;
+    free_ttbin_laps(ttbin);
 
-    if (*data++ != TAG_FILE_HEADER)
+    timeline = ttbin_timeline(ttbin);
+    if (!timeline)
         return 0;
 
-    file = calloc(1, sizeof(TTBIN_FILE));
-
-    file_version = (FILE_VERSION_HEADER*)data;
-    file->file_version = file_version->file_version;
-    data += sizeof(FILE_VERSION_HEADER);
-
-    if (file->file_version <= 9)
-    {
-        const FIRMWARE_VERSION_HEADER_09 *firmware_version = 0;
-
-        firmware_version = (FIRMWARE_VERSION_HEADER_09*)data;
-        data += sizeof(FIRMWARE_VERSION_HEADER_09);
-        memcpy(file->firmware_version, firmware_version->firmware_version, sizeof(firmware_version->firmware_version));
-    }
-    else if (file->file_version == 10) {
-        const FIRMWARE_VERSION_HEADER_10 *firmware_version = 0;
+    /* every lap, interval and length of the pool can end a lap, and the end
+       of the activity ends the last one */
+    count = ttbin->lap_records.count + ttbin->interval_finish_records.count + ttbin->swim_records.count + 1;
+    laps = malloc(SLAB_ALIGN(sizeof(TTBIN_LAP_LIST)) + count * sizeof(TTBIN_LAP_SUMMARY));
+    if (!laps)
+        return 0;
+    laps->laps = (TTBIN_LAP_SUMMARY*)((uint8_t*)laps + SLAB_ALIGN(sizeof(TTBIN_LAP_LIST)));
+    laps->count = 0;
 
-        firmware_version = (FIRMWARE_VERSION_HEADER_10*)data;
-        data += sizeof(FIRMWARE_VERSION_HEADER_10);
-        memcpy(file->firmware_version, firmware_version->firmware_version, sizeof(firmware_version->firmware_version));
-    }
-    else
+    init_lap_builder(&builder, timeline->distance_factor);
+    sample = timeline->samples;
+    end = sample + timeline->count;
+    for (record = ttbin->first; record; record = record->next)
     {
-        return 0;
+        current = 0;
+        if ((sample < end) && (sample->record == record))
+            current = sample++;
+        laps->count += ttbin_lap_builder_add(&builder, ttbin, record, current, &laps->laps[laps->count]);
     }
+    laps->count += ttbin_lap_builder_finish(&builder, ttbin, &laps->laps[laps->count]);
 
-    file_header = (FILE_HEADER*)data;
-    data += sizeof(FILE_HEADER) + (file_header->length_count - 1) * sizeof(RECORD_LENGTH);
-
-    file->product_id      = file_header->product_id;
-    file->timestamp_local = file_header->start_time;
-    file->timestamp_utc   = file_header->start_time - file_header->local_time_offset;
-    file->utc_offset      = file_header->local_time_offset;
-
-    for (p.data = data; p.data < end; p.data += length)
-    {
-        unsigned index = 0;
+    ttbin->laps = laps;
+    return 1;
+}
 
-        /* find the length of this tag */
-        while ((index < file_header->length_count) && (file_header->lengths[index].tag != p.record->tag))
-            ++index;
-        if ((index < file_header->length_count) && (file_header->lengths[index].tag == p.record->tag))
-            length = file_header->lengths[index].length;
-        else
-        {
-            free_ttbin(file);
-            return 0;
-        }
+/*****************************************************************************/
 
-        switch (p.record->tag)
-        {
-        case TAG_SUMMARY:
-            file->activity       = p.record->summary.activity;
-            file->total_distance = p.record->summary.distance;
-            file->duration       = p.record->summary.duration;
-            file->total_calories = p.record->summary.calories;
-            break;
-        case TAG_STATUS:
-            record = append_record(file, p.record->tag, length);
-            record->status.status = p.record->status.status;
-            record->status.activity = p.record->status.activity;
-            record->status.timestamp = p.record->status.timestamp - file->utc_offset;
-            append_array(&file->status_records, record);
-            break;
-        case TAG_GPS:
-            /* if the GPS signal is lost, 0xffffffff is stored in the file */
-            if (p.record->gps.timestamp == 0xffffffff)
-                break;
+void free_ttbin_laps(TTBIN_FILE *ttbin)
+{
+    free(ttbin->laps);
+    ttbin->laps = 0;
+}
 
-            record = append_record(file, p.record->tag, length);
-            record->gps.latitude      = p.record->gps.latitude / 1e7;
-            record->gps.longitude     = p.record->gps.longitude / 1e7;
-            record->gps.elevation     = NAN; /* was 0.0f */
-            record->gps.heading       = p.record->gps.heading / 100.0f;
-            record->gps.gps_speed     = p.record->gps.gps_speed;
-            record->gps.timestamp     = p.record->gps.timestamp;
-            record->gps.calories      = p.record->gps.calories;
-            record->gps.instant_speed = p.record->gps.instant_speed;
-            record->gps.cum_distance  = p.record->gps.cum_distance;
-            record->gps.cycles        = p.record->gps.cycles;
-            append_array(&file->gps_records, record);
-            break;
-        case TAG_HEART_RATE:
-            record = append_record(file, p.record->tag, length);
-            record->heart_rate.timestamp  = p.record->heart_rate.timestamp - file->utc_offset;
-            record->heart_rate.heart_rate = p.record->heart_rate.heart_rate;
-            append_array(&file->heart_rate_records, record);
-            break;
-        case TAG_LAP:
-            record = append_record(file, p.record->tag, length);
-            record->lap.total_time     = p.record->lap.total_time;
-            record->lap.total_distance = p.record->lap.total_distance;
-            record->lap.total_calories = p.record->lap.total_calories;
-            append_array(&file->lap_records, record);
-            break;
-        case TAG_CYCLING_CADENCE:
-            record = append_record(file, p.record->tag, length);
-            record->cycling_cadence.wheel_revolutions      = p.record->cycling_cadence.wheel_revolutions;
-            record->cycling_cadence.wheel_revolutions_time = p.record->cycling_cadence.wheel_revolutions_time;
-            record->cycling_cadence.crank_revolutions      = p.record->cycling_cadence.crank_revolutions;
-            record->cycling_cadence.crank_revolutions_time = p.record->cycling_cadence.crank_revolutions_time;
-            append_array(&file->cycling_cadence_records, record);
-            break;
-        case TAG_TREADMILL:
-            record = append_record(file, p.record->tag, length);
-            record->treadmill.timestamp = p.record->treadmill.timestamp - file->utc_offset;
-            record->treadmill.distance  = p.record->treadmill.distance;
-            record->treadmill.calories  = p.record->treadmill.calories;
-            record->treadmill.steps     = p.record->treadmill.steps;
-            append_array(&file->treadmill_records, record);
-            break;
-        case TAG_SWIM:
-            record = append_record(file, p.record->tag, length);
-            record->swim.timestamp      = p.record->swim.timestamp - file->utc_offset;
-            record->swim.total_distance = p.record->swim.total_distance;
-            record->swim.strokes        = p.record->swim.strokes;
-            record->swim.completed_laps = p.record->swim.completed_laps;
-            record->swim.total_calories = p.record->swim.total_calories;
-            append_array(&file->swim_records, record);
-            break;
-        case TAG_RACE_SETUP:
-            record = append_record(file, p.record->tag, length);
-            record->race_setup.distance = p.record->race_setup.distance;
-            record->race_setup.duration = p.record->race_setup.duration;
-            memcpy(record->race_setup.name, p.record->race_setup.name, sizeof(p.record->race_setup.name));
-            file->race_setup = record;
-            break;
-        case TAG_RACE_RESULT:
-            if (!file->race_setup)
-            {
-                free_ttbin(file);
-                return 0;
-            }
-            record = append_record(file, p.record->tag, length);
-            record->race_result.distance = p.record->race_result.distance;
-            record->race_result.duration = p.record->race_result.duration;
-            record->race_result.calories = p.record->race_result.calories;
-            file->race_result = record;
-            break;
-        case TAG_TRAINING_SETUP:
-            record = append_record(file, p.record->tag, length);
-            record->training_setup.type      = p.record->training_setup.type;
-            record->training_setup.value_min = p.record->training_setup.min;
-            record->training_setup.max       = p.record->training_setup.max;
-            file->training_setup = record;
-            break;
-        case TAG_GOAL_PROGRESS:
-            record = append_record(file, p.record->tag, length);
-            record->goal_progress.percent = p.record->goal_progress.percent;
-            record->goal_progress.value   = p.record->goal_progress.value;
-            append_array(&file->goal_progress_records, record);
-            break;
-        case TAG_INTERVAL_SETUP:
-            record = append_record(file, p.record->tag, length);
-            record->interval_setup.warm_type = p.record->interval_setup.warm_type;
-            record->interval_setup.warm      = p.record->interval_setup.warm;
-            record->interval_setup.work_type = p.record->interval_setup.work_type;
-            record->interval_setup.work      = p.record->interval_setup.work;
-            record->interval_setup.rest_type = p.record->interval_setup.rest_type;
-            record->interval_setup.rest      = p.record->interval_setup.rest;
-            record->interval_setup.cool_type = p.record->interval_setup.cool_type;
-            record->interval_setup.cool      = p.record->interval_setup.cool;
-            record->interval_setup.sets      = p.record->interval_setup.sets;
-            file->interval_setup = record;
-            break;
-        case TAG_INTERVAL_START:
-            record = append_record(file, p.record->tag, length);
-            record->interval_start.type = p.record->interval_start.type;
-            append_array(&file->interval_start_records, record);
-            break;
-        case TAG_INTERVAL_FINISH:
-            record = append_record(file, p.record->tag, length);
-            record->interval_finish.type           = p.record->interval_finish.type;
-            record->interval_finish.total_time     = p.record->interval_finish.total_time;
-            record->interval_finish.total_distance = p.record->interval_finish.total_distance;
-            record->interval_finish.total_calories = p.record->interval_finish.total_calories;
-            append_array(&file->interval_finish_records, record);
-            break;
-        case TAG_ALTITUDE_UPDATE:
-            record = append_record(file, p.record->tag, length);
-            record->altitude.rel_altitude = p.record->altitude.rel_altitude;
-            record->altitude.total_climb  = p.record->altitude.total_climb;
-            record->altitude.qualifier    = p.record->altitude.qualifier;
-            append_array(&file->altitude_records, record);
-            break;
-        case TAG_POOL_SIZE:
-            record = append_record(file, p.record->tag, length);
-            record->pool_size.pool_size = p.record->pool_size.pool_size;
-            file->pool_size = record;
-            break;
-        case TAG_WHEEL_SIZE:
-            record = append_record(file, p.record->tag, length);
-            record->wheel_size.wheel_size = p.record->wheel_size.wheel_size;
-            file->wheel_size = record;
-            break;
-        case TAG_HEART_RATE_RECOVERY:
-            record = append_record(file, p.record->tag, length);
-            record->heart_rate_recovery.status     = p.record->heart_rate_recovery.status;
-            record->heart_rate_recovery.heart_rate = p.record->heart_rate_recovery.heart_rate;
-            file->heart_rate_recovery = record;
-            break;
-        case TAG_GYM:
-            record = append_record(file, p.record->tag, length);
-            record->gym.timestamp = p.record->gym.timestamp;
-            record->gym.total_calories  = p.record->gym.total_calories;
-            record->gym.total_cycles    = p.record->gym.total_cycles;
-            append_array(&file->gym_records, record);
-            break;
-        case TAG_FITNESS_POINT:
-            record = append_record(file, p.record->tag, length);
-            record->fitness_point.timestamp = p.record->fitness_point.timestamp;
-            record->fitness_point.points1   = p.record->fitness_point.points1;
-            record->fitness_point.points2   = p.record->fitness_point.points2;
-            append_array(&file->fitness_point_records, record);
-            break;
-        default:
-            if (length == 0xffff)
-            {
-                length = p.data[2] * 256 + p.data[1] + 3; // 3 to skip over tag plus length
-            }
-            record = append_record(file, p.record->tag, length);
-            memcpy(record->data, p.data + 1, length - 1);
-            break;
-        }
-    }
+/*****************************************************************************/
 
-    return file;
+const TTBIN_LAP_LIST *ttbin_laps(TTBIN_FILE *ttbin)
+{
+    if (!ttbin->laps && !build_ttbin_laps(ttbin))
+        return 0;
+    return ttbin->laps;
 }
 
 /*****************************************************************************/
 
+/* the largest number of record lengths a file header can list */
+#define MAX_LENGTH_RECORDS  (256)
+
 void insert_length_record(FILE_HEADER *header, uint8_t tag, uint16_t length)
 {
     unsigned i = 0;
@@ -583,278 +2125,144 @@ void insert_length_record(FILE_HEADER *header, uint8_t tag, uint16_t length)
     /* make sure we don't insert duplicates */
     if (header->lengths[i].tag != tag)
     {
-        memmove(header->lengths + i + 1, header->lengths + i, (29 - i) * sizeof(RECORD_LENGTH));
+        memmove(header->lengths + i + 1, header->lengths + i, (MAX_LENGTH_RECORDS - 1 - i) * sizeof(RECORD_LENGTH));
         header->lengths[i].tag = tag;
         header->lengths[i].length = length;
         ++header->length_count;
     }
 }
 
-int write_ttbin_file(const TTBIN_FILE *ttbin, FILE *file)
+/*****************************************************************************/
+
+/* the number of bytes (including the tag) the record is written as */
+static size_t encoded_length(const TTBIN_RECORD *record)
 {
-    TTBIN_RECORD *record;
-    uint8_t tag = TAG_FILE_HEADER;
-    uint16_t current_version;
-    unsigned size;
-    size_t file_header_length; /* differs depending on file version */
-    FILE_HEADER *header;
-    FILE_SUMMARY_RECORD summary;
-
-    file_header_length = sizeof(FILE_HEADER) + sizeof(FILE_VERSION_HEADER) - sizeof(RECORD_LENGTH);
-
-    /* create and write the file header */
-    fwrite(&tag, 1, 1, file);
-    /* first file version */
-    current_version = ttbin->file_version;
-    fwrite(&current_version, sizeof(uint16_t), 1, file);
-    /* firmware version */
-    if (current_version <= 9) {
-        FIRMWARE_VERSION_HEADER_09 firmware_header;
-        memcpy(&firmware_header.firmware_version, ttbin->firmware_version, sizeof(firmware_header.firmware_version));
-        fwrite(&firmware_header, sizeof(firmware_header), 1, file);
-        file_header_length += sizeof(FIRMWARE_VERSION_HEADER_09);
-    } else {
-        FIRMWARE_VERSION_HEADER_10 firmware_header;
-        memcpy(&firmware_header.firmware_version, ttbin->firmware_version, sizeof(firmware_header.firmware_version));
-        fwrite(&firmware_header, sizeof(firmware_header), 1, file);
-        file_header_length += sizeof(FIRMWARE_VERSION_HEADER_10);
-    }
-    /* the rest of the common header */
-    size = sizeof(FILE_HEADER) + 29 * sizeof(RECORD_LENGTH);
-    header = (FILE_HEADER*)calloc(1, size);
+    switch (record->tag)
+    {
+#define ENCODED_LENGTH(tag, type, r, FIELDS) case tag: return 1 + sizeof(type);
+    RECORD_TYPES(ENCODED_LENGTH)
+#undef ENCODED_LENGTH
+    default: return record->length;
+    }
+}
+
+/*****************************************************************************/
+
+int serialize_ttbin(const TTBIN_FILE *ttbin, uint8_t **buf, size_t *len)
+{
+    const unsigned utc_offset = ttbin->utc_offset;
+    union
+    {
+        FILE_HEADER header;
+        uint8_t data[sizeof(FILE_HEADER) + (MAX_LENGTH_RECORDS - 1) * sizeof(RECORD_LENGTH)];
+    } h;
+    FILE_HEADER *header = &h.header;
+    const TTBIN_RECORD *record;
+    size_t firmware_length;
+    size_t header_length;
+    size_t size;
+    uint8_t *ptr;
+
+    firmware_length = (ttbin->file_version <= 9) ? sizeof(FIRMWARE_VERSION_HEADER_09) : sizeof(FIRMWARE_VERSION_HEADER_10);
+    header_length   = sizeof(FILE_VERSION_HEADER) + firmware_length + sizeof(FILE_HEADER) - sizeof(RECORD_LENGTH);
+
+    /* build the common header, and work out the exact size of the output
+       while listing the record lengths */
+    memset(&h, 0, sizeof(h));
     header->product_id = ttbin->product_id;
     header->start_time = ttbin->timestamp_local;
     header->watch_time = ttbin->timestamp_local;
     header->local_time_offset = ttbin->utc_offset;
-    insert_length_record(header, TAG_FILE_HEADER, file_header_length);
+    insert_length_record(header, TAG_FILE_HEADER, header_length);
     insert_length_record(header, TAG_SUMMARY, sizeof(FILE_SUMMARY_RECORD) + 1);
+
+    size = 1 + sizeof(FILE_SUMMARY_RECORD);
     for (record = ttbin->first; record; record = record->next)
+    {
         insert_length_record(header, record->tag, record->length);
-    fwrite(header, 1, sizeof(FILE_HEADER) + (header->length_count - 1) * sizeof(RECORD_LENGTH), file);
+        size += encoded_length(record);
+    }
+    size += 1 + header_length + header->length_count * sizeof(RECORD_LENGTH);
+
+    ptr = malloc(size);
+    if (!ptr)
+        return 0;
+    *buf = ptr;
+    *len = size;
+
+    /* the file header */
+    *ptr++ = TAG_FILE_HEADER;
+    ((FILE_VERSION_HEADER*)ptr)->file_version = ttbin->file_version;
+    ptr += sizeof(FILE_VERSION_HEADER);
+    memcpy(ptr, ttbin->firmware_version, firmware_length);
+    ptr += firmware_length;
+    memcpy(ptr, header, sizeof(FILE_HEADER) + (header->length_count - 1) * sizeof(RECORD_LENGTH));
+    ptr += sizeof(FILE_HEADER) + (header->length_count - 1) * sizeof(RECORD_LENGTH);
 
     for (record = ttbin->first; record; record = record->next)
     {
-        fwrite(&record->tag, 1, 1, file);
-        switch (record->tag)
+        *ptr++ = record->tag;
+        if (ttbin->compact_gps && (record->tag == TAG_GPS))
         {
-        case TAG_STATUS: {
-            FILE_STATUS_RECORD r = {
-                record->status.status,
-                record->status.activity,
-                record->status.timestamp + ttbin->utc_offset
-            };
-            fwrite(&r, 1, sizeof(FILE_STATUS_RECORD), file);
-            break;
-        }
-        case TAG_GPS: {
-            FILE_GPS_RECORD r = {
-                (int32_t)(record->gps.latitude * 1e7),
-                (int32_t)(record->gps.longitude * 1e7),
-                (uint16_t)(record->gps.heading * 100.0f + 0.5f),
-                record->gps.gps_speed,
-                record->gps.timestamp,
-                record->gps.calories,
-                record->gps.instant_speed,
-                record->gps.cum_distance,
-                record->gps.cycles
-            };
-            fwrite(&r, 1, sizeof(FILE_GPS_RECORD), file);
-            break;
-        }
-        case TAG_HEART_RATE: {
-            FILE_HEART_RATE_RECORD r = {
-                record->heart_rate.heart_rate,
-                0,  /* reserved */
-                record->heart_rate.timestamp + ttbin->utc_offset
-            };
-            fwrite(&r, 1, sizeof(FILE_HEART_RATE_RECORD), file);
-            break;
-        }
-        case TAG_LAP: {
-            FILE_LAP_RECORD r = {
-                record->lap.total_time,
-                record->lap.total_distance,
-                record->lap.total_calories
-            };
-            fwrite(&r, 1, sizeof(FILE_LAP_RECORD), file);
-            break;
-        }
-        case TAG_CYCLING_CADENCE: {
-            FILE_CYCLING_CADENCE_RECORD r = {
-                record->cycling_cadence.wheel_revolutions,
-                record->cycling_cadence.wheel_revolutions_time,
-                record->cycling_cadence.crank_revolutions,
-                record->cycling_cadence.crank_revolutions_time
-            };
-            fwrite(&r, 1, sizeof(FILE_CYCLING_CADENCE_RECORD), file);
-            break;
-        }
-        case TAG_TREADMILL: {
-            FILE_TREADMILL_RECORD r = {
-                record->treadmill.timestamp + ttbin->utc_offset,
-                record->treadmill.distance,
-                record->treadmill.calories,
-                record->treadmill.steps,
-                record->treadmill.step_length
-            };
-            fwrite(&r, 1, sizeof(FILE_TREADMILL_RECORD), file);
-            break;
-        }
-        case TAG_SWIM: {
-            FILE_SWIM_RECORD r = {
-                record->swim.timestamp + ttbin->utc_offset,
-                record->swim.total_distance,
-                record->swim.frequency,
-                record->swim.stroke_type,
-                record->swim.strokes,
-                record->swim.completed_laps,
-                record->swim.total_calories
-            };
-            fwrite(&r, 1, sizeof(FILE_SWIM_RECORD), file);
-            break;
-        }
-        case TAG_RACE_SETUP: {
-            FILE_RACE_SETUP_RECORD r = {
-                {0},
-                record->race_setup.distance,
-                record->race_setup.duration,
-                {0},
-            };
-            memcpy(r.race_id, record->race_setup.race_id, sizeof(r.race_id));
-            memcpy(r.name, record->race_setup.name, sizeof(r.name));
-            fwrite(&r, 1, sizeof(FILE_RACE_SETUP_RECORD), file);
-            break;
-        }
-        case TAG_RACE_RESULT: {
-            FILE_RACE_RESULT_RECORD r = {
-                record->race_result.duration,
-                record->race_result.distance,
-                record->race_result.calories
-            };
-            fwrite(&r, 1, sizeof(FILE_RACE_RESULT_RECORD), file);
-            break;
-        }
-        case TAG_TRAINING_SETUP: {
-            FILE_TRAINING_SETUP_RECORD r = {
-                record->training_setup.type,
-                record->training_setup.value_min,
-                record->training_setup.max
-            };
-            fwrite(&r, 1, sizeof(FILE_TRAINING_SETUP_RECORD), file);
-            break;
-        }
-        case TAG_GOAL_PROGRESS: {
-            FILE_GOAL_PROGRESS_RECORD r = {
-                record->goal_progress.percent,
-                record->goal_progress.value
-            };
-            fwrite(&r, 1, sizeof(FILE_GOAL_PROGRESS_RECORD), file);
-            break;
-        }
-        case TAG_INTERVAL_SETUP: {
-            FILE_INTERVAL_SETUP_RECORD r = {
-                record->interval_setup.warm_type,
-                record->interval_setup.warm,
-                record->interval_setup.work_type,
-                record->interval_setup.work,
-                record->interval_setup.rest_type,
-                record->interval_setup.rest,
-                record->interval_setup.cool_type,
-                record->interval_setup.cool,
-                record->interval_setup.sets
-            };
-            fwrite(&r, 1, sizeof(FILE_INTERVAL_SETUP_RECORD), file);
-            break;
-        }
-        case TAG_INTERVAL_START: {
-            FILE_INTERVAL_START_RECORD r = {
-                record->interval_start.type
-            };
-            fwrite(&r, 1, sizeof(FILE_INTERVAL_START_RECORD), file);
-            break;
-        }
-        case TAG_INTERVAL_FINISH: {
-            FILE_INTERVAL_FINISH_RECORD r = {
-                record->interval_finish.type,
-                record->interval_finish.total_time,
-                record->interval_finish.total_distance,
-                record->interval_finish.total_calories
-            };
-            fwrite(&r, 1, sizeof(FILE_INTERVAL_FINISH_RECORD), file);
-            break;
-        }
-        case TAG_ALTITUDE_UPDATE: {
-            FILE_ALTITUDE_RECORD r = {
-                record->altitude.rel_altitude,
-                record->altitude.total_climb,
-                record->altitude.qualifier
-            };
-            fwrite(&r, 1, sizeof(FILE_ALTITUDE_RECORD), file);
-            break;
-        }
-        case TAG_POOL_SIZE: {
-            FILE_POOL_SIZE_RECORD r = {
-                record->pool_size.pool_size
-            };
-            fwrite(&r, 1, sizeof(FILE_POOL_SIZE_RECORD), file);
-            break;
-        }
-        case TAG_WHEEL_SIZE: {
-            FILE_WHEEL_SIZE_RECORD r = {
-                record->wheel_size.wheel_size
-            };
-            fwrite(&r, 1, sizeof(FILE_WHEEL_SIZE_RECORD), file);
-            break;
-        }
-        case TAG_HEART_RATE_RECOVERY: {
-            FILE_HEART_RATE_RECOVERY_RECORD r = {
-                record->heart_rate_recovery.status,
-                record->heart_rate_recovery.heart_rate
-            };
-            fwrite(&r, 1, sizeof(FILE_HEART_RATE_RECOVERY_RECORD), file);
-            break;
-        }
-        case TAG_GYM: {
-            FILE_GYM_RECORD r = {
-                record->gym.timestamp,
-                record->gym.total_calories,
-                record->gym.total_cycles
-            };
-            fwrite(&r, 1, sizeof(FILE_GYM_RECORD), file);
-            break;
+            FILE_GPS_RECORD *out = (FILE_GPS_RECORD*)ptr;
+            COMPACT_GPS_FIELDS(ENCODE_FIELD, gps_compact)
+            ptr += sizeof(FILE_GPS_RECORD);
+            continue;
         }
-        case TAG_FITNESS_POINT: {
-            FILE_FITNESS_POINT_RECORD r = {
-                record->gym.timestamp,
-                record->fitness_point.points1,
-                record->fitness_point.points2,
-            };
-            fwrite(&r, 1, sizeof(FILE_FITNESS_POINT_RECORD), file);
-            break;
+        switch (record->tag)
+        {
+#define ENCODE_RECORD(tag, type, r, FIELDS)                 \
+        case tag: {                                         \
+            type *out = (type*)ptr;                         \
+            memset(out, 0, sizeof(type));                   \
+            FIELDS(ENCODE_FIELD, r)                         \
+            ptr += sizeof(type);                            \
+            break;                                          \
         }
-        default: {
-            fwrite(record->data, 1, record->length - 1, file);
+        RECORD_TYPES(ENCODE_RECORD)
+#undef ENCODE_RECORD
+        default:
+            memcpy(ptr, record->data, record->length - 1);
+            ptr += record->length - 1;
             break;
         }
-        }
     }
 
-    /* write the summary record */
-    summary.activity = ttbin->activity;
-    summary.distance = ttbin->total_distance;
-    summary.duration = ttbin->duration;
-    summary.calories = ttbin->total_calories;
-    tag = TAG_SUMMARY;
-    fwrite(&tag, 1, 1, file);
-    fwrite(&summary, 1, sizeof(FILE_SUMMARY_RECORD), file);
-    return 0;
+    /* the summary record */
+    *ptr++ = TAG_SUMMARY;
+    {
+        FILE_SUMMARY_RECORD *summary = (FILE_SUMMARY_RECORD*)ptr;
+        summary->activity = ttbin->activity;
+        summary->distance = ttbin->total_distance;
+        summary->duration = ttbin->duration;
+        summary->calories = ttbin->total_calories;
+    }
+    return 1;
+}
+
+/*****************************************************************************/
+
+int write_ttbin_file(const TTBIN_FILE *ttbin, FILE *file)
+{
+    uint8_t *data;
+    size_t size;
+    int result;
+
+    if (!serialize_ttbin(ttbin, &data, &size))
+        return -1;
+
+    result = (fwrite(data, 1, size, file) == size) ? 0 : -1;
+    free(data);
+    return result;
 }
 
 /*****************************************************************************/
 
 TTBIN_RECORD *insert_before(TTBIN_FILE *ttbin, TTBIN_RECORD *record)
 {
-    TTBIN_RECORD *r = (TTBIN_RECORD*)malloc(sizeof(TTBIN_RECORD));
+    TTBIN_RECORD *r = (TTBIN_RECORD*)arena_alloc(ttbin, sizeof(TTBIN_RECORD));
+    if (!r)
+        return 0;
     if (record == ttbin->first)
     {
         r->next = ttbin->first;
@@ -876,7 +2284,9 @@ TTBIN_RECORD *insert_before(TTBIN_FILE *ttbin, TTBIN_RECORD *record)
 
 TTBIN_RECORD *insert_after(TTBIN_FILE *ttbin, TTBIN_RECORD *record)
 {
-   TTBIN_RECORD *r = (TTBIN_RECORD*)malloc(sizeof(TTBIN_RECORD));
+   TTBIN_RECORD *r = (TTBIN_RECORD*)arena_alloc(ttbin, sizeof(TTBIN_RECORD));
+   if (!r)
+       return 0;
    if (record == ttbin->last)
    {
        r->next = 0;
@@ -896,25 +2306,9 @@ TTBIN_RECORD *insert_after(TTBIN_FILE *ttbin, TTBIN_RECORD *record)
 
 /*****************************************************************************/
 
-void delete_record(TTBIN_FILE *ttbin, TTBIN_RECORD *record)
+/* unlinks a record from the record list, leaving the lookup arrays alone */
+static void unlink_record(TTBIN_FILE *ttbin, TTBIN_RECORD *record)
 {
-    switch (record->tag)
-    {
-    case TAG_GPS: remove_array(&ttbin->gps_records, record); break;
-    case TAG_LAP: remove_array(&ttbin->lap_records, record); break;
-    case TAG_HEART_RATE: remove_array(&ttbin->heart_rate_records, record); break;
-    case TAG_TREADMILL: remove_array(&ttbin->treadmill_records, record); break;
-    case TAG_SWIM: remove_array(&ttbin->swim_records, record); break;
-    case TAG_STATUS: remove_array(&ttbin->status_records, record); break;
-    case TAG_GOAL_PROGRESS: remove_array(&ttbin->goal_progress_records, record); break;
-    case TAG_INTERVAL_START: remove_array(&ttbin->interval_start_records, record); break;
-    case TAG_INTERVAL_FINISH: remove_array(&ttbin->interval_finish_records, record); break;
-    case TAG_ALTITUDE_UPDATE: remove_array(&ttbin->altitude_records, record); break;
-    case TAG_GYM: remove_array(&ttbin->gym_records, record); break;
-    case TAG_FITNESS_POINT: remove_array(&ttbin->fitness_point_records, record); break;
-    case TAG_CYCLING_CADENCE: remove_array(&ttbin->cycling_cadence_records, record); break;
-    }
-
     if (record != ttbin->first)
         record->prev->next = record->next;
     else
@@ -923,7 +2317,138 @@ void delete_record(TTBIN_FILE *ttbin, TTBIN_RECORD *record)
         record->next->prev = record->prev;
     else
         ttbin->last = record->prev;
-    free(record);
+    /* the record's memory belongs to the arena, so it is reclaimed by free_ttbin */
+}
+
+/*****************************************************************************/
+
+void delete_record(TTBIN_FILE *ttbin, TTBIN_RECORD *record)
+{
+    RECORD_ARRAY *array;
+
+    /* the columns would no longer line up with the record arrays */
+    if ((record->tag == TAG_GPS) || (record->tag == TAG_HEART_RATE))
+        free_ttbin_columns(ttbin);
+    free_ttbin_time_index(ttbin);
+    free_ttbin_timeline(ttbin);
+    free_ttbin_laps(ttbin);
+
+    array = record_array(ttbin, record->tag);
+    if (array)
+        remove_array(array, record);
+
+    unlink_record(ttbin, record);
+}
+
+/*****************************************************************************/
+
+/* deletes every record after the specified one in a single pass */
+static void delete_records_after(TTBIN_FILE *ttbin, TTBIN_RECORD *end)
+{
+    TTBIN_RECORD *record;
+
+    free_ttbin_time_index(ttbin);
+    free_ttbin_timeline(ttbin);
+    free_ttbin_laps(ttbin);
+    for (record = ttbin->last; record != end; record = record->prev)
+    {
+        RECORD_ARRAY *array = record_array(ttbin, record->tag);
+        if ((record->tag == TAG_GPS) || (record->tag == TAG_HEART_RATE))
+            free_ttbin_columns(ttbin);
+        /* the arrays are in file order, so a trailing record is normally
+           the last entry of its array and can be dropped without a search */
+        if (array && array->count && (array->records[array->count - 1] == record))
+            --array->count;
+        else if (array)
+            remove_array(array, record);
+    }
+
+    end->next = 0;
+    ttbin->last = end;
+}
+
+/*****************************************************************************/
+
+struct _TTBIN_EDIT
+{
+    TTBIN_FILE *ttbin;
+    unsigned changes;
+};
+
+/*****************************************************************************/
+
+TTBIN_EDIT *ttbin_edit_begin(TTBIN_FILE *ttbin)
+{
+    TTBIN_EDIT *edit = (TTBIN_EDIT*)malloc(sizeof(TTBIN_EDIT));
+    if (!edit)
+        return 0;
+    edit->ttbin   = ttbin;
+    edit->changes = 0;
+    return edit;
+}
+
+/*****************************************************************************/
+
+TTBIN_RECORD *ttbin_edit_insert_before(TTBIN_EDIT *edit, TTBIN_RECORD *record)
+{
+    ++edit->changes;
+    return insert_before(edit->ttbin, record);
+}
+
+/*****************************************************************************/
+
+TTBIN_RECORD *ttbin_edit_insert_after(TTBIN_EDIT *edit, TTBIN_RECORD *record)
+{
+    ++edit->changes;
+    return insert_after(edit->ttbin, record);
+}
+
+/*****************************************************************************/
+
+void ttbin_edit_delete(TTBIN_EDIT *edit, TTBIN_RECORD *record)
+{
+    ++edit->changes;
+    unlink_record(edit->ttbin, record);
+}
+
+/*****************************************************************************/
+
+int ttbin_edit_commit(TTBIN_EDIT *edit)
+{
+    TTBIN_FILE *ttbin = edit->ttbin;
+    TTBIN_RECORD *record;
+    int result = 1;
+    unsigned i;
+
+    if (edit->changes)
+    {
+        free_ttbin_columns(ttbin);
+        free_ttbin_time_index(ttbin);
+        free_ttbin_timeline(ttbin);
+        free_ttbin_laps(ttbin);
+
+        /* rebuild the lookups from scratch, the arrays keep their storage so
+           this only allocates if the edit added records */
+        for (i = 0; i < 256; ++i)
+        {
+            RECORD_ARRAY *array = record_array(ttbin, i);
+            if (array)
+                array->count = 0;
+        }
+        ttbin->race_setup          = 0;
+        ttbin->race_result         = 0;
+        ttbin->training_setup      = 0;
+        ttbin->interval_setup      = 0;
+        ttbin->pool_size           = 0;
+        ttbin->wheel_size          = 0;
+        ttbin->heart_rate_recovery = 0;
+
+        for (record = ttbin->first; record && result; record = record->next)
+            result = track_record(ttbin, record);
+    }
+
+    free(edit);
+    return result;
 }
 
 /*****************************************************************************/
@@ -931,7 +2456,15 @@ void delete_record(TTBIN_FILE *ttbin, TTBIN_RECORD *record)
 const char *create_filename(TTBIN_FILE *ttbin, const char *ext)
 {
     static char filename[32];
-    struct tm *time = gmtime(&ttbin->timestamp_local);
+    return create_filename_r(ttbin, ext, filename, sizeof(filename));
+}
+
+/*****************************************************************************/
+
+const char *create_filename_r(TTBIN_FILE *ttbin, const char *ext, char *filename, size_t size)
+{
+    struct tm tm;
+    struct tm *time = gmtime_r(&ttbin->timestamp_local, &tm);
     const char *type = "Unknown";
 
     switch (ttbin->activity)
@@ -948,7 +2481,7 @@ const char *create_filename(TTBIN_FILE *ttbin, const char *ext)
     case ACTIVITY_SKIING:       type = "Skiing"; break;
     case ACTIVITY_SNOWBOARDING: type = "Snowboarding"; break;
     }
-    sprintf(filename, "%s_%02d-%02d-%02d.%s", type, time->tm_hour, time->tm_min, time->tm_sec, ext);
+    snprintf(filename, size, "%s_%02d-%02d-%02d.%s", type, time->tm_hour, time->tm_min, time->tm_sec, ext);
 
     return filename;
 }
@@ -958,6 +2491,8 @@ const char *create_filename(TTBIN_FILE *ttbin, const char *ext)
 typedef struct
 {
     TTBIN_RECORD **data;
+    GPS_COLUMNS *columns;
+    int compact;
     uint32_t max_count;
     uint32_t current_count;
 
@@ -993,7 +2528,12 @@ static size_t curl_write_data(char *ptr, size_t size, size_t nmemb, void *userda
         {
             if (info->current_count < info->max_count)
             {
-                (*info->data)->gps.elevation = info->elev;
+                if (info->compact)
+                    (*info->data)->gps_compact.elevation = info->elev;
+                else
+                    (*info->data)->gps.elevation = info->elev;
+                if (info->columns)
+                    info->columns->elevation[info->current_count] = info->elev;
                 ++info->current_count;
                 ++info->data;
             }
@@ -1026,6 +2566,9 @@ void download_elevation_data(TTBIN_FILE *ttbin)
         return;
     }
 
+    /* the timeline has copies of the elevations */
+    free_ttbin_timeline(ttbin);
+
     /* create the post string to send to the server */
     post_data = malloc(ttbin->gps_records.count * 52 + 10);
     str = post_data;
@@ -1035,14 +2578,14 @@ void download_elevation_data(TTBIN_FILE *ttbin)
         if (i != (ttbin->gps_records.count - 1))
         {
             str += sprintf(str, "   [ %f, %f ],\n",
-                ttbin->gps_records.records[i]->gps.latitude,
-                ttbin->gps_records.records[i]->gps.longitude);
+                ttbin_gps_latitude(ttbin, ttbin->gps_records.records[i]),
+                ttbin_gps_longitude(ttbin, ttbin->gps_records.records[i]));
         }
         else
         {
             str += sprintf(str, "   [ %f, %f ]\n",
-                ttbin->gps_records.records[i]->gps.latitude,
-                ttbin->gps_records.records[i]->gps.longitude);
+                ttbin_gps_latitude(ttbin, ttbin->gps_records.records[i]),
+                ttbin_gps_longitude(ttbin, ttbin->gps_records.records[i]));
         }
     }
     str += sprintf(str, "]\n");
@@ -1053,6 +2596,8 @@ void download_elevation_data(TTBIN_FILE *ttbin)
     info.mult = 1.0;
     info.elev = 0.0;
     info.data = ttbin->gps_records.records;
+    info.columns = ttbin->columns ? &ttbin->columns->gps : 0;
+    info.compact = ttbin->compact_gps;
     info.max_count = ttbin->gps_records.count;
     info.current_count = 0;
 
@@ -1081,71 +2626,68 @@ void download_elevation_data(TTBIN_FILE *ttbin)
 
 void free_ttbin(TTBIN_FILE *ttbin)
 {
-    TTBIN_RECORD *record;
+    TTBIN_SLAB *slab;
 
     if (!ttbin)
         return;
 
-    for (record = ttbin->first; record; record = record->next)
+    free_ttbin_columns(ttbin);
+    free_ttbin_time_index(ttbin);
+    free_ttbin_timeline(ttbin);
+    free_ttbin_laps(ttbin);
+    while (ttbin->slabs)
     {
-        if (record->prev)
-            free(record->prev);
-    }
-    if (ttbin->last)                            free(ttbin->last);
-    if (ttbin->gps_records.records)             free(ttbin->gps_records.records);
-    if (ttbin->status_records.records)          free(ttbin->status_records.records);
-    if (ttbin->treadmill_records.records)       free(ttbin->treadmill_records.records);
-    if (ttbin->swim_records.records)            free(ttbin->swim_records.records);
-    if (ttbin->lap_records.records)             free(ttbin->lap_records.records);
-    if (ttbin->heart_rate_records.records)      free(ttbin->heart_rate_records.records);
-    if (ttbin->goal_progress_records.records)   free(ttbin->goal_progress_records.records);
-    if (ttbin->interval_start_records.records)  free(ttbin->interval_start_records.records);
-    if (ttbin->interval_finish_records.records) free(ttbin->interval_finish_records.records);
-    if (ttbin->altitude_records.records)        free(ttbin->altitude_records.records);
-    if (ttbin->gym_records.records)             free(ttbin->gym_records.records);
-    if (ttbin->cycling_cadence_records.records) free(ttbin->cycling_cadence_records.records);
+        slab = ttbin->slabs;
+        ttbin->slabs = slab->next;
+        free(slab);
+    }
     free(ttbin);
 }
 
 /*****************************************************************************/
 
-void replace_lap_list(TTBIN_FILE *ttbin, float *distances, unsigned count)
+int replace_lap_list(TTBIN_FILE *ttbin, float *distances, unsigned count)
 {
     float end_of_lap = 0;
     float last_distance = 0;
     uint32_t i;
     unsigned d = 0;
+    TTBIN_EDIT *edit = ttbin_edit_begin(ttbin);
+    GPS_RECORD gps;
+    int result = 1;
+
+    if (!edit)
+        return 0;
 
     /* remove the current lap records */
-    if (ttbin->lap_records.count)
-    {
-        for (i = 0; i < ttbin->lap_records.count; ++i)
-            delete_record(ttbin, ttbin->lap_records.records[i]);
-        free(ttbin->lap_records.records);
-        ttbin->lap_records.records = 0;
-        ttbin->lap_records.count   = 0;
-    }
+    for (i = 0; i < ttbin->lap_records.count; ++i)
+        ttbin_edit_delete(edit, ttbin->lap_records.records[i]);
 
     /* do the check here, so that we can just remove all the laps if we want to */
     if (!distances || (count == 0))
-        return;
+        return ttbin_edit_commit(edit);
 
     end_of_lap = distances[d];
     for (i = 0; i < ttbin->gps_records.count; ++i)
     {
         TTBIN_RECORD *lap_record;
         /* skip records until we reach the desired lap distance */
-        if (ttbin->gps_records.records[i]->gps.cum_distance < end_of_lap)
+        if (ttbin_gps_cum_distance(ttbin, ttbin->gps_records.records[i]) < end_of_lap)
             continue;
+        ttbin_gps_get(ttbin, ttbin->gps_records.records[i], &gps);
 
         /* right, so we need to add a lap marker here */
-        lap_record = insert_before(ttbin, ttbin->gps_records.records[i]);
+        lap_record = ttbin_edit_insert_before(edit, ttbin->gps_records.records[i]);
+        if (!lap_record)
+        {
+            result = 0;
+            break;
+        }
         lap_record->tag = TAG_LAP;
         lap_record->length = 10;
         lap_record->lap.total_time = i;
-        lap_record->lap.total_distance = ttbin->gps_records.records[i]->gps.cum_distance;
-        lap_record->lap.total_calories = ttbin->gps_records.records[i]->gps.calories;
-        append_array(&ttbin->lap_records, lap_record);
+        lap_record->lap.total_distance = gps.cum_distance;
+        lap_record->lap.total_calories = gps.calories;
 
         /* get the next lap distance */
         if (++d >= count)
@@ -1156,6 +2698,11 @@ void replace_lap_list(TTBIN_FILE *ttbin, float *distances, unsigned count)
 
         end_of_lap = last_distance + distances[d];
     }
+
+    /* the laps that were added are still committed if some weren't */
+    if (!ttbin_edit_commit(edit))
+        result = 0;
+    return result;
 }
 
 /*****************************************************************************/
@@ -1164,6 +2711,7 @@ static void update_summary_information(TTBIN_FILE *ttbin)
 {
     unsigned i;
     TTBIN_RECORD *record;
+    GPS_RECORD gps;
     /* update the summary information from the last GPS record */
     switch (ttbin->activity)
     {
@@ -1177,13 +2725,13 @@ static void update_summary_information(TTBIN_FILE *ttbin)
         i = ttbin->gps_records.count;
         while (i > 0)
         {
-            record = ttbin->gps_records.records[--i];
-            if ((record->gps.timestamp == 0) || ((record->gps.latitude == 0) && (record->gps.longitude == 0)))
+            ttbin_gps_get(ttbin, ttbin->gps_records.records[--i], &gps);
+            if ((gps.timestamp == 0) || ((gps.latitude == 0) && (gps.longitude == 0)))
                 continue;
 
-            ttbin->total_distance = record->gps.cum_distance;
-            ttbin->total_calories = record->gps.calories;
-            ttbin->duration       = record->gps.timestamp - ttbin->timestamp_utc;
+            ttbin->total_distance = gps.cum_distance;
+            ttbin->total_calories = gps.calories;
+            ttbin->duration       = gps.timestamp - ttbin->timestamp_utc;
             break;
         }
         break;
@@ -1212,7 +2760,7 @@ static void update_summary_information(TTBIN_FILE *ttbin)
 
 int truncate_laps(TTBIN_FILE *ttbin)
 {
-    TTBIN_RECORD *record, *end;
+    TTBIN_RECORD *end;
     /* if we have no laps, we can't truncate the file */
     if (!ttbin->lap_records.count)
         return 0;
@@ -1227,13 +2775,7 @@ int truncate_laps(TTBIN_FILE *ttbin)
     }
 
     /* delete everything after this point */
-    record = ttbin->last;
-    while (record != end)
-    {
-        TTBIN_RECORD *r = record->prev;
-        delete_record(ttbin, record);
-        record = r;
-    }
+    delete_records_after(ttbin, end);
 
     update_summary_information(ttbin);
 
@@ -1244,7 +2786,7 @@ int truncate_laps(TTBIN_FILE *ttbin)
 
 int truncate_race(TTBIN_FILE *ttbin)
 {
-    TTBIN_RECORD *record, *end;
+    TTBIN_RECORD *end;
     /* if we have no race, we can't truncate the file */
     if (!ttbin->race_result)
         return 0;
@@ -1259,13 +2801,7 @@ int truncate_race(TTBIN_FILE *ttbin)
     }
 
     /* delete everything after this point */
-    record = ttbin->last;
-    while (record != end)
-    {
-        TTBIN_RECORD *r = record->prev;
-        delete_record(ttbin, record);
-        record = r;
-    }
+    delete_records_after(ttbin, end);
 
     update_summary_information(ttbin);
 
@@ -1276,7 +2812,7 @@ int truncate_race(TTBIN_FILE *ttbin)
 
 int truncate_goal(TTBIN_FILE *ttbin)
 {
-    TTBIN_RECORD *record, *end;
+    TTBIN_RECORD *end;
     int i;
     /* if we have no goal, we can't truncate the file */
     if (!ttbin->goal_progress_records.count)
@@ -1302,13 +2838,7 @@ int truncate_goal(TTBIN_FILE *ttbin)
     }
 
     /* delete everything after this point */
-    record = ttbin->last;
-    while (record != end)
-    {
-        TTBIN_RECORD *r = record->prev;
-        delete_record(ttbin, record);
-        record = r;
-    }
+    delete_records_after(ttbin, end);
 
     update_summary_information(ttbin);
 
@@ -1319,7 +2849,7 @@ int truncate_goal(TTBIN_FILE *ttbin)
 
 int truncate_intervals(TTBIN_FILE *ttbin)
 {
-    TTBIN_RECORD *record, *end;
+    TTBIN_RECORD *end;
     /* if we have no intervals, we can't truncate the file */
     if (!ttbin->interval_finish_records.count)
         return 0;
@@ -1329,18 +2859,12 @@ int truncate_intervals(TTBIN_FILE *ttbin)
     while (end->next)
     {
         end = end->next;
-        if ((end->tag == TAG_GPS) || (end->tag == TAG_SWIM) || (end->tag = TAG_TREADMILL) || (end->tag == TAG_GYM))
+        if ((end->tag == TAG_GPS) || (end->tag == TAG_SWIM) || (end->tag == TAG_TREADMILL) || (end->tag == TAG_GYM))
             break;
     }
 
     /* delete everything after this point */
-    record = ttbin->last;
-    while (record != end)
-    {
-        TTBIN_RECORD *r = record->prev;
-        delete_record(ttbin, record);
-        record = r;
-    }
+    delete_records_after(ttbin, end);
 
     update_summary_information(ttbin);
 
@@ -7,12 +7,14 @@
 #include "export.h"
 
 #include <ctype.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
-void do_replace_lap_list(TTBIN_FILE *ttbin, const char *laps)
+int do_replace_lap_list(TTBIN_FILE *ttbin, const char *laps)
 {
     float distance = 0;
     float *distances = 0;
@@ -20,6 +22,7 @@ void do_replace_lap_list(TTBIN_FILE *ttbin, const char *laps)
     char *tlaps;
     char *token;
     const char seps[] = " ,";
+    int result;
 
     tlaps = strdup(laps);
     token = strtok(tlaps, seps);
@@ -33,7 +36,9 @@ void do_replace_lap_list(TTBIN_FILE *ttbin, const char *laps)
     }
     free(tlaps);
 
-    replace_lap_list(ttbin, distances, count);
+    result = replace_lap_list(ttbin, distances, count);
+    free(distances);
+    return result;
 }
 
 char *toupper_s(const char *str)
@@ -57,6 +62,9 @@ void help(char *argv[])
     printf("  -l, --laps=[list]   Replace the laps recorded on the watch with a list of\n");
     printf("                        alternative laps.\n");
     printf("  -E, --no-elevation  Do not download elevation data.\n");
+    printf("  -s, --simplify=[m]  Simplify GPX and KML tracks, leaving out points that are\n");
+    printf("                        within about the given number of metres of the\n");
+    printf("                        track.\n");
     printf("  -a, --all           Output all supported file formats.\n");
     for (i = 0; i < OFFLINE_FORMAT_COUNT; ++i)
     {
@@ -71,7 +79,9 @@ void help(char *argv[])
     printf("\n");
     printf("If the input file is not specified, the program will operate in pipe mode,\n");
     printf("taking input from stdin, and writing the output to stdout. Only one output\n");
-    printf("format may be specified in this mode.\n");
+    printf("format may be specified in this mode. If elevation data is not downloaded and\n");
+    printf("the laps are not replaced, the output is written as the input is read.\n");
+    printf("The input may be compressed with gzip or zstd.\n");
     printf("\n");
     printf("The list of laps does not have to match the distance of the activity; it will\n");
     printf("be used multiple times. For example, \"--laps=1000\" will create a lap marker\n");
@@ -86,25 +96,26 @@ int main(int argc, char *argv[])
     int set_laps = 0;
     int download_elevation = 1;
     char *lap_definitions = 0;
-    FILE *input_file = 0;
     TTBIN_FILE *ttbin = 0;
+    FILE *output_files[OFFLINE_FORMAT_COUNT] = { 0 };
     unsigned i;
 
     int opt = 0;
     int option_index = 0;
 
     /* create the options lists */
-    #define OPTION_COUNT    (OFFLINE_FORMAT_COUNT + 5)
+    #define OPTION_COUNT    (OFFLINE_FORMAT_COUNT + 6)
     struct option long_options[OPTION_COUNT] =
     {
         { "help", no_argument, 0, 'h' },
         { "all",  no_argument, 0, 'a' },
         { "laps", required_argument, 0, 'l' },
         { "no-elevation", no_argument, 0, 'E' },
+        { "simplify", required_argument, 0, 's' },
     };
-    char short_options[OPTION_COUNT + 1] = "hl:aE";
+    char short_options[OPTION_COUNT + 2] = "hl:aEs:";
 
-    opt = 4;
+    opt = 5;
     for (i = 0; i < OFFLINE_FORMAT_COUNT; ++i)
     {
         if (OFFLINE_FORMATS[i].producer)
@@ -114,13 +125,13 @@ int main(int argc, char *argv[])
             long_options[opt].flag    = 0;
             long_options[opt].val     = OFFLINE_FORMATS[i].name[0];
 
-            short_options[opt++ + 1]  = OFFLINE_FORMATS[i].name[0];
+            short_options[opt++ + 2]  = OFFLINE_FORMATS[i].name[0];
         }
     }
     while (opt < OPTION_COUNT)
     {
         memset(&long_options[opt], 0, sizeof(struct option));
-        short_options[opt++ + 1] = 0;
+        short_options[opt++ + 2] = 0;
     }
 
     /* check the command line options */
@@ -141,6 +152,18 @@ int main(int argc, char *argv[])
         case 'E':   /* no elevation */
             download_elevation = 0;
             break;
+        case 's':   /* simplify tracks */
+            {
+                char *end;
+                double tolerance = strtod(optarg, &end);
+                if ((end == optarg) || *end || !(tolerance >= 0))
+                {
+                    fprintf(stderr, "Invalid simplification tolerance: %s\n", optarg);
+                    return 1;
+                }
+                export_set_simplify(tolerance);
+            }
+            break;
         default:
             for (i = 0; i < OFFLINE_FORMAT_COUNT; ++i)
             {
@@ -170,23 +193,39 @@ int main(int argc, char *argv[])
         return 4;
     }
 
-    /* open the input file */
+    /* with nothing to do that needs the whole file, convert it as it arrives */
+    if (pipe_mode && !download_elevation && !set_laps)
+    {
+        switch (export_stream(stdin, formats, stdout))
+        {
+        case -1:
+            fprintf(stderr, "Unable to read and parse TTBIN file\n");
+            return 5;
+        case 0:
+            for (i = 0; i < OFFLINE_FORMAT_COUNT; ++i)
+            {
+                if (formats & OFFLINE_FORMATS[i].mask)
+                    fprintf(stderr, "Unable to process output format: %s\n", OFFLINE_FORMATS[i].name);
+            }
+            break;
+        }
+        return 0;
+    }
+
+    /* read the ttbin data file, mapping it directly if it was named */
     if (!pipe_mode)
     {
-        input_file = fopen(argv[optind], "r");
-        if (!input_file)
+        int fd = open(argv[optind], O_RDONLY);
+        if (fd < 0)
         {
             fprintf(stderr, "Unable to open input file: %s\n", argv[optind]);
             return 3;
         }
+        ttbin = read_ttbin_fd(fd);
+        close(fd);
     }
     else
-        input_file = stdin;
-
-    /* read the ttbin data file */
-    ttbin = read_ttbin_file(input_file);
-    if (input_file != stdin)
-        fclose(input_file);
+        ttbin = read_ttbin_file(stdin);
     if (!ttbin)
     {
         fprintf(stderr, "Unable to read and parse TTBIN file\n");
@@ -198,10 +237,14 @@ int main(int argc, char *argv[])
         download_elevation_data(ttbin);
 
     /* set the list of laps if we have been asked to */
-    if (set_laps)
-        do_replace_lap_list(ttbin, lap_definitions);
+    if (set_laps && !do_replace_lap_list(ttbin, lap_definitions))
+    {
+        fprintf(stderr, "Unable to replace the lap list\n");
+        free_ttbin(ttbin);
+        return 6;
+    }
 
-    /* write the output files */
+    /* open the output files */
     for (i = 0; i < OFFLINE_FORMAT_COUNT; ++i)
     {
         if ((formats & OFFLINE_FORMATS[i].mask) && OFFLINE_FORMATS[i].producer)
@@ -212,27 +255,32 @@ int main(int argc, char *argv[])
                 || (OFFLINE_FORMATS[i].indoor_ok && (ttbin->activity == ACTIVITY_INDOOR || ttbin->activity == ACTIVITY_GYM))
                 )
             {
-                FILE *output_file = stdout;
+                output_files[i] = stdout;
                 if (!pipe_mode)
                 {
                     const char *filename = create_filename(ttbin, OFFLINE_FORMATS[i].name);
-                    output_file = fopen(filename, "w");
-                    if (!output_file)
+                    output_files[i] = fopen(filename, "w");
+                    if (output_files[i])
+                        setvbuf(output_files[i], 0, _IOFBF, EXPORT_BUFFER_SIZE);
+                    else
                         fprintf(stderr, "Unable to create output file: %s\n", filename);
                 }
-                if (output_file)
-                {
-                    (*OFFLINE_FORMATS[i].producer)(ttbin, output_file);
-
-                    if (output_file != stdout)
-                        fclose(output_file);
-                }
             }
             else
                 fprintf(stderr, "Unable to process output format: %s\n", OFFLINE_FORMATS[i].name);
         }
     }
 
+    /* and write them all in one pass over the file */
+    if (!export_files(ttbin, output_files))
+        fprintf(stderr, "Unable to write output files\n");
+
+    for (i = 0; i < OFFLINE_FORMAT_COUNT; ++i)
+    {
+        if (output_files[i] && (output_files[i] != stdout))
+            fclose(output_files[i]);
+    }
+
     free_ttbin(ttbin);
 
     return 0;
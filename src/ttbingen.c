@@ -0,0 +1,193 @@
+/*****************************************************************************\
+** ttbingen.c                                                                **
+** Synthetic TTBIN file generator                                            **
+\*****************************************************************************/
+
+#include "synthetic.h"
+
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*****************************************************************************/
+
+static int parse_sensors(const char *str, uint32_t *sensors)
+{
+    char *copy = strdup(str);
+    char *token;
+
+    *sensors = 0;
+    for (token = strtok(copy, ","); token; token = strtok(0, ","))
+    {
+        if (!strcasecmp(token, "hr"))
+            *sensors |= SENSOR_HEART_RATE;
+        else if (!strcasecmp(token, "cadence"))
+            *sensors |= SENSOR_CADENCE;
+        else if (!strcasecmp(token, "altitude"))
+            *sensors |= SENSOR_ALTITUDE;
+        else if (strcasecmp(token, "none"))
+        {
+            free(copy);
+            return 0;
+        }
+    }
+    free(copy);
+    return 1;
+}
+
+static int parse_laps(const char *str, SYNTHETIC_ACTIVITY *s)
+{
+    if (!strcasecmp(str, "manual"))
+    {
+        s->mode = MODE_LAPS_MANUAL;
+        return 1;
+    }
+    if (!strncasecmp(str, "time:", 5))
+        s->mode = MODE_LAPS_TIME;
+    else if (!strncasecmp(str, "distance:", 9))
+        s->mode = MODE_LAPS_DISTANCE;
+    else
+        return 0;
+    s->mode_value = atof(strchr(str, ':') + 1);
+    return s->mode_value > 0.0f;
+}
+
+static void help(char *argv[])
+{
+    printf("Usage: %s [OPTION]... [FILE]\n", argv[0]);
+    printf("Generates a synthetic, but valid, TTBIN file for benchmarking and testing.\n");
+    printf("The same options and seed always produce the same file. If FILE is not\n");
+    printf("specified, the file is written to stdout.\n");
+    printf("\n");
+    printf("Mandatory arguments to long options are mandatory for short options too.\n");
+    printf("  -h, --help                 Print this help.\n");
+    printf("  -a, --activity=[TYPE]      Activity type: running (default), cycling,\n");
+    printf("                               swimming, treadmill, freestyle, hiking or\n");
+    printf("                               trailrunning.\n");
+    printf("  -d, --duration=[HOURS]     Length of the activity (default 1).\n");
+    printf("  -r, --rate=[SECONDS]       Time between GPS/treadmill/swim samples\n");
+    printf("                               (default 1). Heart rate is always 1 Hz.\n");
+    printf("  -s, --seed=[N]             Random seed (default 1).\n");
+    printf("  -S, --sensors=[LIST]       Comma-separated list of sensors: hr, cadence,\n");
+    printf("                               altitude or none (default hr,altitude).\n");
+    printf("  -l, --laps=[MODE]          Lap mode: manual (default), time:SECONDS or\n");
+    printf("                               distance:METRES.\n");
+    printf("  -g, --goal=[METRES]        Distance goal, with progress records.\n");
+    printf("  -R, --race=[METRES]        Race against a target of the given distance.\n");
+    printf("  -i, --intervals=[LIST]     Interval training, as WARM,WORK,REST,COOL,SETS\n");
+    printf("                               with the times given in seconds.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    SYNTHETIC_ACTIVITY s = { 0, 1.0, 1, 1, SENSOR_HEART_RATE | SENSOR_ALTITUDE, MODE_LAPS_MANUAL, 0.0f, { 0 } };
+    FILE *output_file = stdout;
+    uint8_t *data;
+    size_t size;
+    int activity;
+
+    int opt = 0;
+    int option_index = 0;
+
+    const struct option long_options[] =
+    {
+        { "help",      no_argument,       0, 'h' },
+        { "activity",  required_argument, 0, 'a' },
+        { "duration",  required_argument, 0, 'd' },
+        { "rate",      required_argument, 0, 'r' },
+        { "seed",      required_argument, 0, 's' },
+        { "sensors",   required_argument, 0, 'S' },
+        { "laps",      required_argument, 0, 'l' },
+        { "goal",      required_argument, 0, 'g' },
+        { "race",      required_argument, 0, 'R' },
+        { "intervals", required_argument, 0, 'i' },
+        { 0, 0, 0, 0 }
+    };
+
+    while ((opt = getopt_long(argc, argv, "ha:d:r:s:S:l:g:R:i:", long_options, &option_index)) != -1)
+    {
+        switch (opt)
+        {
+        case 'h':   /* help */
+            help(argv);
+            return 0;
+        case 'a':   /* activity type */
+            activity = find_synthetic_activity(optarg);
+            if (activity < 0)
+            {
+                fprintf(stderr, "Unknown activity type: %s\n", optarg);
+                return 1;
+            }
+            s.activity = activity;
+            break;
+        case 'd':   /* activity duration */
+            s.hours = atof(optarg);
+            break;
+        case 'r':   /* sample rate */
+            s.rate = atoi(optarg);
+            break;
+        case 's':   /* random seed */
+            s.seed = strtoul(optarg, 0, 0);
+            break;
+        case 'S':   /* sensors */
+            if (!parse_sensors(optarg, &s.sensors))
+            {
+                fprintf(stderr, "Invalid sensor list: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'l':   /* lap mode */
+            if (!parse_laps(optarg, &s))
+            {
+                fprintf(stderr, "Invalid lap mode: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'g':   /* distance goal */
+            s.mode = MODE_GOAL_DISTANCE;
+            s.mode_value = atof(optarg);
+            break;
+        case 'R':   /* race */
+            s.mode = MODE_RACE;
+            s.mode_value = atof(optarg);
+            break;
+        case 'i':   /* intervals */
+            s.mode = MODE_INTERVALS;
+            if ((sscanf(optarg, "%u,%u,%u,%u,%u", &s.intervals[0], &s.intervals[1],
+                    &s.intervals[2], &s.intervals[3], &s.intervals[4]) != 5) || !s.intervals[4])
+            {
+                fprintf(stderr, "Invalid interval definition: %s\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            help(argv);
+            return 1;
+        }
+    }
+
+    if ((s.hours <= 0) || (s.hours > 48) || (s.rate == 0) ||
+        (((s.mode == MODE_GOAL_DISTANCE) || (s.mode == MODE_RACE)) && (s.mode_value <= 0.0f)))
+    {
+        help(argv);
+        return 1;
+    }
+
+    if (optind < argc)
+    {
+        output_file = fopen(argv[optind], "w");
+        if (!output_file)
+        {
+            fprintf(stderr, "Unable to open output file: %s\n", argv[optind]);
+            return 1;
+        }
+    }
+
+    data = generate_ttbin(&s, &size);
+    fwrite(data, 1, size, output_file);
+    if (output_file != stdout)
+        fclose(output_file);
+
+    free(data);
+    return 0;
+}
@@ -6,10 +6,12 @@
 #include "ttbin.h"
 
 #include <ctype.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #define TRUNCATE_AUTO       (0)
 #define TRUNCATE_LAPS       (1)
@@ -17,7 +19,7 @@
 #define TRUNCATE_GOAL       (3)
 #define TRUNCATE_INTERVAL   (4)
 
-void do_replace_lap_list(TTBIN_FILE *ttbin, const char *laps)
+int do_replace_lap_list(TTBIN_FILE *ttbin, const char *laps)
 {
     float distance = 0;
     float *distances = 0;
@@ -25,6 +27,7 @@ void do_replace_lap_list(TTBIN_FILE *ttbin, const char *laps)
     char *tlaps;
     char *token;
     const char seps[] = " ,";
+    int result;
 
     tlaps = strdup(laps);
     token = strtok(tlaps, seps);
@@ -38,7 +41,9 @@ void do_replace_lap_list(TTBIN_FILE *ttbin, const char *laps)
     }
     free(tlaps);
 
-    replace_lap_list(ttbin, distances, count);
+    result = replace_lap_list(ttbin, distances, count);
+    free(distances);
+    return result;
 }
 
 char *toupper_s(const char *str)
@@ -64,6 +69,7 @@ void help(char *argv[])
     printf("  -t, --truncate=[MODE] Truncate the output file.\n");
     printf("\n");
     printf("If the input file is not specified, the program will read from stdin.\n");
+    printf("The input may be compressed with gzip or zstd.\n");
     printf("If the output file is not specified, the program will write to stdout.\n");
     printf("\n");
     printf("The list of laps does not have to match the distance of the activity; it will\n");
@@ -86,11 +92,13 @@ int main(int argc, char *argv[])
 {
     int set_laps = 0;
     char *lap_definitions = 0;
-    FILE *input_file = stdin;
     FILE *output_file = stdout;
     TTBIN_FILE *ttbin = 0;
     int truncate = 0;
     int truncate_mode = TRUNCATE_AUTO;
+    uint8_t *data;
+    size_t size, offset;
+    ssize_t written = 0;
 
     int opt = 0;
     int option_index = 0;
@@ -153,21 +161,20 @@ int main(int argc, char *argv[])
         }
     }
 
-    /* open the input file if one was specified */
+    /* read the ttbin data file, mapping it directly if one was specified */
     if (optind < argc)
     {
-        input_file = fopen(argv[optind], "r");
-        if (!input_file)
+        int fd = open(argv[optind], O_RDONLY);
+        if (fd < 0)
         {
             fprintf(stderr, "Unable to open input file: %s\n", argv[optind]);
             return 1;
         }
+        ttbin = read_ttbin_fd(fd);
+        close(fd);
     }
-
-    /* read the ttbin data file */
-    ttbin = read_ttbin_file(input_file);
-    if (input_file != stdin)
-        fclose(input_file);
+    else
+        ttbin = read_ttbin_file(stdin);
     if (!ttbin)
     {
         fprintf(stderr, "Unable to read and parse TTBIN file\n");
@@ -175,8 +182,12 @@ int main(int argc, char *argv[])
     }
 
     /* set the list of laps if we have been asked to */
-    if (set_laps)
-        do_replace_lap_list(ttbin, lap_definitions);
+    if (set_laps && !do_replace_lap_list(ttbin, lap_definitions))
+    {
+        fprintf(stderr, "Unable to replace the lap list\n");
+        free_ttbin(ttbin);
+        return 1;
+    }
 
     /* truncate the file if we have been asked to */
     if (truncate)
@@ -192,13 +203,29 @@ int main(int argc, char *argv[])
         }
     }
 
-    /* write the output file */
-    write_ttbin_file(ttbin, output_file);
+    /* write the output file with as few system calls as possible */
+    if (!serialize_ttbin(ttbin, &data, &size))
+    {
+        fprintf(stderr, "Unable to create TTBIN file\n");
+        free_ttbin(ttbin);
+        return 1;
+    }
+    free_ttbin(ttbin);
+
+    fflush(output_file);
+    for (offset = 0; offset < size; offset += written)
+    {
+        written = write(fileno(output_file), data + offset, size - offset);
+        if (written <= 0)
+        {
+            fprintf(stderr, "Unable to write output file\n");
+            break;
+        }
+    }
     if (output_file != stdout)
         fclose(output_file);
 
-    free_ttbin(ttbin);
-
-    return 0;
+    free(data);
+    return (offset < size) ? 1 : 0;
 }
 